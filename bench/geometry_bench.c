@@ -0,0 +1,155 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../src/allocwrap.h"
+#include "../src/fat12.h"
+#include "../src/fat12_geometry.h"
+
+// Compares the geometry specialized routines against the generic fallback on an in memory
+// 1.44 MB floppy layout, nothing is read from disk.
+
+#define CHAIN_ITERATIONS 20000
+#define OFFSET_ITERATIONS 20000
+#define DIRECTORY_ITERATIONS 200000
+// Every measurement is repeated and the fastest round is reported to filter out noise:
+#define BENCH_ROUNDS 5
+
+static uint64_t nowNanoseconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void initFloppyHeader(FAT12Header* header) {
+	memset(header, 0, sizeof(FAT12Header));
+	header->bytesPerSector = 512;
+	header->sectorsPerCluster = 1;
+	header->reservedSectorCount = 1;
+	header->tableCount = 2;
+	header->rootEntryCount = 224;
+	header->totalSectors16 = 2880;
+	header->tableSize16 = 9;
+}
+
+/** Links every data cluster into a single chain visiting them in a shuffled order. */
+static uint16_t buildShuffledChain(uint8_t* fat, const FAT12Info* fat12Info) {
+	uint32_t clusterCount = fat12Info->clusterCount;
+	uint16_t* order = xmalloc(clusterCount * sizeof(uint16_t));
+	for (uint32_t i = 0; i < clusterCount; i++) {
+		order[i] = i + 2;
+	}
+	srand(1);
+	for (uint32_t i = clusterCount - 1; i > 0; i--) {
+		uint32_t j = rand() % (i + 1);
+		uint16_t temp = order[i];
+		order[i] = order[j];
+		order[j] = temp;
+	}
+	for (uint32_t i = 0; i + 1 < clusterCount; i++) {
+		setNextClusterId(order[i], order[i + 1], fat);
+	}
+	setNextClusterId(order[clusterCount - 1], FAT_LAST_CLUSTER_NUM, fat);
+
+	uint16_t firstClusterId = order[0];
+	free(order);
+	return firstClusterId;
+}
+
+static double benchChainWalk(const FAT12GeometryOps* ops, uint64_t* offsets,
+							 uint16_t firstClusterId, const uint8_t* fat,
+							 const FAT12Info* fat12Info) {
+	uint64_t start = nowNanoseconds();
+	uint64_t walked = 0;
+	for (uint32_t i = 0; i < CHAIN_ITERATIONS; i++) {
+		walked += ops->walkClusterChain(offsets, fat12Info->clusterCount, firstClusterId, fat,
+										fat12Info);
+	}
+	return (double)(nowNanoseconds() - start) / walked;
+}
+
+static double benchClusterOffset(const FAT12GeometryOps* ops, const FAT12Info* fat12Info,
+								 uint64_t* checksum) {
+	uint64_t start = nowNanoseconds();
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < OFFSET_ITERATIONS; i++) {
+		for (uint32_t clusterId = 2; clusterId < fat12Info->clusterCount + 2; clusterId++) {
+			sum += ops->clusterDeviceOffset(clusterId, fat12Info);
+		}
+	}
+	*checksum += sum;
+	return (double)(nowNanoseconds() - start) /
+		   ((uint64_t)OFFSET_ITERATIONS * fat12Info->clusterCount);
+}
+
+static double benchDirectoryScan(const FAT12GeometryOps* ops,
+								 const FAT12DirectoryEntry* dirEntries, const FAT12Info* fat12Info,
+								 uint64_t* checksum) {
+	uint64_t start = nowNanoseconds();
+	uint64_t sum = 0;
+	for (uint32_t i = 0; i < DIRECTORY_ITERATIONS; i++) {
+		sum += ops->countDirectoryEntries(dirEntries, fat12Info->rootDirSectorsSize, fat12Info);
+	}
+	*checksum += sum;
+	return (double)(nowNanoseconds() - start) /
+		   ((uint64_t)DIRECTORY_ITERATIONS * fat12Info->rootDirSectorsSize);
+}
+
+int main(void) {
+	FAT12Header header;
+	FAT12Info fat12Info;
+	initFloppyHeader(&header);
+	loadFat12Info(&fat12Info, &header);
+
+	uint8_t* fat = calloc(fat12Info.fatSectorSize, fat12Info.bytesPerSector);
+	if (fat == NULL) {
+		perror("");
+		exit(-1);
+	}
+	uint16_t firstClusterId = buildShuffledChain(fat, &fat12Info);
+	uint64_t* offsets = xmalloc(fat12Info.clusterCount * sizeof(uint64_t));
+
+	uint32_t rootEntriesCount = fat12Info.rootDirSectorsSize * fat12Info.bytesPerSector /
+								sizeof(FAT12DirectoryEntry);
+	FAT12DirectoryEntry* rootEntries = calloc(rootEntriesCount, sizeof(FAT12DirectoryEntry));
+	if (rootEntries == NULL) {
+		perror("");
+		exit(-1);
+	}
+	for (uint32_t i = 0; i < rootEntriesCount; i++) {
+		memcpy(rootEntries[i].fileName, "FILE    TXT", sizeof(rootEntries[i].fileName));
+		if (i % 7 == 0) {
+			rootEntries[i].fileName[0] = (char)DELETED_ENTRY;
+		}
+	}
+
+	const FAT12GeometryOps* variants[] = {getGenericGeometryOps(), fat12Info.geometry};
+	uint64_t checksum = 0;
+	printf("geometry: %u bytes per sector, %u sectors per cluster, %u clusters\n",
+		   fat12Info.bytesPerSector, fat12Info.sectorsPerCluster, fat12Info.clusterCount);
+	printf("%-10s %18s %18s %18s\n", "variant", "offset ns/cluster", "chain ns/cluster",
+		   "dirscan ns/sector");
+	for (uint32_t i = 0; i < sizeof(variants) / sizeof(variants[0]); i++) {
+		double offsetTime = INFINITY;
+		double chainTime = INFINITY;
+		double scanTime = INFINITY;
+		for (uint32_t round = 0; round < BENCH_ROUNDS; round++) {
+			offsetTime = fmin(offsetTime, benchClusterOffset(variants[i], &fat12Info, &checksum));
+			chainTime = fmin(chainTime,
+							 benchChainWalk(variants[i], offsets, firstClusterId, fat, &fat12Info));
+			checksum += offsets[fat12Info.clusterCount - 1];
+			scanTime =
+				fmin(scanTime, benchDirectoryScan(variants[i], rootEntries, &fat12Info, &checksum));
+		}
+		printf("%-10s %18.3f %18.3f %18.3f\n", variants[i]->name, offsetTime, chainTime, scanTime);
+	}
+	printf("checksum: %lu\n", checksum);
+
+	free(rootEntries);
+	free(offsets);
+	free(fat);
+	return 0;
+}
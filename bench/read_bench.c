@@ -0,0 +1,157 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/allocwrap.h"
+#include "../src/fat12.h"
+
+// Compares getFileContentWithFat, which reads runs of contiguous clusters with a single pread,
+// against the per cluster readCluster loop it replaced. The image is a 1.44 MB floppy written to a
+// temporary file, so the page cache serves every read and the difference is the syscall and copy
+// overhead per cluster.
+
+#define READ_ITERATIONS 200
+// Every measurement is repeated and the fastest round is reported to filter out noise:
+#define BENCH_ROUNDS 5
+
+static uint64_t nowNanoseconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+static void initFloppyHeader(FAT12Header* header) {
+	memset(header, 0, sizeof(FAT12Header));
+	header->bytesPerSector = 512;
+	header->sectorsPerCluster = 1;
+	header->reservedSectorCount = 1;
+	header->tableCount = 2;
+	header->rootEntryCount = 224;
+	header->totalSectors16 = 2880;
+	header->tableSize16 = 9;
+}
+
+/** Links every data cluster into a single chain, in ascending order or shuffled. */
+static uint16_t buildChain(uint8_t* fat, const FAT12Info* fat12Info, bool isShuffled) {
+	uint32_t clusterCount = fat12Info->clusterCount;
+	uint16_t* order = xmalloc(clusterCount * sizeof(uint16_t));
+	for (uint32_t i = 0; i < clusterCount; i++) {
+		order[i] = i + 2;
+	}
+	srand(1);
+	for (uint32_t i = clusterCount - 1; isShuffled && i > 0; i--) {
+		uint32_t j = rand() % (i + 1);
+		uint16_t temp = order[i];
+		order[i] = order[j];
+		order[j] = temp;
+	}
+	for (uint32_t i = 0; i + 1 < clusterCount; i++) {
+		setNextClusterId(order[i], order[i + 1], fat);
+	}
+	setNextClusterId(order[clusterCount - 1], FAT_LAST_CLUSTER_NUM, fat);
+
+	uint16_t firstClusterId = order[0];
+	free(order);
+	return firstClusterId;
+}
+
+/** The read loop getFileContentWithFat used before runs were coalesced. */
+static uint32_t readFilePerCluster(uint8_t** fileContent, uint16_t firstClusterId,
+								   const uint8_t* fat, FAT12Info* fat12Info,
+								   const char* imagePath) {
+	const uint32_t BYTES_PER_CLUSTER = fat12Info->bytesPerSector * fat12Info->sectorsPerCluster;
+
+	uint32_t fileClusterCount = countFileClusters(firstClusterId, fat);
+	*fileContent = xmalloc((uint64_t)fileClusterCount * BYTES_PER_CLUSTER);
+	uint8_t* currFileContentPtr = *fileContent;
+
+	uint16_t currClusterId = firstClusterId;
+	char* clusterData;
+	for (uint32_t i = 0; i < fileClusterCount; i++) {
+		readCluster(&clusterData, currClusterId, fat12Info, imagePath);
+		memcpy(currFileContentPtr, clusterData, BYTES_PER_CLUSTER);
+		free(clusterData);
+
+		currFileContentPtr += BYTES_PER_CLUSTER;
+		currClusterId = getNextClusterId(currClusterId, fat);
+	}
+	return fileClusterCount * BYTES_PER_CLUSTER;
+}
+
+static double benchRead(bool isCoalesced, FAT12DirectoryEntry* entry, const uint8_t* fat,
+						FAT12Info* fat12Info, const char* imagePath, uint64_t* checksum) {
+	uint64_t start = nowNanoseconds();
+	uint64_t clusters = 0;
+	for (uint32_t i = 0; i < READ_ITERATIONS; i++) {
+		uint8_t* content;
+		uint32_t bytes;
+		if (isCoalesced) {
+			bytes = getFileContentWithFat(&content, entry, fat, fat12Info, imagePath);
+		} else {
+			bytes = readFilePerCluster(&content, entry->firstClusterId, fat, fat12Info, imagePath);
+		}
+		*checksum += content[bytes - 1];
+		clusters += bytes / fat12Info->bytesPerSector / fat12Info->sectorsPerCluster;
+		free(content);
+	}
+	return (double)(nowNanoseconds() - start) / clusters;
+}
+
+int main(void) {
+	FAT12Header header;
+	FAT12Info fat12Info;
+	initFloppyHeader(&header);
+	loadFat12Info(&fat12Info, &header);
+
+	char imagePath[] = "/tmp/read_bench_XXXXXX";
+	int imageFileDescriptor = mkstemp(imagePath);
+	if (imageFileDescriptor == -1) {
+		perror("Failed to create the bench image");
+		return -1;
+	}
+	uint64_t imageBytes = (uint64_t)fat12Info.totalSectors * fat12Info.bytesPerSector;
+	uint8_t* image = xmalloc(imageBytes);
+	for (uint64_t i = 0; i < imageBytes; i++) {
+		image[i] = (uint8_t)(i * 31);
+	}
+	pwriteDevice(image, imageBytes, 0, imageFileDescriptor);
+	close(imageFileDescriptor);
+	free(image);
+
+	uint8_t* fat = calloc(fat12Info.fatSectorSize, fat12Info.bytesPerSector);
+	if (fat == NULL) {
+		perror("");
+		exit(-1);
+	}
+	FAT12DirectoryEntry entry;
+	memset(&entry, 0, sizeof(entry));
+	entry.fileSizeInBytes = fat12Info.clusterCount * fat12Info.bytesPerSector *
+							fat12Info.sectorsPerCluster;
+
+	uint64_t checksum = 0;
+	printf("geometry: %u bytes per sector, %u sectors per cluster, %u clusters\n",
+		   fat12Info.bytesPerSector, fat12Info.sectorsPerCluster, fat12Info.clusterCount);
+	printf("%-12s %20s %20s\n", "layout", "per cluster ns/clus", "coalesced ns/clus");
+	const char* layouts[] = {"contiguous", "shuffled"};
+	for (uint32_t layout = 0; layout < 2; layout++) {
+		entry.firstClusterId = buildChain(fat, &fat12Info, layout == 1);
+		double perClusterTime = INFINITY;
+		double coalescedTime = INFINITY;
+		for (uint32_t round = 0; round < BENCH_ROUNDS; round++) {
+			perClusterTime = fmin(perClusterTime, benchRead(false, &entry, fat, &fat12Info,
+															imagePath, &checksum));
+			coalescedTime = fmin(coalescedTime,
+								 benchRead(true, &entry, fat, &fat12Info, imagePath, &checksum));
+		}
+		printf("%-12s %20.3f %20.3f\n", layouts[layout], perClusterTime, coalescedTime);
+	}
+	printf("checksum: %lu\n", checksum);
+
+	unlink(imagePath);
+	free(fat);
+	return 0;
+}
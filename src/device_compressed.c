@@ -0,0 +1,510 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "allocwrap.h"
+#include "device_compressed.h"
+
+#define COMPRESSED_INDEX_MAGIC "FAT12GZI"
+#define COMPRESSED_INDEX_VERSION 3
+#define COMPRESSED_INPUT_BYTES (16 * 1024)
+// windowBits of inflateInit2, 15 with 32 added accepts gzip and zlib headers, negative means raw:
+#define INFLATE_AUTO_HEADER_WINDOW_BITS (15 + 32)
+#define INFLATE_RAW_WINDOW_BITS -15
+// inflate with Z_BLOCK reports the end of a deflate block in data_type:
+#define INFLATE_BLOCK_END_FLAG 128
+#define INFLATE_LAST_BLOCK_FLAG 64
+#define INFLATE_UNUSED_BITS_MASK 7
+
+/** Where decompression can start without anything before it. */
+typedef struct CompressedSeekPoint {
+	uint64_t uncompressedOffset;
+	uint64_t compressedOffset;	// First full byte of the block, see bits
+	uint32_t bits;	// Bits of the block in the byte before compressedOffset, 0 when byte aligned
+	uint32_t windowBytes;
+	// The COMPRESSED_WINDOW_BYTES of history before the point, zlib compressed:
+	uint8_t* window;
+} CompressedSeekPoint;
+
+/** A seek point in the index file, followed by windowBytes of compressed window. */
+typedef struct CompressedSeekPointRecord {
+	uint64_t uncompressedOffset;
+	uint64_t compressedOffset;
+	uint32_t bits;
+	uint32_t windowBytes;
+} __attribute__((packed)) CompressedSeekPointRecord;
+
+typedef struct CompressedIndexHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t span;
+	// Identify the image version the index was built from:
+	uint64_t compressedBytes;
+	int64_t modifiedSeconds;
+	int64_t modifiedNanoseconds;
+	uint64_t uncompressedBytes;
+	uint32_t pointCount;
+} __attribute__((packed)) CompressedIndexHeader;
+
+typedef struct CompressedSpan {
+	uint32_t pointIndex;
+	uint64_t lastUse;
+	uint64_t bytes;
+	uint8_t* data;	// NULL while the slot is unused
+} CompressedSpan;
+
+typedef struct CompressedDevice {
+	char* path;
+	int fileDescriptor;
+	uint64_t uncompressedBytes;
+	CompressedSeekPoint* points;
+	uint32_t pointCount;
+
+	pthread_mutex_t cacheMutex;
+	CompressedSpan cache[COMPRESSED_CACHE_SPANS];
+	uint64_t useCounter;
+} CompressedDevice;
+
+static pthread_mutex_t devicesMutex = PTHREAD_MUTEX_INITIALIZER;
+static CompressedDevice devices[COMPRESSED_MAX_DEVICES];
+static uint32_t devicesCount;
+
+bool isCompressedDevicePath(const char* devicePath) {
+	const char SUFFIX[] = ".gz";
+	uint64_t length = strlen(devicePath);
+	return length > strlen(SUFFIX) && strcmp(devicePath + length - strlen(SUFFIX), SUFFIX) == 0;
+}
+
+static void failCompressedDevice(const CompressedDevice* device, const char* reason) {
+	(void)fprintf(stderr, "Compressed image %s: %s\n", device->path, reason);
+	exit(-1);
+}
+
+/** @return Bytes read, less than readBytes only at the end of the file. */
+static uint64_t preadCompressed(const CompressedDevice* device, uint8_t* buffer, uint64_t readBytes,
+								uint64_t offset) {
+	uint64_t totalRead = 0;
+	while (totalRead < readBytes) {
+		ssize_t bytesRead = pread(device->fileDescriptor, buffer + totalRead, readBytes - totalRead,
+								  (off_t)(offset + totalRead));
+		if (bytesRead == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytesRead == -1) {
+			perror("File failed to be read");
+			exit(-1);
+		}
+		if (bytesRead == 0) {
+			break;
+		}
+		totalRead += bytesRead;
+	}
+	return totalRead;
+}
+
+/** Compresses the window of a seek point, the history is image data and compresses as well as the
+ * image does, storing it raw would make the index half the size of the decompressed image.
+ * @param[in] history The window in order, oldest byte first.
+ */
+static void compressSeekPointWindow(const CompressedDevice* device, CompressedSeekPoint* point,
+									const uint8_t* history) {
+	uLongf windowBytes = compressBound(COMPRESSED_WINDOW_BYTES);
+	point->window = xmalloc(windowBytes);
+	if (compress2(point->window, &windowBytes, history, COMPRESSED_WINDOW_BYTES,
+				  Z_BEST_COMPRESSION) != Z_OK) {
+		failCompressedDevice(device, "failed to compress a seek point window");
+	}
+	point->window = xrealloc(point->window, windowBytes);
+	point->windowBytes = windowBytes;
+}
+
+/** @param[out] history Receives the COMPRESSED_WINDOW_BYTES of history before the point. */
+static void decompressSeekPointWindow(const CompressedDevice* device,
+									  const CompressedSeekPoint* point, uint8_t* history) {
+	uLongf historyBytes = COMPRESSED_WINDOW_BYTES;
+	if (uncompress(history, &historyBytes, point->window, point->windowBytes) != Z_OK ||
+		historyBytes != COMPRESSED_WINDOW_BYTES) {
+		failCompressedDevice(device, "corrupted seek point window, delete its index and retry");
+	}
+}
+
+static void freeSeekPoints(CompressedDevice* device) {
+	for (uint32_t i = 0; i < device->pointCount; i++) {
+		free(device->points[i].window);
+	}
+	free(device->points);
+	device->points = NULL;
+	device->pointCount = 0;
+}
+
+static void addSeekPoint(CompressedDevice* device, uint32_t* capacity, uint32_t bits,
+						 uint64_t compressedOffset, uint64_t uncompressedOffset,
+						 const uint8_t* window, uint32_t windowLeft, uint8_t* history) {
+	if (device->pointCount == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 16;
+		device->points = xrealloc(device->points, *capacity * sizeof(CompressedSeekPoint));
+	}
+	CompressedSeekPoint* point = &device->points[device->pointCount];
+	point->bits = bits;
+	point->compressedOffset = compressedOffset;
+	point->uncompressedOffset = uncompressedOffset;
+	// The output window is circular, the oldest history starts where the next output goes:
+	memcpy(history, window + COMPRESSED_WINDOW_BYTES - windowLeft, windowLeft);
+	memcpy(history + windowLeft, window, COMPRESSED_WINDOW_BYTES - windowLeft);
+	compressSeekPointWindow(device, point, history);
+	device->pointCount++;
+}
+
+/** @return Uncompressed bytes the span starting after the last seek point must reach. */
+static uint64_t getMinimumSpanBytes(const CompressedDevice* device) {
+	uint64_t windowSpanBytes =
+		(uint64_t)device->points[device->pointCount - 1].windowBytes * COMPRESSED_SPAN_WINDOW_RATIO;
+	return windowSpanBytes > COMPRESSED_INDEX_SPAN ? windowSpanBytes : COMPRESSED_INDEX_SPAN;
+}
+
+/** Decompresses the whole image once, adding a seek point at the first deflate block boundary
+ * after every span, see getMinimumSpanBytes. */
+static void buildCompressedIndex(CompressedDevice* device) {
+	z_stream stream = {0};
+	if (inflateInit2(&stream, INFLATE_AUTO_HEADER_WINDOW_BITS) != Z_OK) {
+		failCompressedDevice(device, "failed to initialize zlib");
+	}
+
+	uint8_t* input = xmalloc(COMPRESSED_INPUT_BYTES);
+	uint8_t* window = calloc(1, COMPRESSED_WINDOW_BYTES);
+	if (!window) {
+		perror("");
+		exit(-1);
+	}
+	uint8_t* history = xmalloc(COMPRESSED_WINDOW_BYTES);
+	uint32_t capacity = 0;
+	uint64_t compressedOffset = 0;
+	uint64_t totalIn = 0;
+	uint64_t totalOut = 0;
+	uint64_t lastPointOut = 0;
+	int result = Z_OK;
+	stream.avail_out = 0;
+	while (result != Z_STREAM_END) {
+		stream.avail_in = preadCompressed(device, input, COMPRESSED_INPUT_BYTES, compressedOffset);
+		stream.next_in = input;
+		compressedOffset += stream.avail_in;
+		if (stream.avail_in == 0) {
+			failCompressedDevice(device, "unexpected end of the gzip stream");
+		}
+
+		while (stream.avail_in != 0) {
+			if (stream.avail_out == 0) {
+				stream.avail_out = COMPRESSED_WINDOW_BYTES;
+				stream.next_out = window;
+			}
+			totalIn += stream.avail_in;
+			totalOut += stream.avail_out;
+			result = inflate(&stream, Z_BLOCK);
+			totalIn -= stream.avail_in;
+			totalOut -= stream.avail_out;
+			if (result == Z_NEED_DICT || result == Z_DATA_ERROR || result == Z_MEM_ERROR) {
+				failCompressedDevice(device, "corrupted gzip stream");
+			}
+			if (result == Z_STREAM_END) {
+				break;
+			}
+
+			bool isBlockEnd = (stream.data_type & INFLATE_BLOCK_END_FLAG) &&
+							  !(stream.data_type & INFLATE_LAST_BLOCK_FLAG);
+			if (isBlockEnd &&
+				(totalOut == 0 || totalOut - lastPointOut > getMinimumSpanBytes(device))) {
+				addSeekPoint(device, &capacity, stream.data_type & INFLATE_UNUSED_BITS_MASK,
+							 totalIn, totalOut, window, stream.avail_out, history);
+				lastPointOut = totalOut;
+			}
+		}
+	}
+
+	// gzip allows concatenated members, the seek points only cover the first one:
+	uint8_t trailingByte;
+	if (stream.avail_in != 0 || preadCompressed(device, &trailingByte, 1, compressedOffset) != 0) {
+		failCompressedDevice(device, "data after the first gzip member, multi member images are "
+									 "not supported");
+	}
+
+	device->uncompressedBytes = totalOut;
+	inflateEnd(&stream);
+	free(input);
+	free(window);
+	free(history);
+}
+
+static char* getIndexPath(const char* devicePath) {
+	char* indexPath = xmalloc(strlen(devicePath) + strlen(COMPRESSED_INDEX_SUFFIX) + 1);
+	strcpy(indexPath, devicePath);
+	strcat(indexPath, COMPRESSED_INDEX_SUFFIX);
+	return indexPath;
+}
+
+static void initIndexHeader(CompressedIndexHeader* header, const CompressedDevice* device,
+							const struct stat* imageStat) {
+	memset(header, 0, sizeof(CompressedIndexHeader));
+	memcpy(header->magic, COMPRESSED_INDEX_MAGIC, sizeof(header->magic));
+	header->version = COMPRESSED_INDEX_VERSION;
+	header->span = COMPRESSED_INDEX_SPAN;
+	header->compressedBytes = imageStat->st_size;
+	header->modifiedSeconds = imageStat->st_mtim.tv_sec;
+	header->modifiedNanoseconds = imageStat->st_mtim.tv_nsec;
+	header->uncompressedBytes = device->uncompressedBytes;
+	header->pointCount = device->pointCount;
+}
+
+/** @return false when there is no index or it was built from another version of the image. */
+static bool loadCompressedIndex(CompressedDevice* device, const struct stat* imageStat) {
+	char* indexPath = getIndexPath(device->path);
+	FILE* indexFile = fopen(indexPath, "rb");
+	free(indexPath);
+	if (!indexFile) {
+		return false;
+	}
+
+	CompressedIndexHeader header;
+	CompressedIndexHeader expected;
+	bool isLoaded = fread(&header, sizeof(header), 1, indexFile) == 1;
+	// The counts are only known after loading, they are taken from the header itself:
+	device->uncompressedBytes = header.uncompressedBytes;
+	device->pointCount = header.pointCount;
+	initIndexHeader(&expected, device, imageStat);
+	isLoaded = isLoaded && memcmp(&header, &expected, sizeof(header)) == 0 && header.pointCount;
+	// Counts the points whose window is allocated, so a partial load can be freed:
+	device->pointCount = 0;
+	if (isLoaded) {
+		device->points = xmalloc(header.pointCount * sizeof(CompressedSeekPoint));
+	}
+	while (isLoaded && device->pointCount < header.pointCount) {
+		CompressedSeekPointRecord record;
+		isLoaded = fread(&record, sizeof(record), 1, indexFile) == 1 &&
+				   record.windowBytes <= compressBound(COMPRESSED_WINDOW_BYTES);
+		if (!isLoaded) {
+			break;
+		}
+		CompressedSeekPoint* point = &device->points[device->pointCount];
+		point->uncompressedOffset = record.uncompressedOffset;
+		point->compressedOffset = record.compressedOffset;
+		point->bits = record.bits;
+		point->windowBytes = record.windowBytes;
+		point->window = xmalloc(record.windowBytes ? record.windowBytes : 1);
+		device->pointCount++;
+		isLoaded = fread(point->window, 1, record.windowBytes, indexFile) == record.windowBytes;
+	}
+
+	(void)fclose(indexFile);
+	if (!isLoaded) {
+		freeSeekPoints(device);
+		device->uncompressedBytes = 0;
+	}
+	return isLoaded;
+}
+
+/** Writes the index through a temporary file renamed over the old index, so a concurrent reader
+ * never sees half of it. Failing to save only costs the next run a rebuild. */
+static void saveCompressedIndex(const CompressedDevice* device, const struct stat* imageStat) {
+	char* indexPath = getIndexPath(device->path);
+	char* temporaryPath = xmalloc(strlen(indexPath) + sizeof(".XXXXXX"));
+	strcpy(temporaryPath, indexPath);
+	strcat(temporaryPath, ".XXXXXX");
+
+	int fileDescriptor = mkstemp(temporaryPath);
+	FILE* indexFile = fileDescriptor == -1 ? NULL : fdopen(fileDescriptor, "wb");
+	CompressedIndexHeader header;
+	initIndexHeader(&header, device, imageStat);
+	bool isSaved = indexFile && fwrite(&header, sizeof(header), 1, indexFile) == 1;
+	for (uint32_t i = 0; isSaved && i < device->pointCount; i++) {
+		const CompressedSeekPoint* point = &device->points[i];
+		CompressedSeekPointRecord record = {
+			.uncompressedOffset = point->uncompressedOffset,
+			.compressedOffset = point->compressedOffset,
+			.bits = point->bits,
+			.windowBytes = point->windowBytes,
+		};
+		isSaved = fwrite(&record, sizeof(record), 1, indexFile) == 1 &&
+				  fwrite(point->window, 1, point->windowBytes, indexFile) == point->windowBytes;
+	}
+	if (indexFile && fclose(indexFile) != 0) {
+		isSaved = false;
+	} else if (!indexFile && fileDescriptor != -1) {
+		close(fileDescriptor);
+	}
+	if (isSaved && rename(temporaryPath, indexPath) != 0) {
+		isSaved = false;
+	}
+	if (!isSaved) {
+		(void)fprintf(stderr, "Could not save the seek index of %s, it will be rebuilt next time\n",
+					  device->path);
+		if (fileDescriptor != -1) {
+			(void)unlink(temporaryPath);
+		}
+	}
+
+	free(temporaryPath);
+	free(indexPath);
+}
+
+static CompressedDevice* openCompressedDevice(const char* devicePath) {
+	pthread_mutex_lock(&devicesMutex);
+	for (uint32_t i = 0; i < devicesCount; i++) {
+		if (strcmp(devices[i].path, devicePath) == 0) {
+			pthread_mutex_unlock(&devicesMutex);
+			return &devices[i];
+		}
+	}
+	if (devicesCount == COMPRESSED_MAX_DEVICES) {
+		(void)fprintf(stderr, "Too many compressed images opened\n");
+		exit(-1);
+	}
+
+	CompressedDevice* device = &devices[devicesCount];
+	memset(device, 0, sizeof(CompressedDevice));
+	device->path = strdup(devicePath);
+	device->fileDescriptor = open(devicePath, O_RDONLY | O_CLOEXEC);
+	struct stat imageStat;
+	if (device->fileDescriptor == -1 || fstat(device->fileDescriptor, &imageStat) != 0) {
+		perror("Error opening loop device file");
+		exit(-1);
+	}
+	if (!loadCompressedIndex(device, &imageStat)) {
+		buildCompressedIndex(device);
+		saveCompressedIndex(device, &imageStat);
+	}
+	pthread_mutex_init(&device->cacheMutex, NULL);
+	devicesCount++;
+
+	pthread_mutex_unlock(&devicesMutex);
+	return device;
+}
+
+/** Decompresses the span between seek point pointIndex and the next one into data. */
+static void inflateSpan(const CompressedDevice* device, uint32_t pointIndex, uint8_t* data,
+						uint64_t spanBytes) {
+	const CompressedSeekPoint* point = &device->points[pointIndex];
+	z_stream stream = {0};
+	if (inflateInit2(&stream, INFLATE_RAW_WINDOW_BITS) != Z_OK) {
+		failCompressedDevice(device, "failed to initialize zlib");
+	}
+
+	uint64_t compressedOffset = point->compressedOffset;
+	if (point->bits) {
+		// The block starts inside the previous byte, its top bits are fed to zlib first:
+		uint8_t firstByte;
+		if (preadCompressed(device, &firstByte, 1, compressedOffset - 1) != 1) {
+			failCompressedDevice(device, "image is shorter than its index");
+		}
+		inflatePrime(&stream, (int)point->bits, firstByte >> (8 - point->bits));
+	}
+	uint8_t* history = xmalloc(COMPRESSED_WINDOW_BYTES);
+	decompressSeekPointWindow(device, point, history);
+	inflateSetDictionary(&stream, history, COMPRESSED_WINDOW_BYTES);
+	free(history);
+
+	uint8_t* input = xmalloc(COMPRESSED_INPUT_BYTES);
+	stream.next_out = data;
+	stream.avail_out = spanBytes;
+	while (stream.avail_out != 0) {
+		stream.avail_in = preadCompressed(device, input, COMPRESSED_INPUT_BYTES, compressedOffset);
+		stream.next_in = input;
+		compressedOffset += stream.avail_in;
+		if (stream.avail_in == 0) {
+			failCompressedDevice(device, "image is shorter than its index");
+		}
+
+		int result = inflate(&stream, Z_NO_FLUSH);
+		if (result == Z_NEED_DICT || result == Z_DATA_ERROR || result == Z_MEM_ERROR) {
+			failCompressedDevice(device, "corrupted gzip stream, delete its index and retry");
+		}
+		if (result == Z_STREAM_END) {
+			break;
+		}
+	}
+	if (stream.avail_out != 0) {
+		failCompressedDevice(device, "gzip stream ended before its indexed size");
+	}
+
+	inflateEnd(&stream);
+	free(input);
+}
+
+static uint64_t getSpanBytes(const CompressedDevice* device, uint32_t pointIndex) {
+	uint64_t spanEnd = pointIndex + 1 < device->pointCount
+						   ? device->points[pointIndex + 1].uncompressedOffset
+						   : device->uncompressedBytes;
+	return spanEnd - device->points[pointIndex].uncompressedOffset;
+}
+
+/** Gets the cached span of pointIndex, decompressing it into the least recently used slot when
+ * it is not cached. Called with the cache mutex held. */
+static CompressedSpan* getCompressedSpan(CompressedDevice* device, uint32_t pointIndex) {
+	CompressedSpan* leastRecent = &device->cache[0];
+	for (uint32_t i = 0; i < COMPRESSED_CACHE_SPANS; i++) {
+		CompressedSpan* span = &device->cache[i];
+		if (span->data && span->pointIndex == pointIndex) {
+			span->lastUse = ++device->useCounter;
+			return span;
+		}
+		if (!span->data || (leastRecent->data && span->lastUse < leastRecent->lastUse)) {
+			leastRecent = span;
+		}
+	}
+
+	leastRecent->bytes = getSpanBytes(device, pointIndex);
+	leastRecent->data = xrealloc(leastRecent->data, leastRecent->bytes ? leastRecent->bytes : 1);
+	leastRecent->pointIndex = pointIndex;
+	leastRecent->lastUse = ++device->useCounter;
+	inflateSpan(device, pointIndex, leastRecent->data, leastRecent->bytes);
+	return leastRecent;
+}
+
+/** @return Index of the last seek point at or before offset. */
+static uint32_t findSeekPoint(const CompressedDevice* device, uint64_t offset) {
+	uint32_t low = 0;
+	uint32_t high = device->pointCount - 1;
+	while (low < high) {
+		uint32_t middle = (low + high + 1) / 2;
+		if (device->points[middle].uncompressedOffset <= offset) {
+			low = middle;
+		} else {
+			high = middle - 1;
+		}
+	}
+	return low;
+}
+
+void preadDeviceCompressed(uint8_t* buffer, uint64_t readBytes, int64_t offset,
+						   const char* devicePath) {
+	CompressedDevice* device = openCompressedDevice(devicePath);
+	if (offset < 0 || (uint64_t)offset + readBytes > device->uncompressedBytes) {
+		(void)fprintf(stderr, "pread: file short (%lu bytes past the end of %s)\n",
+					  (uint64_t)offset + readBytes - device->uncompressedBytes, devicePath);
+		exit(-1);
+	}
+
+	uint64_t position = offset;
+	const uint64_t END = offset + readBytes;
+	pthread_mutex_lock(&device->cacheMutex);
+	while (position < END) {
+		uint32_t pointIndex = findSeekPoint(device, position);
+		CompressedSpan* span = getCompressedSpan(device, pointIndex);
+		uint64_t spanStart = device->points[pointIndex].uncompressedOffset;
+		uint64_t copyEnd = spanStart + span->bytes < END ? spanStart + span->bytes : END;
+		memcpy(buffer + (position - offset), span->data + (position - spanStart),
+			   copyEnd - position);
+		position = copyEnd;
+	}
+	pthread_mutex_unlock(&device->cacheMutex);
+}
+
+uint64_t getCompressedDeviceBytes(const char* devicePath) {
+	return openCompressedDevice(devicePath)->uncompressedBytes;
+}
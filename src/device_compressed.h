@@ -0,0 +1,39 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+// Least uncompressed distance between seek points, a read decompresses a span plus one block:
+#define COMPRESSED_INDEX_SPAN (64 * 1024)
+// A span is at least this many times the compressed window of the seek point before it. Data that
+// does not compress has large windows and gets longer spans, keeping the index a small fraction of
+// the decompressed image:
+#define COMPRESSED_SPAN_WINDOW_RATIO 16
+// Deflate back references reach 32 KB back, every seek point stores that much history:
+#define COMPRESSED_WINDOW_BYTES (32 * 1024)
+// Decompressed spans kept per device, the header, fat and root directory fit in the first one:
+#define COMPRESSED_CACHE_SPANS 8
+#define COMPRESSED_MAX_DEVICES 8
+#define COMPRESSED_INDEX_SUFFIX ".idx"
+
+/** Checks if devicePath names a gzip compressed image, which is decided by its .gz suffix. */
+bool isCompressedDevicePath(const char* devicePath);
+
+/**
+ * @brief Reads bytes of the decompressed image from a gzip compressed image.
+ * The first access builds a seek point index in a single pass over the image and stores it next to
+ * it as devicePath + COMPRESSED_INDEX_SUFFIX, later runs load it instead as long as the image size
+ * and modification time still match. A read only decompresses the spans between the seek points
+ * around the requested range, starting from the 32 KB history saved compressed at the seek point,
+ * and keeps the last decompressed spans cached. Terminates the program when the read fails, same as
+ * preadDevice. Only single member gzip images are supported, trailing members are an error.
+ *
+ * @param[out] buffer Preallocated buffer of at least readBytes bytes.
+ * @param[in] readBytes Number of bytes to read.
+ * @param[in] offset Offset in the decompressed image to start reading from.
+ * @param[in] devicePath
+ */
+void preadDeviceCompressed(uint8_t* buffer, uint64_t readBytes, int64_t offset,
+						   const char* devicePath);
+
+/** Gets the size of a compressed image once decompressed, building its index when needed. */
+uint64_t getCompressedDeviceBytes(const char* devicePath);
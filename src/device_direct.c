@@ -0,0 +1,207 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "device_direct.h"
+#include "fat12.h"
+
+#define DIRECT_POOL_BYTES ((uint64_t)DIRECT_POOL_BUFFERS * DIRECT_BUFFER_BYTES)
+
+typedef struct DirectDevice {
+	char* path;
+	int fileDescriptor;
+	uint32_t blockSize;
+	bool isDirect;	// False when O_DIRECT is unsupported and reads fall back to buffered ones
+} DirectDevice;
+
+typedef struct DirectBufferPool {
+	pthread_mutex_t mutex;
+	pthread_cond_t released;
+	uint8_t* memory;
+	uint8_t* freeBuffers[DIRECT_POOL_BUFFERS];
+	uint32_t freeCount;
+} DirectBufferPool;
+
+static pthread_mutex_t devicesMutex = PTHREAD_MUTEX_INITIALIZER;
+static DirectDevice devices[DIRECT_MAX_DEVICES];
+static uint32_t devicesCount;
+
+static DirectBufferPool bufferPool = {
+	.mutex = PTHREAD_MUTEX_INITIALIZER,
+	.released = PTHREAD_COND_INITIALIZER,
+};
+
+/** Allocates all pool buffers as a single region, preferring a huge page so the pool costs one
+ * TLB entry. Called with the pool mutex held. */
+static void initDirectBufferPool(DirectBufferPool* pool) {
+	void* memory = mmap(NULL, DIRECT_POOL_BYTES, PROT_READ | PROT_WRITE,
+						MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (memory == MAP_FAILED) {
+		if (posix_memalign(&memory, DIRECT_BUFFER_ALIGNMENT, DIRECT_POOL_BYTES) != 0) {
+			(void)fprintf(stderr, "Failed to allocate direct read buffers\n");
+			exit(-1);
+		}
+	}
+
+	pool->memory = memory;
+	for (uint32_t i = 0; i < DIRECT_POOL_BUFFERS; i++) {
+		pool->freeBuffers[i] = pool->memory + (uint64_t)i * DIRECT_BUFFER_BYTES;
+	}
+	pool->freeCount = DIRECT_POOL_BUFFERS;
+}
+
+static uint8_t* acquireDirectBuffer(DirectBufferPool* pool) {
+	pthread_mutex_lock(&pool->mutex);
+	if (!pool->memory) {
+		initDirectBufferPool(pool);
+	}
+	while (pool->freeCount == 0) {
+		pthread_cond_wait(&pool->released, &pool->mutex);
+	}
+	pool->freeCount--;
+	uint8_t* buffer = pool->freeBuffers[pool->freeCount];
+	pthread_mutex_unlock(&pool->mutex);
+	return buffer;
+}
+
+static void releaseDirectBuffer(DirectBufferPool* pool, uint8_t* buffer) {
+	pthread_mutex_lock(&pool->mutex);
+	pool->freeBuffers[pool->freeCount] = buffer;
+	pool->freeCount++;
+	pthread_cond_signal(&pool->released);
+	pthread_mutex_unlock(&pool->mutex);
+}
+
+/** Gets the alignment O_DIRECT requires for offsets, sizes and buffers of the device. */
+static uint32_t getLogicalBlockSize(int fileDescriptor) {
+	struct stat deviceStat;
+	if (fstat(fileDescriptor, &deviceStat) != 0) {
+		return DIRECT_BUFFER_ALIGNMENT;
+	}
+
+	uint64_t blockSize = DIRECT_BUFFER_ALIGNMENT;
+	int logicalBlockSize;
+	if (S_ISBLK(deviceStat.st_mode) && ioctl(fileDescriptor, BLKSSZGET, &logicalBlockSize) == 0) {
+		blockSize = logicalBlockSize;
+	} else if (!S_ISBLK(deviceStat.st_mode)) {
+		// Image files are aligned to the block size of the filesystem holding them:
+		blockSize = deviceStat.st_blksize;
+	}
+
+	if (!isPowerOfTwo(blockSize) || blockSize > DIRECT_BUFFER_BYTES) {
+		return DIRECT_BUFFER_ALIGNMENT;
+	}
+	return blockSize < 512 ? 512 : blockSize;
+}
+
+static DirectDevice* openDirectDevice(const char* devicePath) {
+	pthread_mutex_lock(&devicesMutex);
+	for (uint32_t i = 0; i < devicesCount; i++) {
+		if (strcmp(devices[i].path, devicePath) == 0) {
+			pthread_mutex_unlock(&devicesMutex);
+			return &devices[i];
+		}
+	}
+	if (devicesCount == DIRECT_MAX_DEVICES) {
+		(void)fprintf(stderr, "Too many devices opened for direct reads\n");
+		exit(-1);
+	}
+
+	DirectDevice* device = &devices[devicesCount];
+	device->isDirect = true;
+	device->fileDescriptor = open(devicePath, O_RDONLY | O_DIRECT | O_CLOEXEC);
+	if (device->fileDescriptor == -1 && errno == EINVAL) {
+		device->isDirect = false;
+		device->fileDescriptor = open(devicePath, O_RDONLY | O_CLOEXEC);
+		(void)fprintf(stderr, "O_DIRECT is not supported for %s, using buffered reads\n",
+					  devicePath);
+	}
+	if (device->fileDescriptor == -1) {
+		perror("Error opening loop device file");
+		exit(-1);
+	}
+	device->path = strdup(devicePath);
+	device->blockSize = getLogicalBlockSize(device->fileDescriptor);
+	devicesCount++;
+
+	pthread_mutex_unlock(&devicesMutex);
+	return device;
+}
+
+static void preadFully(int fileDescriptor, uint8_t* buffer, uint64_t readBytes, int64_t offset,
+					   uint64_t requiredBytes) {
+	uint64_t totalRead = 0;
+	while (totalRead < readBytes) {
+		ssize_t bytesRead =
+			pread(fileDescriptor, buffer + totalRead, readBytes - totalRead, offset + totalRead);
+		if (bytesRead == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytesRead == -1) {
+			perror("File failed to be read");
+			exit(-1);
+		}
+		if (bytesRead == 0) {
+			break;	// End of device, the aligned tail may reach past it
+		}
+		totalRead += bytesRead;
+	}
+
+	if (totalRead < requiredBytes) {
+		(void)fprintf(stderr, "pread: file short (%lu out of %lu bytes read)\n", totalRead,
+					  requiredBytes);
+		exit(-1);
+	}
+}
+
+/** Buffered fallback that still keeps the read out of the page cache once it is done. */
+static void preadDropCache(DirectDevice* device, uint8_t* buffer, uint64_t readBytes,
+						   int64_t offset) {
+	preadFully(device->fileDescriptor, buffer, readBytes, offset, readBytes);
+	(void)posix_fadvise(device->fileDescriptor, offset, (off_t)readBytes, POSIX_FADV_DONTNEED);
+}
+
+void preadDeviceDirect(uint8_t* buffer, uint64_t readBytes, int64_t offset,
+					   const char* devicePath) {
+	DirectDevice* device = openDirectDevice(devicePath);
+	if (!device->isDirect) {
+		preadDropCache(device, buffer, readBytes, offset);
+		return;
+	}
+
+	const uint64_t BLOCK_MASK = device->blockSize - 1;
+	const uint64_t REQUEST_END = offset + readBytes;
+	const uint64_t ALIGNED_END = (REQUEST_END + BLOCK_MASK) & ~BLOCK_MASK;
+	uint64_t chunkStart = offset & ~BLOCK_MASK;
+
+	uint8_t* bounceBuffer = acquireDirectBuffer(&bufferPool);
+	while (chunkStart < ALIGNED_END) {
+		uint64_t chunkBytes = ALIGNED_END - chunkStart;
+		if (chunkBytes > DIRECT_BUFFER_BYTES) {
+			chunkBytes = DIRECT_BUFFER_BYTES;
+		}
+
+		// Only the part of the chunk that overlaps the request has to exist on the device:
+		uint64_t copyStart = chunkStart > (uint64_t)offset ? chunkStart : (uint64_t)offset;
+		uint64_t copyEnd =
+			chunkStart + chunkBytes < REQUEST_END ? chunkStart + chunkBytes : REQUEST_END;
+		preadFully(device->fileDescriptor, bounceBuffer, chunkBytes, (int64_t)chunkStart,
+				   copyEnd - chunkStart);
+		memcpy(buffer + (copyStart - offset), bounceBuffer + (copyStart - chunkStart),
+			   copyEnd - copyStart);
+
+		chunkStart += chunkBytes;
+	}
+	releaseDirectBuffer(&bufferPool, bounceBuffer);
+}
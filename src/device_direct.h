@@ -0,0 +1,24 @@
+#pragma once
+#include <stdint.h>
+
+// Bounce buffers shared by every direct read, together they fill exactly one 2 MB huge page:
+#define DIRECT_POOL_BUFFERS 8
+#define DIRECT_BUFFER_BYTES (256 * 1024)
+#define DIRECT_BUFFER_ALIGNMENT 4096
+#define DIRECT_MAX_DEVICES 8
+
+/**
+ * @brief Reads bytes from a device with O_DIRECT, bypassing the page cache.
+ * The read is widened to the logical block size of the device, goes through a pool of aligned
+ * bounce buffers (huge page backed when available) and only the requested range is copied out.
+ * Devices are opened once and kept open. When the filesystem holding the device does not support
+ * O_DIRECT the read falls back to a buffered pread that drops the pages from the cache afterwards.
+ * Terminates the program when the read fails, same as preadDevice.
+ *
+ * @param[out] buffer Preallocated buffer of at least readBytes bytes, needs no alignment.
+ * @param[in] readBytes Number of bytes to read.
+ * @param[in] offset Byte offset on the device to start reading from.
+ * @param[in] devicePath
+ */
+void preadDeviceDirect(uint8_t* buffer, uint64_t readBytes, int64_t offset,
+					   const char* devicePath);
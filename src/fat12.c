@@ -1,17 +1,35 @@
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
 #include "allocwrap.h"
+#include "device_compressed.h"
+#include "device_direct.h"
 #include "fat12.h"
+#include "fat12_geometry.h"
 #include "fat12_string.h"
 
+static DeviceReadMode deviceReadMode = DEVICE_READ_BUFFERED;
+
+void setDeviceReadMode(DeviceReadMode mode) { deviceReadMode = mode; }
+
 void preadDevice(uint8_t* buffer, uint64_t readBytes, int64_t offset, const char* loopDevicePath) {
+	if (isCompressedDevicePath(loopDevicePath)) {
+		preadDeviceCompressed(buffer, readBytes, offset, loopDevicePath);
+		return;
+	}
+	if (deviceReadMode == DEVICE_READ_DIRECT) {
+		preadDeviceDirect(buffer, readBytes, offset, loopDevicePath);
+		return;
+	}
+
 	int deviceFileDescriptor = open(loopDevicePath, O_RDONLY);
 	if (deviceFileDescriptor == -1) {
 		perror("Error opening loop device file");
@@ -34,6 +52,40 @@ void preadDevice(uint8_t* buffer, uint64_t readBytes, int64_t offset, const char
 	close(deviceFileDescriptor);
 }
 
+uint64_t getDeviceBytes(const char* loopDevicePath) {
+	if (isCompressedDevicePath(loopDevicePath)) {
+		return getCompressedDeviceBytes(loopDevicePath);
+	}
+	struct stat deviceStat;
+	if (stat(loopDevicePath, &deviceStat) == 0 && S_ISREG(deviceStat.st_mode)) {
+		return deviceStat.st_size;
+	}
+	// Block devices report their size through lseek:
+	int fileDescriptor = open(loopDevicePath, O_RDONLY | O_CLOEXEC);
+	if (fileDescriptor == -1) {
+		return 0;
+	}
+	off_t end = lseek(fileDescriptor, 0, SEEK_END);
+	close(fileDescriptor);
+	return end < 0 ? 0 : (uint64_t)end;
+}
+
+void pwriteDevice(const uint8_t* buffer, uint64_t writeBytes, int64_t offset, int fileDescriptor) {
+	uint64_t totalWritten = 0;
+	while (totalWritten < writeBytes) {
+		ssize_t bytesWritten = pwrite(fileDescriptor, buffer + totalWritten,
+									  writeBytes - totalWritten, offset + (int64_t)totalWritten);
+		if (bytesWritten == -1 && errno == EINTR) {
+			continue;
+		}
+		if (bytesWritten <= 0) {
+			perror("File failed to be written");
+			exit(-1);
+		}
+		totalWritten += bytesWritten;
+	}
+}
+
 FAT12Header* loadFat12Header(FAT12Header* fat12Header, const char* loopDevicePath) {
 	static char buffer[sizeof(FAT12Header)];
 
@@ -43,6 +95,47 @@ FAT12Header* loadFat12Header(FAT12Header* fat12Header, const char* loopDevicePat
 	return fat12Header;
 }
 
+const char* getFat12HeaderError(const FAT12Header* fat12Header, uint64_t deviceBytes) {
+	if (!isPowerOfTwo(fat12Header->bytesPerSector) || fat12Header->bytesPerSector < 512 ||
+		fat12Header->bytesPerSector > 4096) {
+		return "invalid bytes per sector";
+	}
+	if (!isPowerOfTwo(fat12Header->sectorsPerCluster)) {
+		return "invalid sectors per cluster";
+	}
+	if (fat12Header->reservedSectorCount == 0 || fat12Header->tableCount == 0 ||
+		fat12Header->tableSize16 == 0) {
+		return "invalid reserved sector or fat layout";
+	}
+
+	uint64_t totalSectors = fat12Header->totalSectors16 ? fat12Header->totalSectors16
+														: fat12Header->totalSectors32;
+	uint64_t rootDirSectors = bytesToSectorsRoundUp(
+		fat12Header->rootEntryCount * sizeof(FAT12DirectoryEntry), fat12Header->bytesPerSector);
+	uint64_t metadataSectors = fat12Header->reservedSectorCount +
+							   (uint64_t)fat12Header->tableCount * fat12Header->tableSize16 +
+							   rootDirSectors;
+	if (totalSectors <= metadataSectors) {
+		return "total sectors smaller than the metadata sections";
+	}
+	if (totalSectors * fat12Header->bytesPerSector > deviceBytes) {
+		return "device smaller than the filesystem";
+	}
+
+	uint64_t clusterCount = (totalSectors - metadataSectors) / fat12Header->sectorsPerCluster;
+	if (clusterCount >= FAT12_MAX_CLUSTER_COUNT) {
+		return "too many clusters for fat12";
+	}
+	// getNextClusterId of the last cluster id reads 2 bytes at 1.5 times its id:
+	uint64_t lastClusterId = clusterCount + 1;
+	if (lastClusterId + lastClusterId / 2 + 2 >
+		(uint64_t)fat12Header->tableSize16 * fat12Header->bytesPerSector) {
+		return "fat too small for the cluster count";
+	}
+
+	return NULL;
+}
+
 FAT12Info* loadFat12Info(FAT12Info* fat12Info, FAT12Header* fat12Header) {
 	FAT12Info* info = fat12Info;
 	uint32_t rootDirBytes = fat12Header->rootEntryCount * sizeof(FAT12DirectoryEntry);
@@ -65,6 +158,7 @@ FAT12Info* loadFat12Info(FAT12Info* fat12Info, FAT12Header* fat12Header) {
 		fat12Header->reservedSectorCount + info->fatSectionSectorSize + info->rootDirSectorsSize;
 	info->fatSectionSectorOffset = fat12Header->reservedSectorCount;
 	info->rootDirSectorOffset = info->dataSectionSectorOffset - info->rootDirSectorsSize;
+	info->geometry = selectGeometryOps(info);
 
 	return info;
 }
@@ -129,10 +223,10 @@ uint32_t getRootFileNames(char*** names, FAT12Info* fat12Info, const char* loopD
 	return fileNamesCount;
 }
 
-uint32_t filterValidDirectoryEntries(FAT12DirectoryEntry** dirEntries, uint32_t entriesCount) {
-	// Directories names are included in this count:
-	uint32_t fileTypeEntriesCount = countValidEntries(*dirEntries, entriesCount, false);
-
+/** Replaces *dirEntries with a copy holding only its fileTypeEntriesCount file and directory
+ * entries. */
+static uint32_t copyValidDirectoryEntries(FAT12DirectoryEntry** dirEntries, uint32_t entriesCount,
+										  uint32_t fileTypeEntriesCount) {
 	FAT12DirectoryEntry* filteredEntries =
 		xmalloc(fileTypeEntriesCount * sizeof(FAT12DirectoryEntry));
 	int validIndex = 0;
@@ -157,25 +251,48 @@ uint32_t filterValidDirectoryEntries(FAT12DirectoryEntry** dirEntries, uint32_t
 	return fileTypeEntriesCount;
 }
 
+uint32_t filterValidDirectoryEntries(FAT12DirectoryEntry** dirEntries, uint32_t entriesCount) {
+	// Directories names are included in this count:
+	uint32_t fileTypeEntriesCount = countValidEntries(*dirEntries, entriesCount, false);
+	return copyValidDirectoryEntries(dirEntries, entriesCount, fileTypeEntriesCount);
+}
+
 uint32_t getFileContent(uint8_t** fileContent, FAT12DirectoryEntry* fileDirectoryEntry,
 						FAT12Info* fat12Info, const char* loopDevicePath) {
+	uint8_t* fat = getFat(fat12Info, loopDevicePath);
+	uint32_t fileSize =
+		getFileContentWithFat(fileContent, fileDirectoryEntry, fat, fat12Info, loopDevicePath);
+	free(fat);
+	return fileSize;
+}
+
+uint32_t getFileContentWithFat(uint8_t** fileContent, FAT12DirectoryEntry* fileDirectoryEntry,
+							   const uint8_t* fat, FAT12Info* fat12Info,
+							   const char* loopDevicePath) {
 	const uint32_t BYTES_PER_CLUSTER = fat12Info->bytesPerSector * fat12Info->sectorsPerCluster;
 
-	uint8_t* fat = getFat(fat12Info, loopDevicePath);
 	uint32_t fileClusterCount = countFileClusters(fileDirectoryEntry->firstClusterId, fat);
 	*fileContent = xmalloc((uint64_t)fileClusterCount * BYTES_PER_CLUSTER);
 	uint8_t* currFileContentPtr = *fileContent;
 
-	uint32_t currClusterId = fileDirectoryEntry->firstClusterId;
-	char* clusterData;
-	for (uint32_t i = 0; i < fileClusterCount; i++) {
-		readCluster(&clusterData, currClusterId, fat12Info, loopDevicePath);
-		memcpy(currFileContentPtr, clusterData, BYTES_PER_CLUSTER);
-		free(clusterData);
+	uint64_t* clusterOffsets = xmalloc((uint64_t)fileClusterCount * sizeof(uint64_t));
+	fileClusterCount = getClusterChainOffsets(clusterOffsets, fileClusterCount,
+											  fileDirectoryEntry->firstClusterId, fat, fat12Info);
 
-		currFileContentPtr += BYTES_PER_CLUSTER;
-		currClusterId = getNextClusterId(currClusterId, fat);
+	// Clusters that follow each other on the device are read with a single pread:
+	uint32_t runStart = 0;
+	for (uint32_t i = 1; i <= fileClusterCount; i++) {
+		if (i < fileClusterCount &&
+			clusterOffsets[i] == clusterOffsets[i - 1] + BYTES_PER_CLUSTER) {
+			continue;
+		}
+		uint64_t runBytes = (uint64_t)(i - runStart) * BYTES_PER_CLUSTER;
+		preadDevice(currFileContentPtr, runBytes, (int64_t)clusterOffsets[runStart],
+					loopDevicePath);
+		currFileContentPtr += runBytes;
+		runStart = i;
 	}
+	free(clusterOffsets);
 
 	if (isDirectoryEntryDirectory(fileDirectoryEntry)) {
 		return BYTES_PER_CLUSTER * fileClusterCount;
@@ -193,16 +310,6 @@ uint8_t* getFat(FAT12Info* fat12Info, const char* loopDevicePath) {
 	return fat;
 }
 
-uint16_t getNextClusterId(uint16_t clusterId, const uint8_t* fat) {
-	uint32_t offset = clusterId + (clusterId / 2);
-	int packed = fat[offset] | (fat[offset + 1] << 8);
-
-	if (clusterId % 2) {
-		return packed >> 4;
-	}
-	return packed & 0x0FFF;
-}
-
 uint32_t countFileClusters(uint16_t initialClusterId, const uint8_t* fat) {
 	uint32_t clusterCount = 0;
 	uint16_t currClusterId = initialClusterId;
@@ -249,13 +356,20 @@ void printFat12Information(const char* loopDevicePath) {
 	}
 }
 
+uint64_t getClusterDeviceOffset(uint16_t clusterId, const FAT12Info* fat12Info) {
+	return fat12Info->geometry->clusterDeviceOffset(clusterId, fat12Info);
+}
+
+uint32_t getClusterChainOffsets(uint64_t* offsets, uint32_t maxClusters, uint16_t firstClusterId,
+								const uint8_t* fat, const FAT12Info* fat12Info) {
+	return fat12Info->geometry->walkClusterChain(offsets, maxClusters, firstClusterId, fat,
+												 fat12Info);
+}
+
 uint32_t readCluster(char** data, uint16_t clusterId, FAT12Info* fat12Info,
 					 const char* loopDevicePath) {
-	uint32_t clusterNum = clusterIdToClusterNum(clusterId);
 	uint32_t bytesPerCluster = fat12Info->sectorsPerCluster * fat12Info->bytesPerSector;
-	uint32_t dataSectionSectorOffset = clusterNum * fat12Info->sectorsPerCluster;
-	uint32_t deviceSectorOffset = fat12Info->dataSectionSectorOffset + dataSectionSectorOffset;
-	uint32_t deviceBytesOffset = deviceSectorOffset * fat12Info->bytesPerSector;
+	uint64_t deviceBytesOffset = getClusterDeviceOffset(clusterId, fat12Info);
 
 	*data = xmalloc(bytesPerCluster);
 	preadDevice((uint8_t*)*data, bytesPerCluster, deviceBytesOffset, loopDevicePath);
@@ -269,7 +383,9 @@ uint32_t getRootDirectoryEntries(FAT12DirectoryEntry** dirEntries, FAT12Info* fa
 
 	*dirEntries = xmalloc(DIRECTORY_BYTES_SIZE);
 	preadDevice((uint8_t*)*dirEntries, DIRECTORY_BYTES_SIZE, BYTES_OFFSET, loopDevicePath);
-	return filterValidDirectoryEntries(dirEntries, MAX_ENTRIES);
+	uint32_t fileTypeEntriesCount = fat12Info->geometry->countDirectoryEntries(
+		*dirEntries, fat12Info->rootDirSectorsSize, fat12Info);
+	return copyValidDirectoryEntries(dirEntries, MAX_ENTRIES, fileTypeEntriesCount);
 }
 
 // NOLINTBEGIN
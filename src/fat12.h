@@ -59,8 +59,27 @@ static inline bool isDeletedEntry(FAT12DirectoryEntry* entry) {
 static inline bool isDirectoryEntryDirectory(const FAT12DirectoryEntry* entry) {
 	return (entry->attributes & FAT12_ATTR_DIRECTORY) != 0;
 }
+/** Checks for the "." and ".." entries every sub directory starts with */
+static inline bool isDotDirectoryEntry(const FAT12DirectoryEntry* entry) {
+	return entry->fileName[0] == '.';
+}
+
+#define FAT_YEAR_BASE 1980
+#define FAT_YEAR_MAX 2107
+
+/** Encodes a date and time the way FAT12 directory entries store them, as (date << 16) | time.
+ * @return The encoded value, seconds are rounded down to the 2 second FAT resolution.
+ */
+static inline uint32_t encodeFatDateTime(uint32_t year, uint32_t month, uint32_t day,
+										 uint32_t hour, uint32_t minute, uint32_t second) {
+	uint32_t date = ((year - FAT_YEAR_BASE) << 9) | (month << 5) | day;
+	uint32_t time = (hour << 11) | (minute << 5) | (second / 2);
+	return (date << 16) | time;
+}
 
 #define FAT_LAST_CLUSTER_NUM 0xFFF
+#define FAT12_MAX_CLUSTER_COUNT 4085
+typedef struct FAT12GeometryOps FAT12GeometryOps;
 typedef struct FAT12Info {
 	uint32_t bytesPerSector;
 	uint32_t sectorsPerCluster;
@@ -75,17 +94,45 @@ typedef struct FAT12Info {
 	uint32_t dataSectionSectorOffset;
 	uint32_t fatSectionSectorOffset;
 	uint32_t rootDirSectorOffset;
+
+	// Routines specialized for this volume geometry, selected by loadFat12Info:
+	const FAT12GeometryOps* geometry;
 } FAT12Info;
 
+typedef enum DeviceReadMode {
+	DEVICE_READ_BUFFERED,  // Plain pread through the page cache
+	DEVICE_READ_DIRECT,	   // O_DIRECT through aligned bounce buffers, see preadDeviceDirect
+} DeviceReadMode;
+
+/** Selects how preadDevice reads from loop devices, buffered by default. */
+void setDeviceReadMode(DeviceReadMode mode);
+
+/** Writes bytes from a buffer to a loopDevice at an offset.
+ * In case the function fails to write it exits out of the program.
+ * @param[in] buffer Bytes to write.
+ * @param[in] writeBytes Number of bytes to write to the loop device.
+ * @param[in] offset The offset to start writing at.
+ * @param[in] fileDescriptor Loop device opened for writing.
+ */
+void pwriteDevice(const uint8_t* buffer, uint64_t writeBytes, int64_t offset, int fileDescriptor);
+
 /** Reads bytes from a loopDevice from an offset and loads into a preallocated buffer.
  * In case the function fails to read it exists out of the program.
  * @param[in] buffer preallocated buffer the caller provides.
  * @param[in] readBytes Number of bytes to read from loop device.
  * @param[in] offset the offset to start reading from the device.
+ * Paths ending with .gz are read as gzip compressed images, see preadDeviceCompressed.
  * @param[in] loopDevicePath Path to loop device that will be read
  */
 void preadDevice(uint8_t* buffer, uint64_t readBytes, int64_t offset, const char* loopDevicePath);
 
+/** Gets the number of bytes preadDevice can read from a loop device, which for compressed images
+ * is their decompressed size.
+ * @param[in] loopDevicePath
+ * @return The size in bytes, 0 when it can not be found.
+ */
+uint64_t getDeviceBytes(const char* loopDevicePath);
+
 /** Loads FAT12Header with information from a loop device.
  * @param[out] fat12Header Pointer to the allocated structure to load information to.
  * @param[in] loopDevicePath
@@ -93,6 +140,13 @@ void preadDevice(uint8_t* buffer, uint64_t readBytes, int64_t offset, const char
  */
 FAT12Header* loadFat12Header(FAT12Header* fat12Header, const char* loopDevicePath);
 
+/** Checks that a FAT12Header describes a layout the parser can safely walk.
+ * @param[in] fat12Header Header read from a device.
+ * @param[in] deviceBytes Size of the device the header was read from.
+ * @return NULL when the header is valid, otherwise a static description of the problem.
+ */
+const char* getFat12HeaderError(const FAT12Header* fat12Header, uint64_t deviceBytes);
+
 /** Loads FAT12Info from FAT12Header.
  * @param[out] fat12Info Pointer to the allocated structure to load information to.
  * @param[in] fat12Header A FAT12Header structure with correct information of some loop device.
@@ -176,6 +230,14 @@ uint32_t filterValidDirectoryEntries(FAT12DirectoryEntry** dirEntries, uint32_t
 uint32_t getFileContent(uint8_t** fileContent, FAT12DirectoryEntry* fileDirectoryEntry,
 						FAT12Info* fat12Info, const char* loopDevicePath);
 
+/** Same as getFileContent but walks the cluster chain using an already loaded fat instead of
+ * reading it from the loop device, for callers reading many files from the same filesystem.
+ * @param[in] fat The fat returned by getFat.
+ */
+uint32_t getFileContentWithFat(uint8_t** fileContent, FAT12DirectoryEntry* fileDirectoryEntry,
+							   const uint8_t* fat, FAT12Info* fat12Info,
+							   const char* loopDevicePath);
+
 /** Loads the FAT (File Allocation Table) from a FAT12 loopDevice.
  * The function reads the first FAT in the FAT section of the filesystem located in loopDevice.
  * @param[in] fat12Info
@@ -202,6 +264,24 @@ uint8_t* getFat(FAT12Info* fat12Info, const char* loopDevicePath);
 uint32_t readCluster(char** data, uint16_t clusterId, FAT12Info* fat12Info,
 					 const char* loopDevicePath);
 
+/** Converts a cluster id to the byte offset of that cluster on the loop device. */
+uint64_t getClusterDeviceOffset(uint16_t clusterId, const FAT12Info* fat12Info);
+
+/**
+ * @brief Follows a cluster chain through the fat and stores the device offset of each cluster,
+ * using the chain walk specialized for the volume geometry.
+ *
+ * @param[out] offsets Receives up to maxClusters offsets in chain order.
+ * @param[in] maxClusters
+ * @param[in] firstClusterId
+ * @param[in] fat
+ * @param[in] fat12Info
+ * @return Number of offsets stored, the walk stops early at the end of the chain or at an id
+ * outside the data section.
+ */
+uint32_t getClusterChainOffsets(uint64_t* offsets, uint32_t maxClusters, uint16_t firstClusterId,
+								const uint8_t* fat, const FAT12Info* fat12Info);
+
 /** Extracts FAT12 root directory entries from the loopDevice provided.
  * This directory entries only include: directories, files
  *
@@ -220,12 +300,37 @@ uint32_t countFileClusters(uint16_t initialClusterId, const uint8_t* fat);
 /** Gets a cluster id and fat 12 and returns next cluster in the chain.
  @note No error handling assumes values are correct.
  */
-uint16_t getNextClusterId(uint16_t clusterId, const uint8_t* fat);
+static inline uint16_t getNextClusterId(uint16_t clusterId, const uint8_t* fat) {
+	uint32_t offset = clusterId + (clusterId / 2);
+	int packed = fat[offset] | (fat[offset + 1] << 8);
+
+	if (clusterId % 2) {
+		return packed >> 4;
+	}
+	return packed & 0x0FFF;
+}
+/** Sets the fat entry of clusterId to nextClusterId, the inverse of getNextClusterId. */
+static inline void setNextClusterId(uint16_t clusterId, uint16_t nextClusterId, uint8_t* fat) {
+	uint32_t offset = clusterId + (clusterId / 2);
+
+	if (clusterId % 2) {
+		fat[offset] = (fat[offset] & 0x0F) | ((nextClusterId & 0x0F) << 4);
+		fat[offset + 1] = nextClusterId >> 4;
+		return;
+	}
+	fat[offset] = nextClusterId & 0xFF;
+	fat[offset + 1] = (fat[offset + 1] & 0xF0) | ((nextClusterId >> 8) & 0x0F);
+}
 /** Converts clusterId to cluster number since the first id is 2 which points to cluster 0 */
 static inline uint32_t clusterIdToClusterNum(uint16_t clusterId) { return clusterId - 2; }
+/** Checks that clusterId points inside the data section (ids 0 and 1 are reserved) */
+static inline bool isDataClusterId(uint16_t clusterId, const FAT12Info* fat12Info) {
+	return clusterId >= 2 && clusterId < fat12Info->clusterCount + 2;
+}
 static inline uint32_t bytesToSectorsRoundUp(uint32_t bytes, uint16_t bytesPerSector) {
 	return (bytes + bytesPerSector - 1) / bytesPerSector;
 }
+static inline bool isPowerOfTwo(uint64_t value) { return value && !(value & (value - 1)); }
 void printFileAllocationTable(FAT12Info* fat12Info, const char* loopDevicePath);
 /** Prints all kind of inromation about the fat12 device */
 void printFat12Information(const char* loopDevicePath);
@@ -5,7 +5,13 @@
 
 #include "fat12.h"
 #include "fat12_api.h"
+#include "fat12_defrag.h"
+#include "fat12_diff.h"
+#include "fat12_find.h"
+#include "fat12_grep.h"
 #include "fat12_string.h"
+#include "fat12_undelete.h"
+#include "fat12_write.h"
 
 static const char* fat12LoopDevicePath;
 static FAT12Header fat12Header;
@@ -60,7 +66,8 @@ static FAT12DirectoryEntry* getPathFinalDirectoryEntry(const char* path) {
 		}
 		entriesCount =
 			getDirectoryEntries(&dirEntries, currentDirEntry, &fat12Info, fat12LoopDevicePath);
-		entriesCount = filterValidDirectoryEntries(&dirEntries, entriesCount);
+		entriesCount = filterValidDirectoryEntries(&dirEntries,
+												   entriesCount / sizeof(FAT12DirectoryEntry));
 		token = strtok(NULL, "/");
 	}
 
@@ -105,10 +112,146 @@ uint32_t getFileNamesByPath(char*** filesNames, const char* path) {
 	FAT12DirectoryEntry* dirEntries;
 	uint32_t entriesCount =
 		getDirectoryEntries(&dirEntries, finalEntry, &fat12Info, fat12LoopDevicePath);
-	entriesCount = filterValidDirectoryEntries(&dirEntries, entriesCount);
+	entriesCount =
+		filterValidDirectoryEntries(&dirEntries, entriesCount / sizeof(FAT12DirectoryEntry));
 	getEntriesFileNames(filesNames, dirEntries, entriesCount);
 
 	free(finalEntry);
 	free(dirEntries);
 	return entriesCount;
 }
+
+uint64_t grepByPath(const char* pattern, const char* path) {
+	if (strlen(path) == 1 && strcmp(path, "/") == 0) {
+		return grepEntry(pattern, NULL, path, &fat12Info, fat12LoopDevicePath);
+	}
+
+	FAT12DirectoryEntry* finalEntry = getPathFinalDirectoryEntry(path);
+	if (!finalEntry) {
+		(void)fprintf(stderr, "Path does not exist: %s\n", path);
+		return 0;
+	}
+
+	uint64_t matchCount = grepEntry(pattern, finalEntry, path, &fat12Info, fat12LoopDevicePath);
+	free(finalEntry);
+	return matchCount;
+}
+
+uint64_t findByPath(const char* path, const FAT12FindFilter* filter) {
+	if (strlen(path) == 1 && strcmp(path, "/") == 0) {
+		return findEntries(filter, NULL, path, &fat12Info, fat12LoopDevicePath);
+	}
+
+	FAT12DirectoryEntry* finalEntry = getPathFinalDirectoryEntry(path);
+	if (!finalEntry) {
+		(void)fprintf(stderr, "Directory does not exist: %s\n", path);
+		return 0;
+	}
+	if (!isDirectoryEntryDirectory(finalEntry)) {
+		(void)fprintf(stderr, "Path is a file, not a directory: %s\n", path);
+		free(finalEntry);
+		return 0;
+	}
+
+	uint64_t matchCount = findEntries(filter, finalEntry, path, &fat12Info, fat12LoopDevicePath);
+	free(finalEntry);
+	return matchCount;
+}
+
+uint64_t undeleteByPath(const char* path) {
+	if (strlen(path) == 1 && strcmp(path, "/") == 0) {
+		return listDeletedEntries(NULL, path, &fat12Info, fat12LoopDevicePath);
+	}
+
+	FAT12DirectoryEntry* finalEntry = getPathFinalDirectoryEntry(path);
+	if (!finalEntry) {
+		(void)fprintf(stderr, "Directory does not exist: %s\n", path);
+		return 0;
+	}
+	if (!isDirectoryEntryDirectory(finalEntry)) {
+		(void)fprintf(stderr, "Path is a file, not a directory: %s\n", path);
+		free(finalEntry);
+		return 0;
+	}
+
+	uint64_t deletedCount = listDeletedEntries(finalEntry, path, &fat12Info, fat12LoopDevicePath);
+	free(finalEntry);
+	return deletedCount;
+}
+
+uint64_t carveFilesystem(void) { return carveFreeClusters(&fat12Info, fat12LoopDevicePath); }
+
+/** Opens the loop device for writing, runs a single write operation and flushes it on success */
+static int runWriteOperation(int (*operation)(FAT12Volume*, const char*, const char*),
+							 const char* firstArg, const char* secondArg) {
+	FAT12Volume volume;
+	if (openFat12Volume(&volume, fat12LoopDevicePath) != 0) {
+		return -1;
+	}
+
+	int result = operation(&volume, firstArg, secondArg);
+	if (result == 0) {
+		flushFat12Volume(&volume);
+	}
+	closeFat12Volume(&volume);
+	return result;
+}
+
+static int putOperation(FAT12Volume* volume, const char* hostFilePath, const char* path) {
+	return putFat12File(volume, hostFilePath, path);
+}
+
+static int makeDirectoryOperation(FAT12Volume* volume, const char* path, const char* unused) {
+	(void)unused;
+	return makeFat12Directory(volume, path);
+}
+
+static int removeOperation(FAT12Volume* volume, const char* path, const char* unused) {
+	(void)unused;
+	return removeFat12Entry(volume, path);
+}
+
+int putFileByPath(const char* hostFilePath, const char* path) {
+	return runWriteOperation(putOperation, hostFilePath, path);
+}
+
+int makeDirectoryByPath(const char* path) {
+	return runWriteOperation(makeDirectoryOperation, path, NULL);
+}
+
+int removeByPath(const char* path) { return runWriteOperation(removeOperation, path, NULL); }
+
+static void printFragmentationReport(const char* label, const FAT12FragmentationReport* report) {
+	printf("%s: %.2f%% of traversal reads seek, %u of %u chains fragmented, %u extents over %u "
+		   "clusters\n",
+		   label, report->score, report->fragmentedChainCount, report->chainCount,
+		   report->extentCount, report->clusterCount);
+}
+
+static int defragOperation(FAT12Volume* volume, const char* unusedFirst, const char* unusedSecond) {
+	(void)unusedFirst;
+	(void)unusedSecond;
+	FAT12FragmentationReport before;
+	FAT12FragmentationReport after;
+	if (defragFat12Volume(volume, &before, &after) != 0) {
+		return -1;
+	}
+	printFragmentationReport("Before", &before);
+	printFragmentationReport("After", &after);
+	return 0;
+}
+
+int defragFilesystem(void) { return runWriteOperation(defragOperation, NULL, NULL); }
+
+int diffWithImage(const char* otherLoopDevicePath) {
+	FAT12DiffStats stats;
+	if (diffFat12Images(fat12LoopDevicePath, otherLoopDevicePath, &stats) != 0) {
+		return -1;
+	}
+
+	double readPercent = stats.imageBytes ? 100.0 * stats.bytesRead / stats.imageBytes : 0;
+	(void)fprintf(stderr, "%lu added, %lu removed, %lu modified, read %lu of %lu bytes (%.2f%%)\n",
+				  stats.addedCount, stats.removedCount, stats.modifiedCount, stats.bytesRead,
+				  stats.imageBytes, readPercent);
+	return stats.addedCount + stats.removedCount + stats.modifiedCount ? 1 : 0;
+}
@@ -1,6 +1,46 @@
 #pragma once
 #include <stdint.h>
 
+#include "fat12_find.h"
+
 void initFat12Api(const char* loopDevicePath);
 uint32_t getFileContentByPath(uint8_t** fileContent, const char* filePath);
 uint32_t getFileNamesByPath(char*** filesNames, const char* dirPath);
+/** Prints path:offset for every occurrence of pattern in the file or directory tree at path.
+ * @return Number of matches found.
+ */
+uint64_t grepByPath(const char* pattern, const char* path);
+/** Prints the path of every entry below the directory at path that matches filter.
+ * @return Number of matching entries.
+ */
+uint64_t findByPath(const char* path, const FAT12FindFilter* filter);
+/** Prints every deleted entry below the directory at path with a guess of its clusters.
+ * @return Number of deleted entries found.
+ */
+uint64_t undeleteByPath(const char* path);
+/** Prints the free clusters that start with the signature of a known file type.
+ * @return Number of signatures found.
+ */
+uint64_t carveFilesystem(void);
+/** Copies the host file at hostFilePath into the filesystem at path.
+ * @return 0 on success, -1 on failure.
+ */
+int putFileByPath(const char* hostFilePath, const char* path);
+/** Creates an empty directory at path.
+ * @return 0 on success, -1 on failure.
+ */
+int makeDirectoryByPath(const char* path);
+/** Removes the file or empty directory at path.
+ * @return 0 on success, -1 on failure.
+ */
+int removeByPath(const char* path);
+/** Lays out every file and directory contiguously in traversal order and prints the fragmentation
+ * before and after.
+ * @return 0 on success, -1 on failure.
+ */
+int defragFilesystem(void);
+/** Prints the paths added, removed or modified in the image at otherLoopDevicePath compared to
+ * this one.
+ * @return 0 when the images hold the same tree, 1 when they differ, -1 on failure.
+ */
+int diffWithImage(const char* otherLoopDevicePath);
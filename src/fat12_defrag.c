@@ -0,0 +1,490 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocwrap.h"
+#include "fat12.h"
+#include "fat12_defrag.h"
+#include "fat12_write.h"
+
+#define NO_OWNER -1
+#define NO_BATCH_DESTINATION 0
+#define FAT_FIRST_END_OF_CHAIN 0xFF8
+
+/** A cluster chain reachable from the root directory and where its directory entry lives. */
+typedef struct DefragChain {
+	int32_t parentChain;   // -1 for entries of the root directory
+	int32_t entryCluster;  // Logical cluster of the parent holding the entry, -1 in the root
+	uint32_t entryOffset;  // Byte offset of the entry in that cluster or in the root directory
+	uint32_t firstCluster;
+	uint32_t clusterCount;
+	bool isDirectory;
+	bool hasDotEntries;
+} DefragChain;
+
+/**
+ * Logical clusters are numbered in traversal order, logical cluster i is moved to targets[i].
+ * The plan only holds a few integers per cluster, cluster data is read per batch.
+ */
+typedef struct DefragPlan {
+	FAT12Volume* volume;
+
+	uint16_t* locations;  // Current cluster id of every logical cluster
+	uint32_t* chainOf;	  // Chain every logical cluster belongs to
+	uint16_t* targets;
+	uint32_t clusterCount;
+
+	int32_t* owners;  // Logical cluster stored in every cluster id, NO_OWNER when unreachable
+
+	DefragChain* chains;
+	uint32_t chainCount;
+	uint32_t chainCapacity;
+} DefragPlan;
+
+typedef struct DefragBatch {
+	uint32_t* moves;  // Logical clusters moved by the batch
+	uint32_t moveCount;
+	uint32_t maxMoves;
+	// Destination of every logical cluster, NO_BATCH_DESTINATION when it stays in place:
+	uint16_t* destinations;
+	uint8_t* data;
+} DefragBatch;
+
+static bool isEndOfChain(uint16_t clusterId) { return clusterId >= FAT_FIRST_END_OF_CHAIN; }
+
+/** Appends the chain starting at firstClusterId to the traversal order.
+ * @return Index of the chain or -1 when it is cross linked, looped or not terminated.
+ */
+static int32_t addDefragChain(DefragPlan* plan, uint16_t firstClusterId, bool isDirectory,
+							  int32_t parentChain, int32_t entryCluster, uint32_t entryOffset) {
+	const FAT12Info* info = &plan->volume->fat12Info;
+	if (plan->chainCount == plan->chainCapacity) {
+		plan->chainCapacity = plan->chainCapacity ? plan->chainCapacity * 2 : 64;
+		plan->chains = xrealloc(plan->chains, plan->chainCapacity * sizeof(DefragChain));
+	}
+	DefragChain* chain = &plan->chains[plan->chainCount];
+	chain->parentChain = parentChain;
+	chain->entryCluster = entryCluster;
+	chain->entryOffset = entryOffset;
+	chain->firstCluster = plan->clusterCount;
+	chain->clusterCount = 0;
+	chain->isDirectory = isDirectory;
+	chain->hasDotEntries = false;
+
+	uint16_t clusterId = firstClusterId;
+	while (isDataClusterId(clusterId, info)) {
+		// A cluster seen before means a cross link or a loop, owners catches both:
+		if (plan->owners[clusterId] != NO_OWNER) {
+			return -1;
+		}
+		plan->owners[clusterId] = (int32_t)plan->clusterCount;
+		plan->locations[plan->clusterCount] = clusterId;
+		plan->chainOf[plan->clusterCount] = plan->chainCount;
+		plan->clusterCount++;
+		chain->clusterCount++;
+		clusterId = getNextClusterId(clusterId, plan->volume->fat);
+	}
+	if (chain->clusterCount == 0 || !isEndOfChain(clusterId)) {
+		return -1;
+	}
+	return (int32_t)plan->chainCount++;
+}
+
+static bool isDotEntryNamed(const FAT12DirectoryEntry* entry, const char* name) {
+	return memcmp(entry->fileName, name, sizeof(entry->fileName)) == 0;
+}
+
+/** Adds the chains of the entries of a directory, sub directories are walked as soon as they are
+ * reached so their content directly follows them.
+ * @param[in] directoryChain Chain of the directory, -1 for the root directory.
+ */
+static bool addDirectoryChains(DefragPlan* plan, int32_t directoryChain) {
+	FAT12Volume* volume = plan->volume;
+	const FAT12Info* info = &volume->fat12Info;
+
+	FAT12DirectoryEntry* entries;
+	uint64_t directoryBytes;
+	if (directoryChain == -1) {
+		directoryBytes = (uint64_t)info->rootDirSectorsSize * info->bytesPerSector;
+		entries = xmalloc(directoryBytes);
+		preadDevice((uint8_t*)entries, directoryBytes,
+					(int64_t)info->rootDirSectorOffset * info->bytesPerSector,
+					volume->loopDevicePath);
+	} else {
+		DefragChain* chain = &plan->chains[directoryChain];
+		directoryBytes = (uint64_t)chain->clusterCount * volume->bytesPerCluster;
+		entries = xmalloc(directoryBytes);
+		for (uint32_t i = 0; i < chain->clusterCount; i++) {
+			uint16_t clusterId = plan->locations[chain->firstCluster + i];
+			preadDevice((uint8_t*)entries + (uint64_t)i * volume->bytesPerCluster,
+						volume->bytesPerCluster, (int64_t)getClusterDeviceOffset(clusterId, info),
+						volume->loopDevicePath);
+		}
+		chain->hasDotEntries = directoryBytes >= 2 * sizeof(FAT12DirectoryEntry) &&
+							   isDotEntryNamed(&entries[0], ".          ") &&
+							   isDotEntryNamed(&entries[1], "..         ");
+	}
+
+	uint32_t entriesCount = directoryBytes / sizeof(FAT12DirectoryEntry);
+	bool isConsistent = true;
+	for (uint32_t i = 0; i < entriesCount && isConsistent; i++) {
+		FAT12DirectoryEntry* entry = &entries[i];
+		if (isFinalDirectoryEntry(entry)) {
+			break;
+		}
+		if (isDeletedEntry(entry) || isVolumeLabelEntry(entry) || isDotDirectoryEntry(entry) ||
+			entry->firstClusterId == 0) {
+			continue;
+		}
+		if (!isDataClusterId(entry->firstClusterId, info)) {
+			isConsistent = false;
+			break;
+		}
+
+		uint64_t entryByteOffset = (uint64_t)i * sizeof(FAT12DirectoryEntry);
+		int32_t entryCluster = -1;
+		uint32_t entryOffset = entryByteOffset;
+		if (directoryChain != -1) {
+			entryCluster = plan->chains[directoryChain].firstCluster +
+						   entryByteOffset / volume->bytesPerCluster;
+			entryOffset = entryByteOffset % volume->bytesPerCluster;
+		}
+		bool isDirectory = isDirectoryEntryDirectory(entry);
+		int32_t chain = addDefragChain(plan, entry->firstClusterId, isDirectory, directoryChain,
+									   entryCluster, entryOffset);
+		isConsistent = chain != -1 && (!isDirectory || addDirectoryChains(plan, chain));
+	}
+
+	free(entries);
+	return isConsistent;
+}
+
+/** Targets are the lowest cluster ids, skipping allocated clusters no chain reaches (bad clusters
+ * or lost chains) since nothing is known about what points to them. */
+static void assignDefragTargets(DefragPlan* plan) {
+	const uint32_t LAST_CLUSTER_ID = plan->volume->fat12Info.clusterCount + 1;
+	uint32_t targetCount = 0;
+	for (uint32_t clusterId = 2; clusterId <= LAST_CLUSTER_ID && targetCount < plan->clusterCount;
+		 clusterId++) {
+		bool isPinned = plan->owners[clusterId] == NO_OWNER &&
+						getNextClusterId(clusterId, plan->volume->fat) != FAT_FREE_CLUSTER;
+		if (!isPinned) {
+			plan->targets[targetCount] = clusterId;
+			targetCount++;
+		}
+	}
+}
+
+static bool buildDefragPlan(DefragPlan* plan, FAT12Volume* volume) {
+	const uint32_t CLUSTER_ID_COUNT = volume->fat12Info.clusterCount + 2;
+	memset(plan, 0, sizeof(DefragPlan));
+	plan->volume = volume;
+	// Every reachable cluster is a data cluster, so that bounds the traversal:
+	const uint32_t MAX_CLUSTERS = volume->fat12Info.clusterCount;
+	plan->locations = xmalloc(MAX_CLUSTERS * sizeof(uint16_t));
+	plan->chainOf = xmalloc(MAX_CLUSTERS * sizeof(uint32_t));
+	plan->targets = xmalloc(MAX_CLUSTERS * sizeof(uint16_t));
+	plan->owners = xmalloc(CLUSTER_ID_COUNT * sizeof(int32_t));
+	for (uint32_t i = 0; i < CLUSTER_ID_COUNT; i++) {
+		plan->owners[i] = NO_OWNER;
+	}
+
+	if (!addDirectoryChains(plan, -1)) {
+		return false;
+	}
+	assignDefragTargets(plan);
+	return true;
+}
+
+static void freeDefragPlan(DefragPlan* plan) {
+	free(plan->locations);
+	free(plan->chainOf);
+	free(plan->targets);
+	free(plan->owners);
+	free(plan->chains);
+}
+
+static void measureFragmentation(const DefragPlan* plan, FAT12FragmentationReport* report) {
+	memset(report, 0, sizeof(FAT12FragmentationReport));
+	report->chainCount = plan->chainCount;
+	report->clusterCount = plan->clusterCount;
+
+	uint32_t seekCount = 0;
+	for (uint32_t i = 0; i < plan->chainCount; i++) {
+		const DefragChain* chain = &plan->chains[i];
+		uint32_t extentCount = 1;
+		for (uint32_t j = chain->firstCluster + 1; j < chain->firstCluster + chain->clusterCount;
+			 j++) {
+			if (plan->locations[j] != plan->locations[j - 1] + 1) {
+				extentCount++;
+			}
+		}
+		report->extentCount += extentCount;
+		report->fragmentedChainCount += extentCount > 1;
+	}
+	for (uint32_t i = 1; i < plan->clusterCount; i++) {
+		seekCount += plan->locations[i] != plan->locations[i - 1] + 1;
+	}
+	if (plan->clusterCount > 1) {
+		report->score = 100.0 * seekCount / (plan->clusterCount - 1);
+	}
+}
+
+static bool isClusterFree(const DefragPlan* plan, uint16_t clusterId) {
+	return getNextClusterId(clusterId, plan->volume->fat) == FAT_FREE_CLUSTER;
+}
+
+/** Picks the free cluster to move a cluster sitting on a target out of the way, the highest free
+ * cluster is the least likely to be a target itself.
+ * @return The cluster id or 0 when there is no free cluster.
+ */
+static uint16_t findEvictionCluster(const DefragPlan* plan) {
+	for (uint32_t clusterId = plan->volume->fat12Info.clusterCount + 1; clusterId >= 2;
+		 clusterId--) {
+		if (isClusterFree(plan, clusterId)) {
+			return clusterId;
+		}
+	}
+	return 0;
+}
+
+static void addDefragMove(DefragBatch* batch, uint32_t logicalCluster, uint16_t destination) {
+	batch->moves[batch->moveCount] = logicalCluster;
+	batch->moveCount++;
+	batch->destinations[logicalCluster] = destination;
+}
+
+/** Fills a batch with moves of logical clusters to their targets starting at *position.
+ * Targets must be free when the batch starts, a target held by another cluster ends the batch. A
+ * batch that reaches such a target first only moves the cluster holding it out of the way.
+ */
+static void planDefragBatch(DefragPlan* plan, DefragBatch* batch, uint32_t* position) {
+	while (batch->moveCount < batch->maxMoves && *position < plan->clusterCount) {
+		uint32_t logicalCluster = *position;
+		uint16_t target = plan->targets[logicalCluster];
+		if (plan->locations[logicalCluster] == target) {
+			(*position)++;
+			continue;
+		}
+		if (isClusterFree(plan, target)) {
+			addDefragMove(batch, logicalCluster, target);
+			(*position)++;
+			continue;
+		}
+
+		// Destinations are only claimed in the fat on commit, so an eviction starts its own batch
+		// to not pick one of them. When this batch moves the owner, committing it frees target:
+		if (batch->moveCount == 0) {
+			addDefragMove(batch, plan->owners[target], findEvictionCluster(plan));
+		}
+		return;
+	}
+}
+
+/** Location of a logical cluster once the batch is committed. */
+static uint16_t getBatchLocation(const DefragPlan* plan, const DefragBatch* batch,
+								 uint32_t logicalCluster) {
+	uint16_t destination = batch->destinations[logicalCluster];
+	return destination != NO_BATCH_DESTINATION ? destination : plan->locations[logicalCluster];
+}
+
+static uint16_t getChainBatchLocation(const DefragPlan* plan, const DefragBatch* batch,
+									  int32_t chain) {
+	// ".." entries of the children of the root directory point to cluster 0:
+	return chain == -1 ? 0 : getBatchLocation(plan, batch, plan->chains[chain].firstCluster);
+}
+
+/** Points the entries of a copied directory cluster to where their chains are after the batch,
+ * including "." and ".." when the cluster is the first of its directory. */
+static void patchDirectoryCopy(const DefragPlan* plan, const DefragBatch* batch,
+							   uint32_t logicalCluster, FAT12DirectoryEntry* entries) {
+	uint32_t chainIndex = plan->chainOf[logicalCluster];
+	const DefragChain* chain = &plan->chains[chainIndex];
+	if (chain->firstCluster == logicalCluster && chain->hasDotEntries) {
+		entries[0].firstClusterId = getChainBatchLocation(plan, batch, chainIndex);
+		entries[1].firstClusterId = getChainBatchLocation(plan, batch, chain->parentChain);
+	}
+
+	for (uint32_t i = 0; i < plan->chainCount; i++) {
+		const DefragChain* child = &plan->chains[i];
+		if (child->entryCluster == (int32_t)logicalCluster) {
+			entries[child->entryOffset / sizeof(FAT12DirectoryEntry)].firstClusterId =
+				getBatchLocation(plan, batch, child->firstCluster);
+		}
+	}
+}
+
+static uint64_t getEntryDeviceOffset(const DefragPlan* plan, int32_t entryCluster,
+									 uint32_t entryOffset) {
+	const FAT12Info* info = &plan->volume->fat12Info;
+	if (entryCluster == -1) {
+		return (uint64_t)info->rootDirSectorOffset * info->bytesPerSector + entryOffset;
+	}
+	return getClusterDeviceOffset(plan->locations[entryCluster], info) + entryOffset;
+}
+
+/** Redirects what points to a moved cluster whose referrer stays in place: the fat entry of the
+ * previous cluster or the directory entry, and for directories the ".." entries of children. */
+static void redirectMovedCluster(FAT12Volume* volume, const DefragPlan* plan,
+								 const DefragBatch* batch, uint32_t logicalCluster) {
+	uint16_t destination = batch->destinations[logicalCluster];
+	uint32_t chainIndex = plan->chainOf[logicalCluster];
+	const DefragChain* chain = &plan->chains[chainIndex];
+
+	if (chain->firstCluster != logicalCluster) {
+		if (batch->destinations[logicalCluster - 1] == NO_BATCH_DESTINATION) {
+			setFat12VolumeEntry(volume, plan->locations[logicalCluster - 1], destination);
+		}
+		return;
+	}
+
+	if (chain->entryCluster == -1 ||
+		batch->destinations[chain->entryCluster] == NO_BATCH_DESTINATION) {
+		setFat12EntryFirstCluster(
+			volume, getEntryDeviceOffset(plan, chain->entryCluster, chain->entryOffset),
+			destination);
+	}
+	if (!chain->isDirectory) {
+		return;
+	}
+	for (uint32_t i = 0; i < plan->chainCount; i++) {
+		const DefragChain* child = &plan->chains[i];
+		if (child->parentChain == (int32_t)chainIndex && child->isDirectory &&
+			child->hasDotEntries &&
+			batch->destinations[child->firstCluster] == NO_BATCH_DESTINATION) {
+			setFat12EntryFirstCluster(volume,
+									  getEntryDeviceOffset(plan, (int32_t)child->firstCluster,
+														   sizeof(FAT12DirectoryEntry)),
+									  destination);
+		}
+	}
+}
+
+/** @return The cluster a copy has to link to, it is still outside of the batch when the successor
+ * stays in place. */
+static uint16_t getCopySuccessor(const DefragPlan* plan, const DefragBatch* batch,
+								 uint32_t logicalCluster) {
+	uint32_t chainIndex = plan->chainOf[logicalCluster];
+	if (logicalCluster + 1 == plan->clusterCount ||
+		plan->chainOf[logicalCluster + 1] != chainIndex) {
+		return FAT_LAST_CLUSTER_NUM;
+	}
+	return getBatchLocation(plan, batch, logicalCluster + 1);
+}
+
+/**
+ * Commits a batch in two flushes:
+ * 1. The copies are written and linked only to each other, a copy whose successor is not moved
+ *    ends the chain. Nothing points to them yet and they point to nothing live, so an interruption
+ *    only leaves them as lost clusters.
+ * 2. The copies are linked to their successors that stay in place, fat entries and directory
+ *    entries are redirected to the copies, then the old clusters are freed, which
+ *    flushFat12Volume orders as required.
+ */
+static void commitDefragBatch(DefragPlan* plan, DefragBatch* batch) {
+	FAT12Volume* volume = plan->volume;
+	const FAT12Info* info = &volume->fat12Info;
+
+	for (uint32_t i = 0; i < batch->moveCount; i++) {
+		uint32_t logicalCluster = batch->moves[i];
+		uint8_t* clusterData = batch->data + (uint64_t)i * volume->bytesPerCluster;
+		preadDevice(clusterData, volume->bytesPerCluster,
+					(int64_t)getClusterDeviceOffset(plan->locations[logicalCluster], info),
+					volume->loopDevicePath);
+		uint32_t chainIndex = plan->chainOf[logicalCluster];
+		if (plan->chains[chainIndex].isDirectory) {
+			patchDirectoryCopy(plan, batch, logicalCluster, (FAT12DirectoryEntry*)clusterData);
+		}
+
+		uint16_t destination = batch->destinations[logicalCluster];
+		pwriteDevice(clusterData, volume->bytesPerCluster,
+					 (int64_t)getClusterDeviceOffset(destination, info), volume->fileDescriptor);
+		uint16_t successor = getCopySuccessor(plan, batch, logicalCluster);
+		bool isSuccessorCopied = successor != FAT_LAST_CLUSTER_NUM &&
+								 batch->destinations[logicalCluster + 1] != NO_BATCH_DESTINATION;
+		setFat12VolumeEntry(volume, destination,
+							isSuccessorCopied ? successor : FAT_LAST_CLUSTER_NUM);
+	}
+	flushFat12Volume(volume);
+
+	for (uint32_t i = 0; i < batch->moveCount; i++) {
+		uint32_t logicalCluster = batch->moves[i];
+		setFat12VolumeEntry(volume, batch->destinations[logicalCluster],
+							getCopySuccessor(plan, batch, logicalCluster));
+		redirectMovedCluster(volume, plan, batch, logicalCluster);
+		releaseFat12Cluster(volume, plan->locations[logicalCluster]);
+	}
+	flushFat12Volume(volume);
+
+	for (uint32_t i = 0; i < batch->moveCount; i++) {
+		uint32_t logicalCluster = batch->moves[i];
+		plan->owners[plan->locations[logicalCluster]] = NO_OWNER;
+		plan->locations[logicalCluster] = batch->destinations[logicalCluster];
+		plan->owners[plan->locations[logicalCluster]] = (int32_t)logicalCluster;
+		batch->destinations[logicalCluster] = NO_BATCH_DESTINATION;
+	}
+	batch->moveCount = 0;
+}
+
+static bool hasFreeCluster(const DefragPlan* plan) { return findEvictionCluster(plan) != 0; }
+
+static bool isLaidOut(const DefragPlan* plan) {
+	for (uint32_t i = 0; i < plan->clusterCount; i++) {
+		if (plan->locations[i] != plan->targets[i]) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int defragFat12Volume(FAT12Volume* volume, FAT12FragmentationReport* before,
+					  FAT12FragmentationReport* after) {
+	DefragPlan plan;
+	if (!buildDefragPlan(&plan, volume)) {
+		(void)fprintf(stderr, "Filesystem has cross linked or broken cluster chains, not moving "
+							  "anything\n");
+		freeDefragPlan(&plan);
+		return -1;
+	}
+	measureFragmentation(&plan, before);
+	if (isLaidOut(&plan)) {
+		*after = *before;
+		freeDefragPlan(&plan);
+		return 0;
+	}
+	if (!hasFreeCluster(&plan)) {
+		(void)fprintf(stderr, "Filesystem is full, defrag needs a free cluster to move through\n");
+		freeDefragPlan(&plan);
+		return -1;
+	}
+
+	DefragBatch batch = {0};
+	batch.maxMoves = DEFRAG_BATCH_BYTES / volume->bytesPerCluster;
+	if (batch.maxMoves == 0) {
+		batch.maxMoves = 1;
+	}
+	batch.moves = xmalloc(batch.maxMoves * sizeof(uint32_t));
+	batch.data = xmalloc((uint64_t)batch.maxMoves * volume->bytesPerCluster);
+	batch.destinations = calloc(plan.clusterCount, sizeof(uint16_t));
+	if (!batch.destinations) {
+		perror("");
+		exit(-1);
+	}
+
+	uint32_t position = 0;
+	while (position < plan.clusterCount) {
+		planDefragBatch(&plan, &batch, &position);
+		if (batch.moveCount) {
+			commitDefragBatch(&plan, &batch);
+		}
+	}
+
+	measureFragmentation(&plan, after);
+	free(batch.moves);
+	free(batch.data);
+	free(batch.destinations);
+	freeDefragPlan(&plan);
+	return 0;
+}
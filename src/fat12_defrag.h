@@ -0,0 +1,41 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fat12_write.h"
+
+// Upper bound of the cluster data held in memory while relocating a batch of clusters:
+#define DEFRAG_BATCH_BYTES (1024 * 1024)
+
+/** Fragmentation of the reachable clusters, laid out in directory traversal order. */
+typedef struct FAT12FragmentationReport {
+	uint32_t chainCount;
+	uint32_t fragmentedChainCount;
+	uint32_t extentCount;  // Runs of consecutive clusters over all chains
+	uint32_t clusterCount;
+	// Percentage of consecutive cluster reads of a full traversal that are not adjacent on the
+	// device, 0 when a recursive walk followed by reading every file is one sequential sweep:
+	double score;
+} FAT12FragmentationReport;
+
+/**
+ * @brief Relocates every cluster chain so the filesystem is laid out in directory traversal order.
+ * A directory is placed right before its entries, each chain ends up in a single extent and files
+ * follow each other in the order a recursive walk reads them. Clusters that are allocated but not
+ * reachable from the root directory are left in place and skipped over.
+ *
+ * Clusters are moved in batches of at most DEFRAG_BATCH_BYTES, each batch is committed in two
+ * flushes. The copies are written and allocated first, linked only among themselves, so an
+ * interruption leaves them as lost clusters and never shares a live cluster. The second flush links
+ * them to the rest of their chains, redirects the fat and directory entries pointing to the old
+ * clusters and frees those last. It writes fat sectors before directory sectors, so only a crash
+ * between the two can leave the copy of a first cluster sharing its successor with the original.
+ *
+ * @param[in] volume
+ * @param[out] before Fragmentation measured before anything is moved.
+ * @param[out] after Fragmentation after the relocation.
+ * @return 0 on success, -1 when the filesystem is inconsistent or has no free cluster to move
+ * through (nothing is changed in both cases).
+ */
+int defragFat12Volume(FAT12Volume* volume, FAT12FragmentationReport* before,
+					  FAT12FragmentationReport* after);
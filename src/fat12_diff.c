@@ -0,0 +1,428 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "allocwrap.h"
+#include "fat12.h"
+#include "fat12_diff.h"
+#include "fat12_string.h"
+
+#define FIRST_IMAGE 0
+#define SECOND_IMAGE 1
+
+typedef struct DiffImage {
+	const char* loopDevicePath;
+	FAT12Header fat12Header;
+	FAT12Info fat12Info;
+	uint32_t bytesPerCluster;
+	uint8_t* fat;
+} DiffImage;
+
+typedef struct DiffContext {
+	DiffImage images[2];
+	// With the same layout cluster ids point to the same device offsets in both images, so equal
+	// fat entries mean equal chains:
+	bool isSameLayout;
+	bool* changedClusters;	// Cluster ids whose fat entry differs between the images
+	FAT12DiffStats* stats;
+} DiffContext;
+
+static bool isRangeEqual(const uint8_t* first, const uint8_t* second, uint64_t bytes) {
+	uint64_t i = 0;
+#ifdef __SSE2__
+	// 64 bytes per iteration, the four compares are combined before the single movemask:
+	for (; i + 4 * sizeof(__m128i) <= bytes; i += 4 * sizeof(__m128i)) {
+		__m128i equal = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(first + i)),
+									   _mm_loadu_si128((const __m128i*)(second + i)));
+		for (uint32_t j = 1; j < 4; j++) {
+			const uint64_t OFFSET = i + j * sizeof(__m128i);
+			__m128i firstBytes = _mm_loadu_si128((const __m128i*)(first + OFFSET));
+			__m128i secondBytes = _mm_loadu_si128((const __m128i*)(second + OFFSET));
+			equal = _mm_and_si128(equal, _mm_cmpeq_epi8(firstBytes, secondBytes));
+		}
+		if (_mm_movemask_epi8(equal) != 0xFFFF) {
+			return false;
+		}
+	}
+#endif
+
+	return memcmp(first + i, second + i, bytes - i) == 0;
+}
+
+static void readDiffImage(DiffContext* context, DiffImage* image, uint8_t* buffer, uint64_t bytes,
+						  uint64_t offset) {
+	preadDevice(buffer, bytes, (int64_t)offset, image->loopDevicePath);
+	context->stats->bytesRead += bytes;
+}
+
+static bool openDiffImage(DiffContext* context, DiffImage* image, const char* loopDevicePath) {
+	image->loopDevicePath = loopDevicePath;
+	uint64_t imageBytes = getDeviceBytes(loopDevicePath);
+	if (imageBytes < sizeof(FAT12Header)) {
+		(void)fprintf(stderr, "Can not read FAT12 header of %s\n", loopDevicePath);
+		return false;
+	}
+	readDiffImage(context, image, (uint8_t*)&image->fat12Header, sizeof(FAT12Header), 0);
+	const char* headerError = getFat12HeaderError(&image->fat12Header, imageBytes);
+	if (headerError) {
+		(void)fprintf(stderr, "Invalid FAT12 filesystem %s: %s\n", loopDevicePath, headerError);
+		return false;
+	}
+
+	const FAT12Info* info = &image->fat12Info;
+	loadFat12Info(&image->fat12Info, &image->fat12Header);
+	image->bytesPerCluster = info->bytesPerSector * info->sectorsPerCluster;
+	image->fat = getFat(&image->fat12Info, loopDevicePath);
+	context->stats->bytesRead += (uint64_t)info->fatSectorSize * info->bytesPerSector;
+	context->stats->imageBytes += (uint64_t)info->totalSectors * info->bytesPerSector;
+	return true;
+}
+
+static bool isSameLayout(const FAT12Info* first, const FAT12Info* second) {
+	return first->bytesPerSector == second->bytesPerSector &&
+		   first->sectorsPerCluster == second->sectorsPerCluster &&
+		   first->fatSectorSize == second->fatSectorSize &&
+		   first->clusterCount == second->clusterCount &&
+		   first->rootDirSectorsSize == second->rootDirSectorsSize &&
+		   first->dataSectionSectorOffset == second->dataSectionSectorOffset;
+}
+
+/** Compares the fats sector by sector and only decodes the entries of sectors that differ. */
+static void markChangedClusters(DiffContext* context) {
+	const FAT12Info* info = &context->images[FIRST_IMAGE].fat12Info;
+	const uint8_t* firstFat = context->images[FIRST_IMAGE].fat;
+	const uint8_t* secondFat = context->images[SECOND_IMAGE].fat;
+	const uint32_t LAST_CLUSTER_ID = info->clusterCount + 1;
+
+	context->changedClusters = calloc(LAST_CLUSTER_ID + 1, sizeof(bool));
+	if (!context->changedClusters) {
+		perror("");
+		exit(-1);
+	}
+	for (uint32_t sector = 0; sector < info->fatSectorSize; sector++) {
+		const uint64_t SECTOR_OFFSET = (uint64_t)sector * info->bytesPerSector;
+		if (isRangeEqual(firstFat + SECTOR_OFFSET, secondFat + SECTOR_OFFSET,
+						 info->bytesPerSector)) {
+			continue;
+		}
+
+		// An entry takes 1.5 bytes, one more id on each side covers entries crossing the sector:
+		uint64_t firstClusterId = SECTOR_OFFSET * 2 / 3;
+		firstClusterId = firstClusterId > 3 ? firstClusterId - 1 : 2;
+		uint64_t lastClusterId = (SECTOR_OFFSET + info->bytesPerSector) * 2 / 3 + 1;
+		if (lastClusterId > LAST_CLUSTER_ID) {
+			lastClusterId = LAST_CLUSTER_ID;
+		}
+		for (uint64_t clusterId = firstClusterId; clusterId <= lastClusterId; clusterId++) {
+			context->changedClusters[clusterId] =
+				getNextClusterId(clusterId, firstFat) != getNextClusterId(clusterId, secondFat);
+		}
+	}
+}
+
+static bool isChainUnchanged(const DiffContext* context, uint16_t firstClusterId) {
+	const FAT12Info* info = &context->images[FIRST_IMAGE].fat12Info;
+	uint16_t clusterId = firstClusterId;
+	for (uint32_t i = 0; isDataClusterId(clusterId, info) && i < info->clusterCount; i++) {
+		if (context->changedClusters[clusterId]) {
+			return false;
+		}
+		clusterId = getNextClusterId(clusterId, context->images[FIRST_IMAGE].fat);
+	}
+	return true;
+}
+
+/** Reads a whole cluster chain, clusters that follow each other on the device in a single read.
+ * @param[out] bytes Number of bytes read into the returned buffer.
+ */
+static uint8_t* readDiffChain(DiffContext* context, DiffImage* image, uint16_t firstClusterId,
+							  uint64_t* bytes) {
+	const FAT12Info* info = &image->fat12Info;
+	uint16_t* clusterIds = xmalloc((uint64_t)info->clusterCount * sizeof(uint16_t));
+	uint32_t clusterCount = 0;
+	uint16_t clusterId = firstClusterId;
+	while (isDataClusterId(clusterId, info) && clusterCount < info->clusterCount) {
+		clusterIds[clusterCount] = clusterId;
+		clusterCount++;
+		clusterId = getNextClusterId(clusterId, image->fat);
+	}
+
+	uint8_t* data = xmalloc((uint64_t)clusterCount * image->bytesPerCluster);
+	uint32_t runStart = 0;
+	for (uint32_t i = 1; i <= clusterCount; i++) {
+		if (i < clusterCount && clusterIds[i] == clusterIds[i - 1] + 1) {
+			continue;
+		}
+		readDiffImage(context, image, data + (uint64_t)runStart * image->bytesPerCluster,
+					  (uint64_t)(i - runStart) * image->bytesPerCluster,
+					  getClusterDeviceOffset(clusterIds[runStart], info));
+		runStart = i;
+	}
+
+	free(clusterIds);
+	*bytes = (uint64_t)clusterCount * image->bytesPerCluster;
+	return data;
+}
+
+static bool isFileModified(DiffContext* context, const FAT12DirectoryEntry* firstEntry,
+						   const FAT12DirectoryEntry* secondEntry) {
+	if (firstEntry->fileSizeInBytes != secondEntry->fileSizeInBytes ||
+		firstEntry->attributes != secondEntry->attributes) {
+		return true;
+	}
+	if (firstEntry->fileSizeInBytes == 0) {
+		return false;
+	}
+	// Timestamps change whenever a file is written, so an identical entry over an identical chain
+	// means the same content. Anything else is settled by comparing the contents:
+	if (context->isSameLayout &&
+		memcmp(firstEntry, secondEntry, sizeof(FAT12DirectoryEntry)) == 0 &&
+		isChainUnchanged(context, firstEntry->firstClusterId)) {
+		return false;
+	}
+
+	uint64_t firstBytes;
+	uint64_t secondBytes;
+	uint8_t* firstData = readDiffChain(context, &context->images[FIRST_IMAGE],
+									   firstEntry->firstClusterId, &firstBytes);
+	uint8_t* secondData = readDiffChain(context, &context->images[SECOND_IMAGE],
+										secondEntry->firstClusterId, &secondBytes);
+	uint64_t size = firstEntry->fileSizeInBytes;
+	bool isModified = firstBytes < size || secondBytes < size
+						  ? firstBytes != secondBytes
+						  : !isRangeEqual(firstData, secondData, size);
+	free(firstData);
+	free(secondData);
+	return isModified;
+}
+
+static bool isListedEntry(FAT12DirectoryEntry* entry) {
+	return !isDeletedEntry(entry) && !isVolumeLabelEntry(entry) && !isDotDirectoryEntry(entry);
+}
+
+/** @return Number of entries before the end of the directory. */
+static uint32_t countDirectoryEntries(FAT12DirectoryEntry* entries, uint32_t maxEntries) {
+	uint32_t count = 0;
+	while (count < maxEntries && !isFinalDirectoryEntry(&entries[count])) {
+		count++;
+	}
+	return count;
+}
+
+static void printDiffPath(char change, const char* directoryPath, FAT12DirectoryEntry* entry) {
+	char* name = fatFileNameToStr(entry->fileName);
+	bool needsSeparator = directoryPath[strlen(directoryPath) - 1] != '/';
+	printf("%c %s%s%s%s\n", change, directoryPath, needsSeparator ? "/" : "", name,
+		   isDirectoryEntryDirectory(entry) ? "/" : "");
+	free(name);
+}
+
+static char* joinDiffPath(const char* directoryPath, FAT12DirectoryEntry* entry) {
+	char* name = fatFileNameToStr(entry->fileName);
+	uint64_t directoryLength = strlen(directoryPath);
+	bool needsSeparator = directoryPath[directoryLength - 1] != '/';
+
+	char* path = xmalloc(directoryLength + needsSeparator + strlen(name) + 1);
+	strcpy(path, directoryPath);
+	if (needsSeparator) {
+		strcat(path, "/");
+	}
+	strcat(path, name);
+	free(name);
+	return path;
+}
+
+/** Looks for the entry called like entry, checking the same position first since unchanged
+ * directories keep their order. */
+static int64_t findMatchingEntry(FAT12DirectoryEntry* entry, uint32_t index,
+								 FAT12DirectoryEntry* entries, uint32_t entriesCount) {
+	if (index < entriesCount && isListedEntry(&entries[index]) &&
+		memcmp(entries[index].fileName, entry->fileName, sizeof(entry->fileName)) == 0) {
+		return index;
+	}
+	for (uint32_t i = 0; i < entriesCount; i++) {
+		if (isListedEntry(&entries[i]) &&
+			memcmp(entries[i].fileName, entry->fileName, sizeof(entry->fileName)) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void diffDirectories(DiffContext* context, FAT12DirectoryEntry* firstEntries,
+							uint32_t firstCount, FAT12DirectoryEntry* secondEntries,
+							uint32_t secondCount, const char* path, uint32_t depth);
+static void diffSubDirectories(DiffContext* context, FAT12DirectoryEntry* firstEntry,
+							   FAT12DirectoryEntry* secondEntry, const char* path,
+							   uint32_t depth);
+
+/** Walks a directory whose clusters are identical in both images, so every entry matches itself.
+ * Changes in sub directories do not touch the clusters of their parent, those are still followed,
+ * files are only compared when their chain changed. */
+static void diffUnchangedDirectory(DiffContext* context, FAT12DirectoryEntry* entries,
+								   uint32_t entriesCount, const char* path, uint32_t depth) {
+	entriesCount = countDirectoryEntries(entries, entriesCount);
+	for (uint32_t i = 0; i < entriesCount; i++) {
+		FAT12DirectoryEntry* entry = &entries[i];
+		if (!isListedEntry(entry)) {
+			continue;
+		}
+		if (isDirectoryEntryDirectory(entry)) {
+			char* subPath = joinDiffPath(path, entry);
+			diffSubDirectories(context, entry, entry, subPath, depth);
+			free(subPath);
+		} else if (isFileModified(context, entry, entry)) {
+			printDiffPath('M', path, entry);
+			context->stats->modifiedCount++;
+		}
+	}
+}
+
+static void diffSubDirectories(DiffContext* context, FAT12DirectoryEntry* firstEntry,
+							   FAT12DirectoryEntry* secondEntry, const char* path,
+							   uint32_t depth) {
+	// Every nested directory takes a cluster, deeper means the chains loop:
+	if (depth > context->images[FIRST_IMAGE].fat12Info.clusterCount) {
+		return;
+	}
+
+	uint64_t firstBytes;
+	uint64_t secondBytes;
+	FAT12DirectoryEntry* firstEntries = (FAT12DirectoryEntry*)readDiffChain(
+		context, &context->images[FIRST_IMAGE], firstEntry->firstClusterId, &firstBytes);
+	FAT12DirectoryEntry* secondEntries = (FAT12DirectoryEntry*)readDiffChain(
+		context, &context->images[SECOND_IMAGE], secondEntry->firstClusterId, &secondBytes);
+	// Same entry over the same chain with the same clusters, no entry needs to be matched:
+	bool isDirectoryUnchanged =
+		context->isSameLayout &&
+		memcmp(firstEntry, secondEntry, sizeof(FAT12DirectoryEntry)) == 0 &&
+		isChainUnchanged(context, firstEntry->firstClusterId) && firstBytes == secondBytes &&
+		isRangeEqual((uint8_t*)firstEntries, (uint8_t*)secondEntries, firstBytes);
+	if (isDirectoryUnchanged) {
+		diffUnchangedDirectory(context, firstEntries, firstBytes / sizeof(FAT12DirectoryEntry),
+							   path, depth + 1);
+	} else {
+		diffDirectories(context, firstEntries, firstBytes / sizeof(FAT12DirectoryEntry),
+						secondEntries, secondBytes / sizeof(FAT12DirectoryEntry), path, depth + 1);
+	}
+	free(firstEntries);
+	free(secondEntries);
+}
+
+static void diffDirectories(DiffContext* context, FAT12DirectoryEntry* firstEntries,
+							uint32_t firstCount, FAT12DirectoryEntry* secondEntries,
+							uint32_t secondCount, const char* path, uint32_t depth) {
+	firstCount = countDirectoryEntries(firstEntries, firstCount);
+	secondCount = countDirectoryEntries(secondEntries, secondCount);
+	bool* isMatched = calloc(secondCount ? secondCount : 1, sizeof(bool));
+	if (!isMatched) {
+		perror("");
+		exit(-1);
+	}
+
+	for (uint32_t i = 0; i < firstCount; i++) {
+		FAT12DirectoryEntry* firstEntry = &firstEntries[i];
+		if (!isListedEntry(firstEntry)) {
+			continue;
+		}
+		int64_t matchIndex = findMatchingEntry(firstEntry, i, secondEntries, secondCount);
+		if (matchIndex == -1) {
+			printDiffPath('D', path, firstEntry);
+			context->stats->removedCount++;
+			continue;
+		}
+		isMatched[matchIndex] = true;
+
+		FAT12DirectoryEntry* secondEntry = &secondEntries[matchIndex];
+		bool isDirectory = isDirectoryEntryDirectory(firstEntry);
+		if (isDirectory != isDirectoryEntryDirectory(secondEntry)) {
+			printDiffPath('D', path, firstEntry);
+			printDiffPath('A', path, secondEntry);
+			context->stats->removedCount++;
+			context->stats->addedCount++;
+		} else if (isDirectory) {
+			char* subPath = joinDiffPath(path, firstEntry);
+			diffSubDirectories(context, firstEntry, secondEntry, subPath, depth);
+			free(subPath);
+		} else if (isFileModified(context, firstEntry, secondEntry)) {
+			printDiffPath('M', path, firstEntry);
+			context->stats->modifiedCount++;
+		}
+	}
+
+	for (uint32_t i = 0; i < secondCount; i++) {
+		if (!isMatched[i] && isListedEntry(&secondEntries[i])) {
+			printDiffPath('A', path, &secondEntries[i]);
+			context->stats->addedCount++;
+		}
+	}
+	free(isMatched);
+}
+
+static FAT12DirectoryEntry* readDiffRootDirectory(DiffContext* context, DiffImage* image,
+												  uint32_t* entriesCount) {
+	const FAT12Info* info = &image->fat12Info;
+	const uint64_t ROOT_DIR_BYTES = (uint64_t)info->rootDirSectorsSize * info->bytesPerSector;
+	FAT12DirectoryEntry* entries = xmalloc(ROOT_DIR_BYTES);
+	readDiffImage(context, image, (uint8_t*)entries, ROOT_DIR_BYTES,
+				  (uint64_t)info->rootDirSectorOffset * info->bytesPerSector);
+	*entriesCount = ROOT_DIR_BYTES / sizeof(FAT12DirectoryEntry);
+	return entries;
+}
+
+/** Compares the root regions sector by sector, stopping at the first sector that differs. */
+static bool isRootDirectoryUnchanged(const FAT12Info* info, FAT12DirectoryEntry* firstEntries,
+									 FAT12DirectoryEntry* secondEntries) {
+	for (uint32_t sector = 0; sector < info->rootDirSectorsSize; sector++) {
+		const uint64_t SECTOR_OFFSET = (uint64_t)sector * info->bytesPerSector;
+		if (!isRangeEqual((uint8_t*)firstEntries + SECTOR_OFFSET,
+						  (uint8_t*)secondEntries + SECTOR_OFFSET, info->bytesPerSector)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int diffFat12Images(const char* firstLoopDevicePath, const char* secondLoopDevicePath,
+					FAT12DiffStats* stats) {
+	DiffContext context = {0};
+	memset(stats, 0, sizeof(FAT12DiffStats));
+	context.stats = stats;
+	if (!openDiffImage(&context, &context.images[FIRST_IMAGE], firstLoopDevicePath)) {
+		return -1;
+	}
+	if (!openDiffImage(&context, &context.images[SECOND_IMAGE], secondLoopDevicePath)) {
+		free(context.images[FIRST_IMAGE].fat);
+		return -1;
+	}
+	context.isSameLayout = isSameLayout(&context.images[FIRST_IMAGE].fat12Info,
+										&context.images[SECOND_IMAGE].fat12Info);
+	if (context.isSameLayout) {
+		markChangedClusters(&context);
+	}
+
+	uint32_t firstCount;
+	uint32_t secondCount;
+	FAT12DirectoryEntry* firstEntries =
+		readDiffRootDirectory(&context, &context.images[FIRST_IMAGE], &firstCount);
+	FAT12DirectoryEntry* secondEntries =
+		readDiffRootDirectory(&context, &context.images[SECOND_IMAGE], &secondCount);
+	if (context.isSameLayout && isRootDirectoryUnchanged(&context.images[FIRST_IMAGE].fat12Info,
+														 firstEntries, secondEntries)) {
+		diffUnchangedDirectory(&context, firstEntries, firstCount, "/", 0);
+	} else {
+		diffDirectories(&context, firstEntries, firstCount, secondEntries, secondCount, "/", 0);
+	}
+
+	free(firstEntries);
+	free(secondEntries);
+	free(context.changedClusters);
+	free(context.images[FIRST_IMAGE].fat);
+	free(context.images[SECOND_IMAGE].fat);
+	return 0;
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include <stdint.h>
+
+/** Outcome of a diff, bytes count what was read from both images together. */
+typedef struct FAT12DiffStats {
+	uint64_t addedCount;
+	uint64_t removedCount;
+	uint64_t modifiedCount;
+	uint64_t bytesRead;
+	uint64_t imageBytes;
+} FAT12DiffStats;
+
+/**
+ * @brief Prints the paths that differ between two FAT12 images, one per line prefixed with
+ * A (only in the second image), D (only in the first image) or M (modified). Directories that
+ * exist in one image only are printed once with a trailing '/', without their content.
+ *
+ * A file is modified when its size, attributes or content differ, timestamps and the clusters it
+ * is stored in are ignored. When both images share the same layout, the fats are compared sector by
+ * sector first, and a file whose directory entry and cluster chain are identical in both images is
+ * considered unchanged without reading it. Contents are only read and compared when the entry or
+ * the chain differ. A directory whose clusters are identical in both images, the root region
+ * compared sector by sector, is walked without matching its entries by name.
+ *
+ * @param[in] firstLoopDevicePath
+ * @param[in] secondLoopDevicePath
+ * @param[out] stats
+ * @return 0 when a diff was produced, -1 when one of the images is not a valid FAT12 filesystem.
+ */
+int diffFat12Images(const char* firstLoopDevicePath, const char* secondLoopDevicePath,
+					FAT12DiffStats* stats);
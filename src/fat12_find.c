@@ -0,0 +1,277 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocwrap.h"
+#include "fat12.h"
+#include "fat12_find.h"
+#include "fat12_string.h"
+
+#define FAT_TIME_MAX 0xFFFF
+
+typedef struct FindWalk {
+	const FAT12FindFilter* filter;
+	const uint8_t* fat;
+	FAT12Info* fat12Info;
+	const char* loopDevicePath;
+	const char* rootPath;
+
+	// Raw 8.3 names of the directories between the root path and the current directory:
+	const char** nameStack;
+	uint32_t nameStackCapacity;
+
+	bool canMatchFiles;
+	bool canMatchDirectories;
+	bool isDone;
+	uint64_t matchCount;
+} FindWalk;
+
+void initFindFilter(FAT12FindFilter* filter) {
+	memset(filter, 0, sizeof(FAT12FindFilter));
+	filter->type = FIND_TYPE_ANY;
+	filter->maxSize = UINT32_MAX;
+	filter->maxCreation = UINT32_MAX;
+	filter->maxModify = UINT32_MAX;
+	filter->maxDepth = UINT32_MAX;
+}
+
+/** Parses DATE of a -cfrom/-cto/-mfrom/-mto option. A date without a time covers the whole day, so
+ * it starts at 00:00:00 for lower bounds and ends after the last possible time for upper bounds. */
+static bool parseFatDateTime(uint32_t* encoded, const char* str, bool isUpperBound) {
+	uint32_t year;
+	uint32_t month;
+	uint32_t day;
+	uint32_t hour = 0;
+	uint32_t minute = 0;
+	uint32_t second = 0;
+	int fieldCount = sscanf(str, "%u-%u-%uT%u:%u:%u", &year, &month, &day, &hour, &minute, &second);
+	if (fieldCount != 3 && fieldCount != 6) {
+		return false;
+	}
+	if (year < FAT_YEAR_BASE || year > FAT_YEAR_MAX || month < 1 || month > 12 || day < 1 ||
+		day > 31 || hour > 23 || minute > 59 || second > 59) {
+		return false;
+	}
+
+	*encoded = encodeFatDateTime(year, month, day, hour, minute, second);
+	if (fieldCount == 3 && isUpperBound) {
+		*encoded |= FAT_TIME_MAX;
+	}
+	return true;
+}
+
+static bool parseFindNumber(uint32_t* value, const char* str, uint32_t maxValue) {
+	char* end;
+	unsigned long parsed = strtoul(str, &end, 0);
+	if (*str == '\0' || *end != '\0' || parsed > maxValue) {
+		return false;
+	}
+	*value = parsed;
+	return true;
+}
+
+static bool applyFindOption(FAT12FindFilter* filter, const char* option, const char* value) {
+	uint32_t number;
+	if (strcmp(option, "-type") == 0) {
+		if (strcmp(value, "f") == 0) {
+			filter->type = FIND_TYPE_FILE;
+			return true;
+		}
+		if (strcmp(value, "d") == 0) {
+			filter->type = FIND_TYPE_DIRECTORY;
+			return true;
+		}
+		return false;
+	}
+	if (strcmp(option, "-minsize") == 0) {
+		return parseFindNumber(&filter->minSize, value, UINT32_MAX);
+	}
+	if (strcmp(option, "-maxsize") == 0) {
+		return parseFindNumber(&filter->maxSize, value, UINT32_MAX);
+	}
+	if (strcmp(option, "-attr") == 0 && parseFindNumber(&number, value, UINT8_MAX)) {
+		filter->requiredAttributes = number;
+		return true;
+	}
+	if (strcmp(option, "-noattr") == 0 && parseFindNumber(&number, value, UINT8_MAX)) {
+		filter->excludedAttributes = number;
+		return true;
+	}
+	if (strcmp(option, "-cluster") == 0 && parseFindNumber(&number, value, UINT16_MAX)) {
+		filter->hasFirstClusterId = true;
+		filter->firstClusterId = number;
+		return true;
+	}
+	if (strcmp(option, "-maxdepth") == 0) {
+		return parseFindNumber(&filter->maxDepth, value, UINT32_MAX);
+	}
+	if (strcmp(option, "-cfrom") == 0) {
+		return parseFatDateTime(&filter->minCreation, value, false);
+	}
+	if (strcmp(option, "-cto") == 0) {
+		return parseFatDateTime(&filter->maxCreation, value, true);
+	}
+	if (strcmp(option, "-mfrom") == 0) {
+		return parseFatDateTime(&filter->minModify, value, false);
+	}
+	if (strcmp(option, "-mto") == 0) {
+		return parseFatDateTime(&filter->maxModify, value, true);
+	}
+	return false;
+}
+
+bool parseFindFilter(FAT12FindFilter* filter, int argc, char** argv) {
+	for (int i = 0; i < argc; i += 2) {
+		if (i + 1 >= argc) {
+			(void)fprintf(stderr, "find: missing value for %s\n", argv[i]);
+			return false;
+		}
+		if (!applyFindOption(filter, argv[i], argv[i + 1])) {
+			(void)fprintf(stderr, "find: invalid option %s %s\n", argv[i], argv[i + 1]);
+			return false;
+		}
+	}
+	return true;
+}
+
+bool isFindFilterMatch(const FAT12FindFilter* filter, const FAT12DirectoryEntry* entry) {
+	bool isDirectory = isDirectoryEntryDirectory(entry);
+	if ((filter->type == FIND_TYPE_FILE && isDirectory) ||
+		(filter->type == FIND_TYPE_DIRECTORY && !isDirectory)) {
+		return false;
+	}
+	if (entry->fileSizeInBytes < filter->minSize || entry->fileSizeInBytes > filter->maxSize) {
+		return false;
+	}
+	if ((entry->attributes & filter->requiredAttributes) != filter->requiredAttributes ||
+		(entry->attributes & filter->excludedAttributes) != 0) {
+		return false;
+	}
+	if (filter->hasFirstClusterId && entry->firstClusterId != filter->firstClusterId) {
+		return false;
+	}
+
+	uint32_t creation = ((uint32_t)entry->creationDate << 16) | entry->creationTime;
+	uint32_t modify = ((uint32_t)entry->lastModifyDate << 16) | entry->lastModifyTime;
+	return creation >= filter->minCreation && creation <= filter->maxCreation &&
+		   modify >= filter->minModify && modify <= filter->maxModify;
+}
+
+static bool isEmptyRange(uint32_t min, uint32_t max) { return min > max; }
+
+/** Decides up front which entry kinds can possibly match, so the walk can skip them with a single
+ * attribute check and skip reading the whole tree when nothing can match. */
+static void initFindWalkPruning(FindWalk* walk) {
+	const FAT12FindFilter* filter = walk->filter;
+	bool canMatchAnything = !isEmptyRange(filter->minSize, filter->maxSize) &&
+							!isEmptyRange(filter->minCreation, filter->maxCreation) &&
+							!isEmptyRange(filter->minModify, filter->maxModify) &&
+							(filter->requiredAttributes & filter->excludedAttributes) == 0 &&
+							filter->maxDepth > 0;
+
+	walk->canMatchFiles = canMatchAnything && filter->type != FIND_TYPE_DIRECTORY &&
+						  !(filter->requiredAttributes & FAT12_ATTR_DIRECTORY);
+	// Directory entries always have a size of 0:
+	walk->canMatchDirectories = canMatchAnything && filter->type != FIND_TYPE_FILE &&
+								!(filter->excludedAttributes & FAT12_ATTR_DIRECTORY) &&
+								filter->minSize == 0;
+}
+
+static void printFindMatch(FindWalk* walk, uint32_t depth) {
+	uint64_t rootPathLength = strlen(walk->rootPath);
+	bool needsSeparator = rootPathLength == 0 || walk->rootPath[rootPathLength - 1] != '/';
+
+	(void)fputs(walk->rootPath, stdout);
+	for (uint32_t i = 0; i < depth; i++) {
+		char* name = fatFileNameToStr((char*)walk->nameStack[i]);
+		if (i > 0 || needsSeparator) {
+			(void)putchar('/');
+		}
+		(void)fputs(name, stdout);
+		free(name);
+	}
+	(void)putchar('\n');
+}
+
+static void pushFindName(FindWalk* walk, uint32_t depth, const char* fileName) {
+	if (depth >= walk->nameStackCapacity) {
+		walk->nameStackCapacity = walk->nameStackCapacity ? walk->nameStackCapacity * 2 : 8;
+		walk->nameStack = xrealloc((void*)walk->nameStack, walk->nameStackCapacity * sizeof(char*));
+	}
+	walk->nameStack[depth] = fileName;
+}
+
+static void walkFindDirectory(FindWalk* walk, FAT12DirectoryEntry* dirEntries, uint32_t maxEntries,
+							  uint32_t depth) {
+	for (uint32_t i = 0; i < maxEntries && !walk->isDone; i++) {
+		FAT12DirectoryEntry* entry = &dirEntries[i];
+		if (isFinalDirectoryEntry(entry)) {
+			break;
+		}
+		if (isDeletedEntry(entry) || isVolumeLabelEntry(entry) || isDotDirectoryEntry(entry)) {
+			continue;
+		}
+
+		bool isDirectory = isDirectoryEntryDirectory(entry);
+		bool canMatch = isDirectory ? walk->canMatchDirectories : walk->canMatchFiles;
+		if (canMatch && isFindFilterMatch(walk->filter, entry)) {
+			pushFindName(walk, depth, entry->fileName);
+			printFindMatch(walk, depth + 1);
+			walk->matchCount++;
+			// First cluster ids are unique, nothing else can match. Empty files all share
+			// cluster 0:
+			walk->isDone = walk->filter->hasFirstClusterId && walk->filter->firstClusterId != 0;
+		}
+
+		if (!isDirectory || depth + 1 >= walk->filter->maxDepth || walk->isDone) {
+			continue;
+		}
+		FAT12DirectoryEntry* subEntries;
+		uint32_t subEntriesBytes = getFileContentWithFat(
+			(uint8_t**)&subEntries, entry, walk->fat, walk->fat12Info, walk->loopDevicePath);
+		pushFindName(walk, depth, entry->fileName);
+		walkFindDirectory(walk, subEntries, subEntriesBytes / sizeof(FAT12DirectoryEntry),
+						  depth + 1);
+		free(subEntries);
+	}
+}
+
+uint64_t findEntries(const FAT12FindFilter* filter, FAT12DirectoryEntry* entry, const char* path,
+					 FAT12Info* fat12Info, const char* loopDevicePath) {
+	FindWalk walk = {
+		.filter = filter,
+		.fat12Info = fat12Info,
+		.loopDevicePath = loopDevicePath,
+		.rootPath = path,
+	};
+	initFindWalkPruning(&walk);
+	if (!walk.canMatchFiles && !walk.canMatchDirectories) {
+		return 0;
+	}
+	// Cluster 0 is stored by empty files, every other id has to name a data cluster:
+	if (filter->hasFirstClusterId && filter->firstClusterId != 0 &&
+		!isDataClusterId(filter->firstClusterId, fat12Info)) {
+		(void)fprintf(stderr, "find: -cluster %u is not a data cluster, valid ids are 0 and 2-%u\n",
+					  filter->firstClusterId, fat12Info->clusterCount + 1);
+		return 0;
+	}
+
+	walk.fat = getFat(fat12Info, loopDevicePath);
+	FAT12DirectoryEntry* dirEntries;
+	uint32_t entriesCount;
+	if (entry) {
+		uint32_t dirBytes = getFileContentWithFat((uint8_t**)&dirEntries, entry, walk.fat,
+												  fat12Info, loopDevicePath);
+		entriesCount = dirBytes / sizeof(FAT12DirectoryEntry);
+	} else {
+		entriesCount = getRootDirectoryEntries(&dirEntries, fat12Info, loopDevicePath);
+	}
+	walkFindDirectory(&walk, dirEntries, entriesCount, 0);
+
+	free(dirEntries);
+	free((void*)walk.nameStack);
+	free((void*)walk.fat);
+	return walk.matchCount;
+}
@@ -0,0 +1,61 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fat12.h"
+
+typedef enum FindEntryType { FIND_TYPE_ANY, FIND_TYPE_FILE, FIND_TYPE_DIRECTORY } FindEntryType;
+
+/** Filters of a find query. They are compared directly against the packed FAT12DirectoryEntry
+ * fields, date ranges hold the raw FAT encoding as (date << 16) | time so a single integer compare
+ * orders them. A default initialized filter (see initFindFilter) matches every entry.
+ */
+typedef struct FAT12FindFilter {
+	FindEntryType type;
+	uint32_t minSize;
+	uint32_t maxSize;
+	uint8_t requiredAttributes;	 // Every bit must be set in the entry attributes
+	uint8_t excludedAttributes;	 // No bit may be set in the entry attributes
+	bool hasFirstClusterId;
+	uint16_t firstClusterId;
+	uint32_t minCreation;
+	uint32_t maxCreation;
+	uint32_t minModify;
+	uint32_t maxModify;
+	uint32_t maxDepth;	// Depth 1 are the entries directly inside the searched directory
+} FAT12FindFilter;
+
+/** Initializes filter to match every entry. */
+void initFindFilter(FAT12FindFilter* filter);
+
+/** Parses find command line options into filter, prints the problem to stderr on failure.
+ * Supported options:
+ * -type f|d, -minsize N, -maxsize N, -attr MASK, -noattr MASK, -cluster ID, -maxdepth N,
+ * -cfrom DATE, -cto DATE, -mfrom DATE, -mto DATE
+ * Where DATE is YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS.
+ *
+ * @param[out] filter Initialized filter the options are applied to.
+ * @param[in] argc Amount of options in argv.
+ * @param[in] argv The options.
+ * @return true when all options were valid.
+ */
+bool parseFindFilter(FAT12FindFilter* filter, int argc, char** argv);
+
+/** Checks entry against every filter without converting its name or allocating. */
+bool isFindFilterMatch(const FAT12FindFilter* filter, const FAT12DirectoryEntry* entry);
+
+/**
+ * @brief Walks the tree below entry and prints the path of every entry matching filter.
+ * Subtrees are pruned when the filter can not match anything inside of them, names are only
+ * converted to strings for printed entries.
+ *
+ * @param[in] filter
+ * @param[in] entry Directory entry of the directory to search, NULL for the root directory.
+ * @param[in] path Path of entry, used as the prefix of the printed paths.
+ * @param[in] fat12Info
+ * @param[in] loopDevicePath
+ *
+ * @return Number of matching entries.
+ */
+uint64_t findEntries(const FAT12FindFilter* filter, FAT12DirectoryEntry* entry, const char* path,
+					 FAT12Info* fat12Info, const char* loopDevicePath);
@@ -0,0 +1,146 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fat12.h"
+#include "fat12_geometry.h"
+
+#define ALWAYS_INLINE inline __attribute__((always_inline))
+
+// The templates below take the geometry as arguments. Specialized variants pass constants so
+// after inlining every multiplication and division by them is folded into shifts, the generic
+// variant passes the runtime values of FAT12Info.
+
+static ALWAYS_INLINE uint64_t clusterDeviceOffsetTemplate(uint16_t clusterId,
+														  const FAT12Info* fat12Info,
+														  uint32_t bytesPerSector,
+														  uint32_t sectorsPerCluster) {
+	uint64_t dataSectionOffset = (uint64_t)fat12Info->dataSectionSectorOffset * bytesPerSector;
+	uint64_t clusterOffset =
+		(uint64_t)clusterIdToClusterNum(clusterId) * (bytesPerSector * sectorsPerCluster);
+	return dataSectionOffset + clusterOffset;
+}
+
+static ALWAYS_INLINE uint32_t walkClusterChainTemplate(uint64_t* offsets, uint32_t maxClusters,
+													   uint16_t firstClusterId, const uint8_t* fat,
+													   const FAT12Info* fat12Info,
+													   uint32_t bytesPerSector,
+													   uint32_t sectorsPerCluster) {
+	// Cluster id 2 is the first cluster of the data section:
+	const uint64_t FIRST_CLUSTER_OFFSET =
+		(uint64_t)fat12Info->dataSectionSectorOffset * bytesPerSector -
+		2 * (uint64_t)(bytesPerSector * sectorsPerCluster);
+
+	uint32_t count = 0;
+	uint16_t clusterId = firstClusterId;
+	while (count < maxClusters && isDataClusterId(clusterId, fat12Info)) {
+		offsets[count] =
+			FIRST_CLUSTER_OFFSET + (uint64_t)clusterId * (bytesPerSector * sectorsPerCluster);
+		count++;
+		clusterId = getNextClusterId(clusterId, fat);
+	}
+
+	return count;
+}
+
+static ALWAYS_INLINE uint32_t countDirectoryEntriesTemplate(const FAT12DirectoryEntry* dirEntries,
+															uint32_t sectorCount,
+															uint32_t bytesPerSector) {
+	const uint32_t ENTRIES_PER_SECTOR = bytesPerSector / sizeof(FAT12DirectoryEntry);
+
+	uint32_t count = 0;
+	for (uint32_t sector = 0; sector < sectorCount; sector++) {
+		const FAT12DirectoryEntry* sectorEntries =
+			dirEntries + (uint64_t)sector * ENTRIES_PER_SECTOR;
+		for (uint32_t i = 0; i < ENTRIES_PER_SECTOR; i++) {
+			const FAT12DirectoryEntry* entry = &sectorEntries[i];
+			uint8_t firstChar = (uint8_t)entry->fileName[0];
+			if (firstChar == FINAL_ENTRY) {
+				return count;
+			}
+			count += firstChar != DELETED_ENTRY && !(entry->attributes & VOLUME_LABEL_ATTRIBUTE);
+		}
+	}
+
+	return count;
+}
+
+/** Stamps out a FAT12GeometryOps variant for a constant bytesPerSector and sectorsPerCluster. */
+#define DEFINE_GEOMETRY_OPS(BYTES_PER_SECTOR, SECTORS_PER_CLUSTER)                                 \
+	static uint64_t clusterDeviceOffset##BYTES_PER_SECTOR##x##SECTORS_PER_CLUSTER(                 \
+		uint16_t clusterId, const FAT12Info* fat12Info) {                                          \
+		return clusterDeviceOffsetTemplate(clusterId, fat12Info, BYTES_PER_SECTOR,                 \
+										   SECTORS_PER_CLUSTER);                                   \
+	}                                                                                              \
+	static uint32_t walkClusterChain##BYTES_PER_SECTOR##x##SECTORS_PER_CLUSTER(                    \
+		uint64_t* offsets, uint32_t maxClusters, uint16_t firstClusterId, const uint8_t* fat,      \
+		const FAT12Info* fat12Info) {                                                              \
+		return walkClusterChainTemplate(offsets, maxClusters, firstClusterId, fat, fat12Info,      \
+										BYTES_PER_SECTOR, SECTORS_PER_CLUSTER);                    \
+	}                                                                                              \
+	static uint32_t countDirectoryEntries##BYTES_PER_SECTOR##x##SECTORS_PER_CLUSTER(               \
+		const FAT12DirectoryEntry* dirEntries, uint32_t sectorCount, const FAT12Info* fat12Info) { \
+		(void)fat12Info;                                                                           \
+		return countDirectoryEntriesTemplate(dirEntries, sectorCount, BYTES_PER_SECTOR);           \
+	}                                                                                              \
+	static const FAT12GeometryOps geometryOps##BYTES_PER_SECTOR##x##SECTORS_PER_CLUSTER = {        \
+		.name = #BYTES_PER_SECTOR "x" #SECTORS_PER_CLUSTER,                                        \
+		.clusterDeviceOffset = clusterDeviceOffset##BYTES_PER_SECTOR##x##SECTORS_PER_CLUSTER,      \
+		.walkClusterChain = walkClusterChain##BYTES_PER_SECTOR##x##SECTORS_PER_CLUSTER,            \
+		.countDirectoryEntries = countDirectoryEntries##BYTES_PER_SECTOR##x##SECTORS_PER_CLUSTER,  \
+	};
+
+// 1.44 MB and 1.2 MB floppies:
+DEFINE_GEOMETRY_OPS(512, 1)
+// 720 KB, 360 KB and 2.88 MB floppies:
+DEFINE_GEOMETRY_OPS(512, 2)
+// Larger FAT12 images created by mkfs.fat:
+DEFINE_GEOMETRY_OPS(512, 4)
+
+static uint64_t clusterDeviceOffsetGeneric(uint16_t clusterId, const FAT12Info* fat12Info) {
+	return clusterDeviceOffsetTemplate(clusterId, fat12Info, fat12Info->bytesPerSector,
+									   fat12Info->sectorsPerCluster);
+}
+
+static uint32_t walkClusterChainGeneric(uint64_t* offsets, uint32_t maxClusters,
+										uint16_t firstClusterId, const uint8_t* fat,
+										const FAT12Info* fat12Info) {
+	return walkClusterChainTemplate(offsets, maxClusters, firstClusterId, fat, fat12Info,
+									fat12Info->bytesPerSector, fat12Info->sectorsPerCluster);
+}
+
+static uint32_t countDirectoryEntriesGeneric(const FAT12DirectoryEntry* dirEntries,
+											 uint32_t sectorCount, const FAT12Info* fat12Info) {
+	return countDirectoryEntriesTemplate(dirEntries, sectorCount, fat12Info->bytesPerSector);
+}
+
+static const FAT12GeometryOps genericGeometryOps = {
+	.name = "generic",
+	.clusterDeviceOffset = clusterDeviceOffsetGeneric,
+	.walkClusterChain = walkClusterChainGeneric,
+	.countDirectoryEntries = countDirectoryEntriesGeneric,
+};
+
+typedef struct GeometryOpsEntry {
+	uint32_t bytesPerSector;
+	uint32_t sectorsPerCluster;
+	const FAT12GeometryOps* ops;
+} GeometryOpsEntry;
+
+static const GeometryOpsEntry geometryOpsTable[] = {
+	{512, 1, &geometryOps512x1},
+	{512, 2, &geometryOps512x2},
+	{512, 4, &geometryOps512x4},
+};
+
+const FAT12GeometryOps* selectGeometryOps(const FAT12Info* fat12Info) {
+	for (size_t i = 0; i < sizeof(geometryOpsTable) / sizeof(geometryOpsTable[0]); i++) {
+		if (geometryOpsTable[i].bytesPerSector == fat12Info->bytesPerSector &&
+			geometryOpsTable[i].sectorsPerCluster == fat12Info->sectorsPerCluster) {
+			return geometryOpsTable[i].ops;
+		}
+	}
+
+	return &genericGeometryOps;
+}
+
+const FAT12GeometryOps* getGenericGeometryOps(void) { return &genericGeometryOps; }
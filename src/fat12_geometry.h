@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+#include "fat12.h"
+
+/** Hot routines whose arithmetic depends on bytesPerSector and sectorsPerCluster. Every common
+ * geometry gets a variant where both are compile time constants, so the multiplications and
+ * divisions become shifts, plus a generic variant working with the runtime values.
+ */
+struct FAT12GeometryOps {
+	const char* name;
+
+	/** Converts a cluster id to the byte offset of that cluster on the loop device. */
+	uint64_t (*clusterDeviceOffset)(uint16_t clusterId, const FAT12Info* fat12Info);
+
+	/** Follows the cluster chain starting at firstClusterId and stores the device byte offset of
+	 * every cluster in offsets. Stops at the end of the chain, at an id outside of the data section
+	 * or after maxClusters clusters.
+	 * @return Amount of offsets stored.
+	 */
+	uint32_t (*walkClusterChain)(uint64_t* offsets, uint32_t maxClusters, uint16_t firstClusterId,
+								 const uint8_t* fat, const FAT12Info* fat12Info);
+
+	/** Counts the file and directory entries in a directory that spans sectorCount sectors, stops
+	 * at the final entry. */
+	uint32_t (*countDirectoryEntries)(const FAT12DirectoryEntry* dirEntries, uint32_t sectorCount,
+									  const FAT12Info* fat12Info);
+};
+
+/** Picks the variant matching the geometry of fat12Info, falls back to the generic one. */
+const FAT12GeometryOps* selectGeometryOps(const FAT12Info* fat12Info);
+
+/** The variant that works for any geometry. */
+const FAT12GeometryOps* getGenericGeometryOps(void);
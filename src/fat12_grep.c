@@ -0,0 +1,319 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "allocwrap.h"
+#include "fat12.h"
+#include "fat12_grep.h"
+#include "fat12_string.h"
+
+typedef struct GrepFile {
+	char* path;
+	FAT12DirectoryEntry entry;
+	uint64_t* matchOffsets;
+	uint32_t matchCount;
+	uint32_t matchCapacity;
+} GrepFile;
+
+typedef struct GrepFileList {
+	GrepFile* files;
+	uint32_t count;
+	uint32_t capacity;
+	bool* isVisitedDirectory;  // Indexed by cluster id, stops loops in corrupted directory trees
+} GrepFileList;
+
+typedef struct GrepContext {
+	const uint8_t* pattern;
+	uint32_t patternLength;
+	GrepFile* files;
+	uint32_t fileCount;
+	uint32_t nextFileIndex;	 // Shared between workers, accessed atomically
+	const uint8_t* fat;
+	FAT12Info* fat12Info;
+	const char* loopDevicePath;
+} GrepContext;
+
+static const uint8_t* findPatternScalar(const uint8_t* haystack, uint64_t length,
+										const uint8_t* pattern, uint32_t patternLength) {
+	const uint8_t* end = haystack + length;
+	const uint8_t* curr = haystack;
+	while ((uint64_t)(end - curr) >= patternLength) {
+		curr = memchr(curr, pattern[0], (end - curr) - patternLength + 1);
+		if (!curr) {
+			return NULL;
+		}
+		if (memcmp(curr + 1, pattern + 1, patternLength - 1) == 0) {
+			return curr;
+		}
+		curr++;
+	}
+
+	return NULL;
+}
+
+const uint8_t* findPattern(const uint8_t* haystack, uint64_t length, const uint8_t* pattern,
+						   uint32_t patternLength) {
+	if (patternLength == 0 || length < patternLength) {
+		return NULL;
+	}
+	if (patternLength == 1) {
+		return memchr(haystack, pattern[0], length);
+	}
+
+	uint64_t i = 0;
+#ifdef __SSE2__
+	// Compares the first and last pattern bytes against 16 candidate positions at once, only
+	// candidates matching both are verified with memcmp:
+	const __m128i firstByte = _mm_set1_epi8((char)pattern[0]);
+	const __m128i lastByte = _mm_set1_epi8((char)pattern[patternLength - 1]);
+	for (; i + patternLength - 1 + sizeof(__m128i) <= length; i += sizeof(__m128i)) {
+		__m128i firstBlock = _mm_loadu_si128((const __m128i*)(haystack + i));
+		__m128i lastBlock = _mm_loadu_si128((const __m128i*)(haystack + i + patternLength - 1));
+		uint32_t mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(firstByte, firstBlock),
+														_mm_cmpeq_epi8(lastByte, lastBlock)));
+		while (mask) {
+			uint32_t bit = __builtin_ctz(mask);
+			if (memcmp(haystack + i + bit + 1, pattern + 1, patternLength - 2) == 0) {
+				return haystack + i + bit;
+			}
+			mask &= mask - 1;
+		}
+	}
+#endif
+
+	return findPatternScalar(haystack + i, length - i, pattern, patternLength);
+}
+
+static char* joinPath(const char* directoryPath, const char* name) {
+	uint64_t directoryLength = strlen(directoryPath);
+	uint64_t nameLength = strlen(name);
+	bool needsSeparator = directoryLength == 0 || directoryPath[directoryLength - 1] != '/';
+
+	char* path = xmalloc(directoryLength + needsSeparator + nameLength + 1);
+	memcpy(path, directoryPath, directoryLength);
+	if (needsSeparator) {
+		path[directoryLength] = '/';
+	}
+	memcpy(path + directoryLength + needsSeparator, name, nameLength + 1);
+	return path;
+}
+
+static void appendGrepFile(GrepFileList* list, char* path, FAT12DirectoryEntry* entry) {
+	if (list->count == list->capacity) {
+		list->capacity = list->capacity ? list->capacity * 2 : 16;
+		list->files = xrealloc(list->files, list->capacity * sizeof(GrepFile));
+	}
+
+	GrepFile* file = &list->files[list->count];
+	memset(file, 0, sizeof(GrepFile));
+	file->path = path;
+	memcpy(&file->entry, entry, sizeof(FAT12DirectoryEntry));
+	list->count++;
+}
+
+static void collectGrepFiles(GrepFileList* list, FAT12DirectoryEntry* dirEntries,
+							 uint32_t entriesCount, const char* directoryPath,
+							 FAT12Info* fat12Info, const char* loopDevicePath) {
+	for (uint32_t i = 0; i < entriesCount; i++) {
+		FAT12DirectoryEntry* entry = &dirEntries[i];
+		if (isDotDirectoryEntry(entry)) {
+			continue;
+		}
+
+		char* name = fatFileNameToStr(entry->fileName);
+		char* path = joinPath(directoryPath, name);
+		free(name);
+		if (!isDirectoryEntryDirectory(entry)) {
+			appendGrepFile(list, path, entry);
+			continue;
+		}
+
+		if (isDataClusterId(entry->firstClusterId, fat12Info)) {
+			if (list->isVisitedDirectory[entry->firstClusterId]) {
+				(void)fprintf(stderr, "grep: %s loops back into the directory tree, skipped\n",
+							  path);
+				free(path);
+				continue;
+			}
+			list->isVisitedDirectory[entry->firstClusterId] = true;
+		}
+
+		FAT12DirectoryEntry* subEntries;
+		// getDirectoryEntries returns the directory size in bytes, not in entries:
+		uint32_t subEntriesBytes =
+			getDirectoryEntries(&subEntries, entry, fat12Info, loopDevicePath);
+		uint32_t subEntriesCount = filterValidDirectoryEntries(
+			&subEntries, subEntriesBytes / sizeof(FAT12DirectoryEntry));
+		collectGrepFiles(list, subEntries, subEntriesCount, path, fat12Info, loopDevicePath);
+		free(subEntries);
+		free(path);
+	}
+}
+
+static void recordMatch(GrepFile* file, uint64_t offset) {
+	if (file->matchCount == file->matchCapacity) {
+		file->matchCapacity = file->matchCapacity ? file->matchCapacity * 2 : 4;
+		file->matchOffsets = xrealloc(file->matchOffsets, file->matchCapacity * sizeof(uint64_t));
+	}
+	file->matchOffsets[file->matchCount] = offset;
+	file->matchCount++;
+}
+
+/** Streams a file through the matcher. The last patternLength - 1 bytes of every window are carried
+ * to the front of the next one so matches crossing a cluster run boundary are still found. */
+static void grepFile(GrepContext* context, GrepFile* file, uint8_t* buffer) {
+	const uint32_t BYTES_PER_CLUSTER =
+		context->fat12Info->bytesPerSector * context->fat12Info->sectorsPerCluster;
+	const uint32_t MAX_CARRY = context->patternLength - 1;
+
+	uint64_t remainingBytes = file->entry.fileSizeInBytes;
+	uint64_t fileOffset = 0;  // File offset of the first byte after the carry
+	uint32_t carry = 0;
+	uint16_t clusterId = file->entry.firstClusterId;
+	while (remainingBytes > 0 && isDataClusterId(clusterId, context->fat12Info)) {
+		uint16_t runStartClusterId = clusterId;
+		uint16_t prevClusterId;
+		uint32_t runLength = 0;
+		do {
+			runLength++;
+			prevClusterId = clusterId;
+			clusterId = getNextClusterId(clusterId, context->fat);
+		} while (runLength < GREP_READ_CLUSTERS &&
+				 (uint64_t)runLength * BYTES_PER_CLUSTER < remainingBytes &&
+				 clusterId == prevClusterId + 1);
+
+		uint64_t readBytes = (uint64_t)runLength * BYTES_PER_CLUSTER;
+		if (readBytes > remainingBytes) {
+			readBytes = remainingBytes;
+		}
+		preadDevice(buffer + carry, readBytes,
+					(int64_t)getClusterDeviceOffset(runStartClusterId, context->fat12Info),
+					context->loopDevicePath);
+
+		uint64_t windowLength = carry + readBytes;
+		uint64_t windowFileOffset = fileOffset - carry;
+		const uint8_t* match = buffer;
+		while ((match = findPattern(match, windowLength - (match - buffer), context->pattern,
+									context->patternLength))) {
+			recordMatch(file, windowFileOffset + (match - buffer));
+			match++;
+		}
+
+		remainingBytes -= readBytes;
+		fileOffset += readBytes;
+		carry = windowLength < MAX_CARRY ? windowLength : MAX_CARRY;
+		memmove(buffer, buffer + windowLength - carry, carry);
+	}
+}
+
+static void* grepWorker(void* arg) {
+	GrepContext* context = arg;
+	const uint32_t BYTES_PER_CLUSTER =
+		context->fat12Info->bytesPerSector * context->fat12Info->sectorsPerCluster;
+	uint8_t* buffer =
+		xmalloc(context->patternLength - 1 + (uint64_t)GREP_READ_CLUSTERS * BYTES_PER_CLUSTER);
+
+	while (true) {
+		uint32_t fileIndex = __atomic_fetch_add(&context->nextFileIndex, 1, __ATOMIC_RELAXED);
+		if (fileIndex >= context->fileCount) {
+			break;
+		}
+		grepFile(context, &context->files[fileIndex], buffer);
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+static uint32_t getGrepWorkerCount(uint32_t fileCount) {
+	long onlineCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t workerCount = onlineCpus > 0 ? (uint32_t)onlineCpus : 1;
+	if (workerCount > GREP_MAX_WORKERS) {
+		workerCount = GREP_MAX_WORKERS;
+	}
+	if (workerCount > fileCount) {
+		workerCount = fileCount;
+	}
+	return workerCount;
+}
+
+uint64_t grepEntry(const char* pattern, FAT12DirectoryEntry* entry, const char* path,
+				   FAT12Info* fat12Info, const char* loopDevicePath) {
+	if (strlen(pattern) == 0) {
+		(void)fprintf(stderr, "grep: empty pattern\n");
+		return 0;
+	}
+
+	GrepFileList list = {0};
+	if (entry && !isDirectoryEntryDirectory(entry)) {
+		appendGrepFile(&list, strdup(path), entry);
+	} else {
+		list.isVisitedDirectory = calloc(fat12Info->clusterCount + 2, sizeof(bool));
+		if (!list.isVisitedDirectory) {
+			perror("");
+			exit(-1);
+		}
+		FAT12DirectoryEntry* dirEntries;
+		uint32_t entriesCount;
+		if (entry) {
+			if (isDataClusterId(entry->firstClusterId, fat12Info)) {
+				list.isVisitedDirectory[entry->firstClusterId] = true;
+			}
+			uint32_t dirBytes = getDirectoryEntries(&dirEntries, entry, fat12Info, loopDevicePath);
+			entriesCount =
+				filterValidDirectoryEntries(&dirEntries, dirBytes / sizeof(FAT12DirectoryEntry));
+		} else {
+			entriesCount = getRootDirectoryEntries(&dirEntries, fat12Info, loopDevicePath);
+		}
+		collectGrepFiles(&list, dirEntries, entriesCount, path, fat12Info, loopDevicePath);
+		free(dirEntries);
+		free(list.isVisitedDirectory);
+	}
+
+	uint8_t* fat = getFat(fat12Info, loopDevicePath);
+	GrepContext context = {
+		.pattern = (const uint8_t*)pattern,
+		.patternLength = strlen(pattern),
+		.files = list.files,
+		.fileCount = list.count,
+		.nextFileIndex = 0,
+		.fat = fat,
+		.fat12Info = fat12Info,
+		.loopDevicePath = loopDevicePath,
+	};
+
+	uint32_t workerCount = getGrepWorkerCount(list.count);
+	pthread_t workers[GREP_MAX_WORKERS];
+	for (uint32_t i = 0; i < workerCount; i++) {
+		if (pthread_create(&workers[i], NULL, grepWorker, &context) != 0) {
+			perror("Failed to create grep worker");
+			exit(-1);
+		}
+	}
+	for (uint32_t i = 0; i < workerCount; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	// Printing after all workers finished keeps the output in directory traversal order:
+	uint64_t matchCount = 0;
+	for (uint32_t i = 0; i < list.count; i++) {
+		GrepFile* file = &list.files[i];
+		for (uint32_t j = 0; j < file->matchCount; j++) {
+			printf("%s:%lu\n", file->path, file->matchOffsets[j]);
+		}
+		matchCount += file->matchCount;
+		free(file->matchOffsets);
+		free(file->path);
+	}
+
+	free(list.files);
+	free(fat);
+	return matchCount;
+}
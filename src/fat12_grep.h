@@ -0,0 +1,32 @@
+#pragma once
+#include <stdint.h>
+
+#include "fat12.h"
+
+/** Maximum amount of contiguous clusters streamed into the matcher with a single read */
+#define GREP_READ_CLUSTERS 64
+#define GREP_MAX_WORKERS 64
+
+/**
+ * @brief Searches the content of files inside the FAT12 filesystem for a fixed pattern.
+ * Files are streamed cluster run by cluster run and never materialized as a whole, matches that
+ * straddle a cluster boundary are found as well. When entry is a directory every file below it is
+ * searched, files are spread across worker threads.
+ * Every match is printed to stdout as path:offset, where offset is the byte offset in the file.
+ *
+ * @param[in] pattern Null terminated pattern to search for.
+ * @param[in] entry Directory entry of the file or directory to search, NULL for the root directory.
+ * @param[in] path Path of entry, used as the prefix of the printed paths.
+ * @param[in] fat12Info
+ * @param[in] loopDevicePath
+ *
+ * @return Number of matches found.
+ */
+uint64_t grepEntry(const char* pattern, FAT12DirectoryEntry* entry, const char* path,
+				   FAT12Info* fat12Info, const char* loopDevicePath);
+
+/** Finds the first occurrence of pattern inside haystack using a SIMD first/last byte filter.
+ * @return Pointer to the match inside haystack or NULL when there is no match.
+ */
+const uint8_t* findPattern(const uint8_t* haystack, uint64_t length, const uint8_t* pattern,
+						   uint32_t patternLength);
@@ -0,0 +1,683 @@
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "allocwrap.h"
+#include "fat12.h"
+#include "fat12_scan.h"
+#include "fat12_string.h"
+
+#define IMAGE_EXTENSION ".img"
+
+/** Counting semaphore for a shared resource, units are bytes for memory and descriptors for
+ * open images. */
+typedef struct ScanGate {
+	pthread_mutex_t mutex;
+	pthread_cond_t released;
+	uint64_t available;
+	uint64_t capacity;
+} ScanGate;
+
+typedef struct ScanQueue {
+	pthread_mutex_t mutex;
+	pthread_cond_t notEmpty;
+	pthread_cond_t notFull;
+	char** paths;
+	uint32_t capacity;
+	uint32_t head;
+	uint32_t count;
+	bool isClosed;
+} ScanQueue;
+
+typedef struct ScanContext {
+	ScanQueue queue;
+	ScanGate openImages;
+	ScanGate memory;
+	pthread_mutex_t outputMutex;
+
+	// Updated atomically by the workers:
+	uint64_t imageCount;
+	uint64_t errorCount;
+	uint64_t entryCount;
+} ScanContext;
+
+typedef struct ScanOutput {
+	ScanContext* context;
+	char* data;
+	uint64_t length;
+	uint64_t capacity;
+} ScanOutput;
+
+typedef struct ScanImage {
+	ScanContext* context;
+	ScanOutput* output;
+	const char* imagePath;
+	int fileDescriptor;
+	FAT12Info fat12Info;
+	uint8_t* fat;
+	uint32_t bytesPerCluster;
+	bool* isVisitedDirectory;  // Indexed by cluster id, stops loops in corrupted directory trees
+	// Part of the memory reserved for the image that is left for sub directory buffers:
+	uint64_t directoryBytesLeft;
+	bool hasReadFailed;
+	bool hasFailed;	 // Set once an error made the whole image unreadable
+} ScanImage;
+
+static void initScanGate(ScanGate* gate, uint64_t capacity) {
+	pthread_mutex_init(&gate->mutex, NULL);
+	pthread_cond_init(&gate->released, NULL);
+	gate->available = capacity;
+	gate->capacity = capacity;
+}
+
+static void destroyScanGate(ScanGate* gate) {
+	pthread_mutex_destroy(&gate->mutex);
+	pthread_cond_destroy(&gate->released);
+}
+
+/** Waits until units are available and takes them. A request larger than the whole capacity waits
+ * for the entire capacity instead, so it can still make progress alone.
+ * @return The amount of units taken, to be passed to releaseScanGate.
+ */
+static uint64_t acquireScanGate(ScanGate* gate, uint64_t units) {
+	if (units > gate->capacity) {
+		units = gate->capacity;
+	}
+
+	pthread_mutex_lock(&gate->mutex);
+	while (gate->available < units) {
+		pthread_cond_wait(&gate->released, &gate->mutex);
+	}
+	gate->available -= units;
+	pthread_mutex_unlock(&gate->mutex);
+	return units;
+}
+
+static void releaseScanGate(ScanGate* gate, uint64_t units) {
+	pthread_mutex_lock(&gate->mutex);
+	gate->available += units;
+	pthread_cond_broadcast(&gate->released);
+	pthread_mutex_unlock(&gate->mutex);
+}
+
+static void initScanQueue(ScanQueue* queue, uint32_t capacity) {
+	pthread_mutex_init(&queue->mutex, NULL);
+	pthread_cond_init(&queue->notEmpty, NULL);
+	pthread_cond_init(&queue->notFull, NULL);
+	queue->paths = xmalloc(capacity * sizeof(char*));
+	queue->capacity = capacity;
+	queue->head = 0;
+	queue->count = 0;
+	queue->isClosed = false;
+}
+
+static void destroyScanQueue(ScanQueue* queue) {
+	pthread_mutex_destroy(&queue->mutex);
+	pthread_cond_destroy(&queue->notEmpty);
+	pthread_cond_destroy(&queue->notFull);
+	free((void*)queue->paths);
+}
+
+/** Blocks while the queue is full, which keeps enumeration from running ahead of the workers. */
+static void pushScanQueue(ScanQueue* queue, char* path) {
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->count == queue->capacity) {
+		pthread_cond_wait(&queue->notFull, &queue->mutex);
+	}
+	queue->paths[(queue->head + queue->count) % queue->capacity] = path;
+	queue->count++;
+	pthread_cond_signal(&queue->notEmpty);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+static void closeScanQueue(ScanQueue* queue) {
+	pthread_mutex_lock(&queue->mutex);
+	queue->isClosed = true;
+	pthread_cond_broadcast(&queue->notEmpty);
+	pthread_mutex_unlock(&queue->mutex);
+}
+
+/** @return The next path or NULL once the queue is closed and empty. */
+static char* popScanQueue(ScanQueue* queue) {
+	pthread_mutex_lock(&queue->mutex);
+	while (queue->count == 0 && !queue->isClosed) {
+		pthread_cond_wait(&queue->notEmpty, &queue->mutex);
+	}
+
+	char* path = NULL;
+	if (queue->count > 0) {
+		path = queue->paths[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+		pthread_cond_signal(&queue->notFull);
+	}
+	pthread_mutex_unlock(&queue->mutex);
+	return path;
+}
+
+static void flushScanOutput(ScanOutput* output) {
+	if (output->length == 0) {
+		return;
+	}
+	pthread_mutex_lock(&output->context->outputMutex);
+	(void)fwrite(output->data, 1, output->length, stdout);
+	pthread_mutex_unlock(&output->context->outputMutex);
+	output->length = 0;
+}
+
+static void reserveScanOutput(ScanOutput* output, uint64_t bytes) {
+	if (output->length + bytes <= output->capacity) {
+		return;
+	}
+	while (output->length + bytes > output->capacity) {
+		output->capacity = output->capacity ? output->capacity * 2 : SCAN_OUTPUT_FLUSH_BYTES;
+	}
+	output->data = xrealloc(output->data, output->capacity);
+}
+
+static void appendScanOutput(ScanOutput* output, const char* format, ...) {
+	va_list args;
+	va_start(args, format);
+	va_list argsCopy;
+	va_copy(argsCopy, args);
+	int length = vsnprintf(NULL, 0, format, argsCopy);
+	va_end(argsCopy);
+
+	reserveScanOutput(output, length + 1);
+	(void)vsnprintf(output->data + output->length, length + 1, format, args);
+	output->length += length;
+	va_end(args);
+}
+
+static void appendScanJsonString(ScanOutput* output, const char* str) {
+	const char HEX_DIGITS[] = "0123456789abcdef";
+
+	// Worst case every byte becomes a 6 byte \u00XX escape, plus the quotes:
+	reserveScanOutput(output, strlen(str) * 6 + 2);
+	char* out = output->data + output->length;
+	*out++ = '"';
+	for (const uint8_t* curr = (const uint8_t*)str; *curr; curr++) {
+		if (*curr == '"' || *curr == '\\') {
+			*out++ = '\\';
+			*out++ = (char)*curr;
+		} else if (*curr < 0x20 || *curr >= 0x7F) {
+			memcpy(out, "\\u00", 4);
+			out[4] = HEX_DIGITS[*curr >> 4];
+			out[5] = HEX_DIGITS[*curr & 0x0F];
+			out += 6;
+		} else {
+			*out++ = (char)*curr;
+		}
+	}
+	*out++ = '"';
+	output->length = out - output->data;
+}
+
+static void appendScanJsonDateTime(ScanOutput* output, uint16_t date, uint16_t time) {
+	appendScanOutput(output, "\"%04u-%02u-%02uT%02u:%02u:%02u\"", 1980 + ((date >> 9) & 0x7F),
+					 (date >> 5) & 0x0F, date & 0x1F, (time >> 11) & 0x1F, (time >> 5) & 0x3F,
+					 (time & 0x1F) * 2);
+}
+
+/** Reports an error of a single directory, or of the whole image when path is NULL. */
+static void reportScanError(ScanImage* image, const char* path, const char* error) {
+	image->hasFailed = image->hasFailed || !path;
+	appendScanOutput(image->output, "{\"image\":");
+	appendScanJsonString(image->output, image->imagePath);
+	if (path) {
+		appendScanOutput(image->output, ",\"path\":");
+		appendScanJsonString(image->output, path);
+	}
+	appendScanOutput(image->output, ",\"error\":");
+	appendScanJsonString(image->output, error);
+	appendScanOutput(image->output, "}\n");
+}
+
+static bool preadScanImage(ScanImage* image, void* buffer, uint64_t readBytes, uint64_t offset) {
+	uint64_t totalRead = 0;
+	while (totalRead < readBytes) {
+		ssize_t bytesRead = pread(image->fileDescriptor, (uint8_t*)buffer + totalRead,
+								  readBytes - totalRead, (off_t)(offset + totalRead));
+		if (bytesRead < 0 && errno == EINTR) {
+			continue;
+		}
+		if (bytesRead <= 0) {
+			image->hasReadFailed = true;
+			return false;
+		}
+		totalRead += bytesRead;
+	}
+	return true;
+}
+
+/** Counts the clusters of a chain without following it past the cluster count, which protects
+ * against cycles in a corrupted fat.
+ * @param[out] isComplete Set when the chain ends with the end of chain marker.
+ */
+static uint32_t countScanChainClusters(ScanImage* image, uint16_t firstClusterId,
+									   bool* isComplete) {
+	uint32_t clusterCount = 0;
+	uint16_t clusterId = firstClusterId;
+	while (isDataClusterId(clusterId, &image->fat12Info) &&
+		   clusterCount < image->fat12Info.clusterCount) {
+		clusterCount++;
+		clusterId = getNextClusterId(clusterId, image->fat);
+	}
+
+	*isComplete = clusterId == FAT_LAST_CLUSTER_NUM;
+	return clusterCount;
+}
+
+/** Reads a sub directory, the cluster chain is bounded and validated before any memory is taken.
+ * The buffers come out of the memory the image reserved up front, a worker never waits for the
+ * budget while it already holds a part of it.
+ * @param[out] dirEntries The entries, NULL on error.
+ * @param[out] reservedBytes Bytes taken from directoryBytesLeft, given back by the caller.
+ * @return NULL on success, otherwise the error to report for the directory.
+ */
+static const char* readScanDirectory(ScanImage* image, FAT12DirectoryEntry* entry,
+									 FAT12DirectoryEntry** dirEntries, uint32_t* entriesCount,
+									 uint64_t* reservedBytes) {
+	*dirEntries = NULL;
+	bool isComplete;
+	uint32_t clusterCount = countScanChainClusters(image, entry->firstClusterId, &isComplete);
+	if (!isComplete || clusterCount == 0) {
+		return "invalid directory cluster chain";
+	}
+
+	uint64_t directoryBytes = (uint64_t)clusterCount * image->bytesPerCluster;
+	uint64_t offsetsBytes = (uint64_t)clusterCount * sizeof(uint64_t);
+	if (directoryBytes + offsetsBytes > image->directoryBytesLeft) {
+		return "directory tree exceeds the memory budget";
+	}
+
+	uint64_t* offsets = xmalloc(offsetsBytes);
+	getClusterChainOffsets(offsets, clusterCount, entry->firstClusterId, image->fat,
+						   &image->fat12Info);
+	uint16_t clusterId = entry->firstClusterId;
+	for (uint32_t i = 0; i < clusterCount; i++) {
+		if (image->isVisitedDirectory[clusterId]) {
+			free(offsets);
+			return "directory cluster chain loops back into the tree";
+		}
+		image->isVisitedDirectory[clusterId] = true;
+		clusterId = getNextClusterId(clusterId, image->fat);
+	}
+
+	*reservedBytes = directoryBytes + offsetsBytes;
+	image->directoryBytesLeft -= *reservedBytes;
+	*dirEntries = xmalloc(directoryBytes);
+	for (uint32_t i = 0; i < clusterCount; i++) {
+		uint8_t* clusterData = (uint8_t*)*dirEntries + (uint64_t)i * image->bytesPerCluster;
+		if (!preadScanImage(image, clusterData, image->bytesPerCluster, offsets[i])) {
+			free(offsets);
+			free(*dirEntries);
+			*dirEntries = NULL;
+			return "failed to read directory";
+		}
+	}
+
+	free(offsets);
+	*entriesCount = directoryBytes / sizeof(FAT12DirectoryEntry);
+	return NULL;
+}
+
+static void appendScanRecord(ScanImage* image, const char* path, FAT12DirectoryEntry* entry) {
+	bool isComplete = false;
+	uint32_t clusterCount = countScanChainClusters(image, entry->firstClusterId, &isComplete);
+	// Empty files own no cluster at all:
+	if (entry->firstClusterId == 0 && !isDirectoryEntryDirectory(entry)) {
+		isComplete = entry->fileSizeInBytes == 0;
+	}
+
+	ScanOutput* output = image->output;
+	appendScanOutput(output, "{\"image\":");
+	appendScanJsonString(output, image->imagePath);
+	appendScanOutput(output, ",\"path\":");
+	appendScanJsonString(output, path);
+	appendScanOutput(output,
+					 ",\"type\":\"%s\",\"size\":%u,\"attributes\":%u,\"firstCluster\":%u,"
+					 "\"clusters\":%u,\"chainComplete\":%s,\"created\":",
+					 isDirectoryEntryDirectory(entry) ? "dir" : "file", entry->fileSizeInBytes,
+					 entry->attributes, entry->firstClusterId, clusterCount,
+					 isComplete ? "true" : "false");
+	appendScanJsonDateTime(output, entry->creationDate, entry->creationTime);
+	appendScanOutput(output, ",\"modified\":");
+	appendScanJsonDateTime(output, entry->lastModifyDate, entry->lastModifyTime);
+	appendScanOutput(output, "}\n");
+
+	__atomic_fetch_add(&image->context->entryCount, 1, __ATOMIC_RELAXED);
+	if (output->length >= SCAN_OUTPUT_FLUSH_BYTES) {
+		flushScanOutput(output);
+	}
+}
+
+static void walkScanDirectory(ScanImage* image, FAT12DirectoryEntry* dirEntries,
+							  uint32_t entriesCount, const char* directoryPath, uint32_t depth) {
+	uint64_t directoryPathLength = strlen(directoryPath);
+	for (uint32_t i = 0; i < entriesCount && !image->hasReadFailed; i++) {
+		FAT12DirectoryEntry* entry = &dirEntries[i];
+		if (isFinalDirectoryEntry(entry)) {
+			break;
+		}
+		if (isDeletedEntry(entry) || isVolumeLabelEntry(entry) || isDotDirectoryEntry(entry)) {
+			continue;
+		}
+
+		char* name = fatFileNameToStr(entry->fileName);
+		char* path = xmalloc(directoryPathLength + strlen(name) + 2);
+		(void)sprintf(path, "%s/%s", directoryPath, name);
+		free(name);
+		appendScanRecord(image, path, entry);
+
+		if (isDirectoryEntryDirectory(entry)) {
+			uint32_t subEntriesCount = 0;
+			uint64_t reservedBytes = 0;
+			FAT12DirectoryEntry* subEntries = NULL;
+			const char* error = NULL;
+			if (depth >= SCAN_MAX_DIRECTORY_DEPTH) {
+				reportScanError(image, path, "directory nesting too deep");
+			} else if ((error = readScanDirectory(image, entry, &subEntries, &subEntriesCount,
+												  &reservedBytes))) {
+				// A failed read is reported once for the whole image by scanOpenImage:
+				if (!image->hasReadFailed) {
+					reportScanError(image, path, error);
+				}
+			} else {
+				walkScanDirectory(image, subEntries, subEntriesCount, path, depth + 1);
+			}
+			free(subEntries);
+			image->directoryBytesLeft += reservedBytes;
+		}
+		free(path);
+	}
+}
+
+static void scanOpenImage(ScanImage* image) {
+	FAT12Header fat12Header;
+	if (!preadScanImage(image, &fat12Header, sizeof(FAT12Header), 0)) {
+		reportScanError(image, NULL, "failed to read header");
+		return;
+	}
+	const char* headerError =
+		getFat12HeaderError(&fat12Header, getDeviceBytes(image->imagePath));
+	if (headerError) {
+		reportScanError(image, NULL, headerError);
+		return;
+	}
+	loadFat12Info(&image->fat12Info, &fat12Header);
+	image->bytesPerCluster = image->fat12Info.bytesPerSector * image->fat12Info.sectorsPerCluster;
+
+	const uint64_t FAT_BYTES =
+		(uint64_t)image->fat12Info.fatSectorSize * image->fat12Info.bytesPerSector;
+	const uint64_t ROOT_DIR_BYTES =
+		(uint64_t)image->fat12Info.rootDirSectorsSize * image->fat12Info.bytesPerSector;
+	const uint64_t VISITED_BYTES = (image->fat12Info.clusterCount + 2) * sizeof(bool);
+	// Every directory cluster is read at most once, so the data section bounds the sub directories:
+	uint64_t directoryBytes =
+		(uint64_t)image->fat12Info.clusterCount * (image->bytesPerCluster + sizeof(uint64_t));
+	if (directoryBytes > SCAN_IMAGE_DIRECTORY_BYTES) {
+		directoryBytes = SCAN_IMAGE_DIRECTORY_BYTES;
+	}
+	// Taken once for the whole image, waiting for more while holding a part could deadlock:
+	uint64_t reservedBytes = acquireScanGate(&image->context->memory,
+											 FAT_BYTES + ROOT_DIR_BYTES + VISITED_BYTES +
+												 directoryBytes);
+	image->directoryBytesLeft = directoryBytes;
+
+	image->isVisitedDirectory = calloc(image->fat12Info.clusterCount + 2, sizeof(bool));
+	if (!image->isVisitedDirectory) {
+		perror("");
+		exit(-1);
+	}
+	image->fat = xmalloc(FAT_BYTES);
+	FAT12DirectoryEntry* rootEntries = xmalloc(ROOT_DIR_BYTES);
+	if (!preadScanImage(image, image->fat, FAT_BYTES,
+						(uint64_t)image->fat12Info.fatSectionSectorOffset *
+							image->fat12Info.bytesPerSector) ||
+		!preadScanImage(image, rootEntries, ROOT_DIR_BYTES,
+						(uint64_t)image->fat12Info.rootDirSectorOffset *
+							image->fat12Info.bytesPerSector)) {
+		reportScanError(image, NULL, "failed to read fat or root directory");
+	} else {
+		walkScanDirectory(image, rootEntries, ROOT_DIR_BYTES / sizeof(FAT12DirectoryEntry), "", 0);
+		if (image->hasReadFailed) {
+			reportScanError(image, NULL, "failed to read directory");
+		}
+	}
+
+	free(rootEntries);
+	free(image->fat);
+	free(image->isVisitedDirectory);
+	releaseScanGate(&image->context->memory, reservedBytes);
+}
+
+static void scanImage(ScanContext* context, ScanOutput* output, const char* imagePath) {
+	ScanImage image = {
+		.context = context,
+		.output = output,
+		.imagePath = imagePath,
+	};
+
+	acquireScanGate(&context->openImages, 1);
+	image.fileDescriptor = open(imagePath, O_RDONLY | O_CLOEXEC);
+	if (image.fileDescriptor == -1) {
+		reportScanError(&image, NULL, strerror(errno));
+	} else {
+		scanOpenImage(&image);
+		close(image.fileDescriptor);
+	}
+	releaseScanGate(&context->openImages, 1);
+
+	__atomic_fetch_add(&context->imageCount, 1, __ATOMIC_RELAXED);
+	if (image.hasFailed) {
+		__atomic_fetch_add(&context->errorCount, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static void* scanWorker(void* arg) {
+	ScanContext* context = arg;
+	ScanOutput output = {.context = context};
+
+	char* imagePath;
+	while ((imagePath = popScanQueue(&context->queue))) {
+		scanImage(context, &output, imagePath);
+		free(imagePath);
+	}
+
+	flushScanOutput(&output);
+	free(output.data);
+	return NULL;
+}
+
+static bool hasImageExtension(const char* name) {
+	uint64_t nameLength = strlen(name);
+	uint64_t extensionLength = strlen(IMAGE_EXTENSION);
+	return nameLength > extensionLength &&
+		   strcmp(name + nameLength - extensionLength, IMAGE_EXTENSION) == 0;
+}
+
+/** Directories already enumerated, symlinks can reach the same directory twice or loop back to
+ * an ancestor. */
+typedef struct ScanVisitedDirectories {
+	dev_t* devices;
+	ino_t* inodes;
+	uint32_t count;
+	uint32_t capacity;
+} ScanVisitedDirectories;
+
+/** @return false when the directory was visited already, otherwise records it. */
+static bool markScanDirectoryVisited(ScanVisitedDirectories* visited,
+									 const struct stat* directoryStat) {
+	for (uint32_t i = 0; i < visited->count; i++) {
+		if (visited->devices[i] == directoryStat->st_dev &&
+			visited->inodes[i] == directoryStat->st_ino) {
+			return false;
+		}
+	}
+	if (visited->count == visited->capacity) {
+		visited->capacity = visited->capacity ? visited->capacity * 2 : 16;
+		visited->devices = xrealloc(visited->devices, visited->capacity * sizeof(dev_t));
+		visited->inodes = xrealloc(visited->inodes, visited->capacity * sizeof(ino_t));
+	}
+	visited->devices[visited->count] = directoryStat->st_dev;
+	visited->inodes[visited->count] = directoryStat->st_ino;
+	visited->count++;
+	return true;
+}
+
+static void enqueueImageDirectory(ScanQueue* queue, const char* directoryPath,
+								  ScanVisitedDirectories* visited) {
+	struct stat directoryStat;
+	if (stat(directoryPath, &directoryStat) == 0 &&
+		!markScanDirectoryVisited(visited, &directoryStat)) {
+		return;
+	}
+	DIR* directory = opendir(directoryPath);
+	if (!directory) {
+		(void)fprintf(stderr, "scan: failed to open directory %s: %s\n", directoryPath,
+					  strerror(errno));
+		return;
+	}
+
+	struct dirent* dirEntry;
+	while ((dirEntry = readdir(directory))) {
+		if (strcmp(dirEntry->d_name, ".") == 0 || strcmp(dirEntry->d_name, "..") == 0) {
+			continue;
+		}
+		char* path = xmalloc(strlen(directoryPath) + strlen(dirEntry->d_name) + 2);
+		(void)sprintf(path, "%s/%s", directoryPath, dirEntry->d_name);
+
+		unsigned char type = dirEntry->d_type;
+		if (type == DT_UNKNOWN || type == DT_LNK) {
+			struct stat pathStat;
+			type = stat(path, &pathStat) == 0 && S_ISDIR(pathStat.st_mode) ? DT_DIR : DT_REG;
+		}
+		if (type == DT_DIR) {
+			enqueueImageDirectory(queue, path, visited);
+			free(path);
+		} else if (hasImageExtension(dirEntry->d_name)) {
+			pushScanQueue(queue, path);
+		} else {
+			free(path);
+		}
+	}
+	closedir(directory);
+}
+
+static void enqueueImageList(ScanQueue* queue, FILE* list) {
+	char* line = NULL;
+	size_t lineCapacity = 0;
+	ssize_t lineLength;
+	while ((lineLength = getline(&line, &lineCapacity, list)) != -1) {
+		while (lineLength > 0 && (line[lineLength - 1] == '\n' || line[lineLength - 1] == '\r')) {
+			line[--lineLength] = '\0';
+		}
+		if (lineLength > 0) {
+			pushScanQueue(queue, strdup(line));
+		}
+	}
+	free(line);
+}
+
+static bool enqueueScanSource(ScanQueue* queue, const char* source) {
+	struct stat sourceStat;
+	if (strcmp(source, "-") == 0) {
+		enqueueImageList(queue, stdin);
+		return true;
+	}
+	if (stat(source, &sourceStat) != 0) {
+		(void)fprintf(stderr, "scan: %s: %s\n", source, strerror(errno));
+		return false;
+	}
+	if (S_ISDIR(sourceStat.st_mode)) {
+		ScanVisitedDirectories visited = {0};
+		enqueueImageDirectory(queue, source, &visited);
+		free(visited.devices);
+		free(visited.inodes);
+		return true;
+	}
+
+	FILE* list = fopen(source, "r");
+	if (!list) {
+		(void)fprintf(stderr, "scan: %s: %s\n", source, strerror(errno));
+		return false;
+	}
+	enqueueImageList(queue, list);
+	(void)fclose(list);
+	return true;
+}
+
+static uint32_t getScanWorkerCount(uint32_t requestedWorkerCount) {
+	uint32_t workerCount = requestedWorkerCount;
+	if (workerCount == 0) {
+		long onlineCpus = sysconf(_SC_NPROCESSORS_ONLN);
+		workerCount = onlineCpus > 0 ? (uint32_t)onlineCpus : 1;
+	}
+	return workerCount > SCAN_MAX_WORKERS ? SCAN_MAX_WORKERS : workerCount;
+}
+
+static uint64_t getOpenImagesLimit(uint32_t workerCount) {
+	struct rlimit fileLimit;
+	if (getrlimit(RLIMIT_NOFILE, &fileLimit) != 0 || fileLimit.rlim_cur == RLIM_INFINITY ||
+		fileLimit.rlim_cur <= SCAN_RESERVED_FILE_DESCRIPTORS + 1) {
+		return workerCount;
+	}
+
+	uint64_t limit = fileLimit.rlim_cur - SCAN_RESERVED_FILE_DESCRIPTORS;
+	return limit < workerCount ? limit : workerCount;
+}
+
+static double getMonotonicSeconds(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+uint64_t scanImages(const char* source, uint32_t workerCount) {
+	workerCount = getScanWorkerCount(workerCount);
+	double startTime = getMonotonicSeconds();
+
+	ScanContext context = {0};
+	initScanQueue(&context.queue, workerCount * SCAN_QUEUE_SLOTS_PER_WORKER);
+	initScanGate(&context.openImages, getOpenImagesLimit(workerCount));
+	initScanGate(&context.memory, SCAN_MEMORY_BUDGET_BYTES);
+	pthread_mutex_init(&context.outputMutex, NULL);
+
+	pthread_t workers[SCAN_MAX_WORKERS];
+	for (uint32_t i = 0; i < workerCount; i++) {
+		if (pthread_create(&workers[i], NULL, scanWorker, &context) != 0) {
+			perror("Failed to create scan worker");
+			exit(-1);
+		}
+	}
+
+	bool isSourceValid = enqueueScanSource(&context.queue, source);
+	closeScanQueue(&context.queue);
+	for (uint32_t i = 0; i < workerCount; i++) {
+		pthread_join(workers[i], NULL);
+	}
+	(void)fflush(stdout);
+
+	double elapsedSeconds = getMonotonicSeconds() - startTime;
+	(void)fprintf(stderr, "scan: %lu images (%lu failed), %lu entries in %.3fs, %.1f images/s\n",
+				  context.imageCount, context.errorCount, context.entryCount, elapsedSeconds,
+				  elapsedSeconds > 0 ? context.imageCount / elapsedSeconds : 0.0);
+
+	pthread_mutex_destroy(&context.outputMutex);
+	destroyScanGate(&context.memory);
+	destroyScanGate(&context.openImages);
+	destroyScanQueue(&context.queue);
+	return isSourceValid ? context.errorCount : context.errorCount + 1;
+}
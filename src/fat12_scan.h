@@ -0,0 +1,35 @@
+#pragma once
+#include <stdint.h>
+
+#define SCAN_MAX_WORKERS 256
+// Paths waiting for a worker, bounds the memory used by huge image lists:
+#define SCAN_QUEUE_SLOTS_PER_WORKER 4
+// Bytes of FAT and directory buffers all workers may hold at the same time. Output buffers are not
+// counted, each worker flushes its own once it reaches SCAN_OUTPUT_FLUSH_BYTES:
+#define SCAN_MEMORY_BUDGET_BYTES (256ULL * 1024 * 1024)
+// Upper bound of the sub directory buffers reserved for a single image, deeper trees report an
+// error for the directories that do not fit:
+#define SCAN_IMAGE_DIRECTORY_BYTES (4ULL * 1024 * 1024)
+// File descriptors left for stdio and the enumeration of the input directory:
+#define SCAN_RESERVED_FILE_DESCRIPTORS 16
+#define SCAN_OUTPUT_FLUSH_BYTES (64 * 1024)
+#define SCAN_MAX_DIRECTORY_DEPTH 64
+
+/**
+ * @brief Scans many FAT12 images concurrently and prints a JSONL inventory of their content.
+ * Every file and directory produces one line on stdout:
+ * {"image":..,"path":..,"type":"file"|"dir","size":..,"attributes":..,"firstCluster":..,
+ *  "clusters":..,"chainComplete":..,"created":..,"modified":..}
+ * Images or directories that can not be parsed produce {"image":..,["path":..,]"error":..} instead
+ * of terminating the scan.
+ * Images are processed by a fixed pool of workers, the amount of open images and the memory held
+ * by all workers are bounded and workers wait when the bound is reached. An image reserves all the
+ * memory it may need before it is read, so a worker never waits while holding a part of the budget.
+ *
+ * @param[in] source A directory that is searched recursively for *.img files, or a file holding
+ * one image path per line ("-" reads the list from stdin).
+ * @param[in] workerCount Amount of workers, 0 uses one worker per online cpu.
+ *
+ * @return Amount of images that failed to be scanned.
+ */
+uint64_t scanImages(const char* source, uint32_t workerCount);
@@ -0,0 +1,938 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "allocwrap.h"
+#include "device_compressed.h"
+#include "fat12.h"
+#include "fat12_serve.h"
+#include "fat12_string.h"
+
+#define SERVE_LISTEN_BACKLOG 128
+#define SERVE_MAX_EVENTS 64
+#define SERVE_REQUEST_MAX_BYTES (sizeof(ServeRequest) + SERVE_MAX_PATH)
+#define SERVE_NAME_MAX_BYTES 13
+
+typedef struct ServeDirectory {
+	FAT12DirectoryEntry* entries;  // Only files and sub directories
+	char** names;
+	int32_t* subDirectoryIndex;	 // Index into the image directories, -1 for files
+	uint32_t entriesCount;
+} ServeDirectory;
+
+typedef struct ServeImage {
+	const char* path;
+	int fileDescriptor;	 // Held open for splice, -1 when the image can not be spliced from
+	FAT12Header fat12Header;
+	FAT12Info fat12Info;
+	uint8_t* fat;
+	uint32_t bytesPerCluster;
+	ServeDirectory* directories;  // The root directory is at index 0
+	uint32_t directoriesCount;
+} ServeImage;
+
+typedef struct ServeClient {
+	int socket;
+	uint8_t buffer[SERVE_REQUEST_MAX_BYTES];
+	uint32_t bufferedBytes;
+
+	// Response bytes the socket did not take yet, they go out before anything else:
+	uint8_t* pending;
+	uint64_t pendingStart;
+	uint64_t pendingEnd;
+	uint64_t pendingCapacity;
+	// The rest of a read-range whose header is already out, readImage is NULL when there is none:
+	const ServeImage* readImage;
+	uint16_t readClusterId;
+	uint32_t readClusterOffset;
+	uint64_t readBytes;
+
+	struct ServeClient* next;  // Work queue link
+	// Links of the list of connected clients:
+	struct ServeClient* previousClient;
+	struct ServeClient* nextClient;
+} ServeClient;
+
+typedef struct ServeServer {
+	ServeImage* images;
+	uint32_t imagesCount;
+	int epoll;
+
+	// Clients with pending requests, a client is queued at most once since its epoll registration
+	// is one shot and only re-armed by the worker that handled it:
+	pthread_mutex_t queueMutex;
+	pthread_cond_t queueCondition;
+	ServeClient* queueHead;
+	ServeClient* queueTail;
+	bool isStopping;
+	ServeClient* clients;  // Every connected client, guarded by queueMutex
+} ServeServer;
+
+typedef struct ServeWorker {
+	ServeServer* server;
+	pthread_t thread;
+	int pipe[2];
+	uint8_t* buffer;  // SERVE_READ_CHUNK_BYTES, compressed reads and ls payloads
+	uint64_t bufferCapacity;
+} ServeWorker;
+
+// Distinct addresses tagging the epoll events that are not clients:
+static char listenTag;
+static char signalTag;
+
+/** Reads a directory chain, stopping at clusters already read as part of another directory. */
+static FAT12DirectoryEntry* readServeDirectory(ServeImage* image, uint16_t firstClusterId,
+											   bool* isVisited, uint32_t* entriesCount) {
+	uint8_t* data = NULL;
+	uint32_t clusterCount = 0;
+	uint16_t clusterId = firstClusterId;
+	while (isDataClusterId(clusterId, &image->fat12Info) && !isVisited[clusterId]) {
+		isVisited[clusterId] = true;
+		data = xrealloc(data, (uint64_t)(clusterCount + 1) * image->bytesPerCluster);
+		preadDevice(data + (uint64_t)clusterCount * image->bytesPerCluster,
+					image->bytesPerCluster,
+					(int64_t)getClusterDeviceOffset(clusterId, &image->fat12Info), image->path);
+		clusterCount++;
+		clusterId = getNextClusterId(clusterId, image->fat);
+	}
+
+	*entriesCount = (uint64_t)clusterCount * image->bytesPerCluster / sizeof(FAT12DirectoryEntry);
+	return (FAT12DirectoryEntry*)data;
+}
+
+/** Decodes a directory and every directory below it into the image directories.
+ * @return Index of the directory. */
+static int32_t loadServeDirectory(ServeImage* image, FAT12DirectoryEntry* rawEntries,
+								  uint32_t rawCount, bool* isVisited) {
+	int32_t directoryIndex = image->directoriesCount;
+	image->directories =
+		xrealloc(image->directories, (image->directoriesCount + 1) * sizeof(ServeDirectory));
+	image->directoriesCount++;
+
+	uint32_t count = 0;
+	FAT12DirectoryEntry* entries =
+		xmalloc((rawCount ? rawCount : 1) * sizeof(FAT12DirectoryEntry));
+	for (uint32_t i = 0; i < rawCount && !isFinalDirectoryEntry(&rawEntries[i]); i++) {
+		FAT12DirectoryEntry* entry = &rawEntries[i];
+		if (!isDeletedEntry(entry) && !isVolumeLabelEntry(entry) && !isDotDirectoryEntry(entry)) {
+			memcpy(&entries[count], entry, sizeof(FAT12DirectoryEntry));
+			count++;
+		}
+	}
+	char** names = (char**)xmalloc((count ? count : 1) * sizeof(char*));
+	int32_t* subDirectoryIndex = xmalloc((count ? count : 1) * sizeof(int32_t));
+	for (uint32_t i = 0; i < count; i++) {
+		names[i] = fatFileNameToStr(entries[i].fileName);
+		subDirectoryIndex[i] = -1;
+		if (isDirectoryEntryDirectory(&entries[i])) {
+			uint32_t subCount;
+			FAT12DirectoryEntry* subEntries =
+				readServeDirectory(image, entries[i].firstClusterId, isVisited, &subCount);
+			subDirectoryIndex[i] = loadServeDirectory(image, subEntries, subCount, isVisited);
+			free(subEntries);
+		}
+	}
+
+	// The recursion above moves the directories array, it is only indexed after it:
+	ServeDirectory* directory = &image->directories[directoryIndex];
+	directory->entries = entries;
+	directory->names = names;
+	directory->subDirectoryIndex = subDirectoryIndex;
+	directory->entriesCount = count;
+	return directoryIndex;
+}
+
+/** Checks that splice can read from the image, it fails for example on some FUSE filesystems. */
+static bool canSpliceFrom(int fileDescriptor) {
+	int testPipe[2];
+	if (pipe2(testPipe, O_CLOEXEC) != 0) {
+		return false;
+	}
+	loff_t offset = 0;
+	bool canSplice = splice(fileDescriptor, &offset, testPipe[1], NULL, 1, 0) == 1;
+	close(testPipe[0]);
+	close(testPipe[1]);
+	return canSplice;
+}
+
+static bool openServeImage(ServeImage* image, const char* path) {
+	memset(image, 0, sizeof(ServeImage));
+	image->path = path;
+	image->fileDescriptor = -1;
+
+	uint64_t deviceBytes = getDeviceBytes(path);
+	if (deviceBytes < sizeof(FAT12Header)) {
+		(void)fprintf(stderr, "Can not read FAT12 header of %s\n", path);
+		return false;
+	}
+	preadDevice((uint8_t*)&image->fat12Header, sizeof(FAT12Header), 0, path);
+	const char* headerError = getFat12HeaderError(&image->fat12Header, deviceBytes);
+	if (headerError) {
+		(void)fprintf(stderr, "Invalid FAT12 filesystem %s: %s\n", path, headerError);
+		return false;
+	}
+	loadFat12Info(&image->fat12Info, &image->fat12Header);
+	image->bytesPerCluster = image->fat12Info.bytesPerSector * image->fat12Info.sectorsPerCluster;
+	image->fat = getFat(&image->fat12Info, path);
+
+	const uint32_t ROOT_DIR_BYTES =
+		image->fat12Info.rootDirSectorsSize * image->fat12Info.bytesPerSector;
+	FAT12DirectoryEntry* rootEntries = xmalloc(ROOT_DIR_BYTES);
+	preadDevice((uint8_t*)rootEntries, ROOT_DIR_BYTES,
+				(int64_t)image->fat12Info.rootDirSectorOffset * image->fat12Info.bytesPerSector,
+				path);
+	bool* isVisited = calloc(image->fat12Info.clusterCount + 2, sizeof(bool));
+	if (!isVisited) {
+		perror("");
+		exit(-1);
+	}
+	loadServeDirectory(image, rootEntries, ROOT_DIR_BYTES / sizeof(FAT12DirectoryEntry), isVisited);
+	free(isVisited);
+	free(rootEntries);
+
+	if (!isCompressedDevicePath(path)) {
+		image->fileDescriptor = open(path, O_RDONLY | O_CLOEXEC);
+		if (image->fileDescriptor != -1 && !canSpliceFrom(image->fileDescriptor)) {
+			close(image->fileDescriptor);
+			image->fileDescriptor = -1;
+		}
+	}
+	return true;
+}
+
+static void closeServeImage(ServeImage* image) {
+	for (uint32_t i = 0; i < image->directoriesCount; i++) {
+		ServeDirectory* directory = &image->directories[i];
+		for (uint32_t j = 0; j < directory->entriesCount; j++) {
+			free(directory->names[j]);
+		}
+		free((void*)directory->names);
+		free(directory->entries);
+		free(directory->subDirectoryIndex);
+	}
+	free(image->directories);
+	free(image->fat);
+	if (image->fileDescriptor != -1) {
+		close(image->fileDescriptor);
+	}
+}
+
+/** Resolves path against the cached directory tree. The root is resolved to entryIndex -1.
+ * @return SERVE_STATUS_OK or the reason the path does not resolve. */
+static ServeStatus resolveServePath(const ServeImage* image, char* path, int32_t* directoryIndex,
+									int32_t* entryIndex) {
+	*directoryIndex = 0;
+	*entryIndex = -1;
+	char* savePtr;
+	for (char* name = strtok_r(path, "/", &savePtr); name; name = strtok_r(NULL, "/", &savePtr)) {
+		if (*entryIndex != -1) {
+			int32_t subDirectoryIndex =
+				image->directories[*directoryIndex].subDirectoryIndex[*entryIndex];
+			if (subDirectoryIndex == -1) {
+				return SERVE_STATUS_NOT_DIRECTORY;
+			}
+			*directoryIndex = subDirectoryIndex;
+		}
+
+		const ServeDirectory* directory = &image->directories[*directoryIndex];
+		*entryIndex = -1;
+		for (uint32_t i = 0; i < directory->entriesCount; i++) {
+			if (strcasecmp(directory->names[i], name) == 0) {
+				*entryIndex = i;
+				break;
+			}
+		}
+		if (*entryIndex == -1) {
+			return SERVE_STATUS_NOT_FOUND;
+		}
+	}
+	return SERVE_STATUS_OK;
+}
+
+static void fillServeStat(ServeStat* stat, const FAT12DirectoryEntry* entry) {
+	stat->size = entry->fileSizeInBytes;
+	stat->attributes = entry->attributes;
+	stat->firstClusterId = entry->firstClusterId;
+	stat->creation = ((uint32_t)entry->creationDate << 16) | entry->creationTime;
+	stat->modification = ((uint32_t)entry->lastModifyDate << 16) | entry->lastModifyTime;
+}
+
+static bool isOutputPending(const ServeClient* client) {
+	return client->pendingStart != client->pendingEnd || client->readImage;
+}
+
+/** @return Space for bytes more at the end of the client pending output. */
+static uint8_t* reservePendingOutput(ServeClient* client, uint64_t bytes) {
+	if (client->pendingStart == client->pendingEnd) {
+		client->pendingStart = 0;
+		client->pendingEnd = 0;
+	}
+	if (client->pendingEnd + bytes > client->pendingCapacity) {
+		client->pendingCapacity = client->pendingEnd + bytes;
+		client->pending = xrealloc(client->pending, client->pendingCapacity);
+	}
+	return client->pending + client->pendingEnd;
+}
+
+static void appendPendingOutput(ServeClient* client, const struct iovec* iovecs,
+								uint32_t iovecsCount) {
+	for (uint32_t i = 0; i < iovecsCount; i++) {
+		memcpy(reservePendingOutput(client, iovecs[i].iov_len), iovecs[i].iov_base,
+			   iovecs[i].iov_len);
+		client->pendingEnd += iovecs[i].iov_len;
+	}
+}
+
+/** Sends the iovecs without waiting, whatever the full socket does not take is appended to the
+ * client pending output. Once output is pending everything is appended, so responses keep their
+ * order. moreFlag is MSG_MORE when the caller is about to send more.
+ * @return false when the client has to be disconnected. */
+static bool sendOutput(ServeClient* client, struct iovec* iovecs, uint32_t iovecsCount,
+					   int moreFlag) {
+	struct msghdr message = {.msg_iov = iovecs, .msg_iovlen = iovecsCount};
+	if (client->pendingStart != client->pendingEnd) {
+		appendPendingOutput(client, message.msg_iov, message.msg_iovlen);
+		return true;
+	}
+	while (message.msg_iovlen > 0) {
+		ssize_t sentBytes = sendmsg(client->socket, &message, MSG_NOSIGNAL | moreFlag);
+		if (sentBytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (sentBytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			appendPendingOutput(client, message.msg_iov, message.msg_iovlen);
+			return true;
+		}
+		if (sentBytes == -1) {
+			return false;
+		}
+
+		while (message.msg_iovlen > 0 && (uint64_t)sentBytes >= message.msg_iov->iov_len) {
+			sentBytes -= message.msg_iov->iov_len;
+			message.msg_iov++;
+			message.msg_iovlen--;
+		}
+		if (message.msg_iovlen > 0) {
+			message.msg_iov->iov_base = (uint8_t*)message.msg_iov->iov_base + sentBytes;
+			message.msg_iov->iov_len -= sentBytes;
+		}
+	}
+	return true;
+}
+
+/** Sends as much of the pending output as the socket takes.
+ * @return false when the client has to be disconnected. */
+static bool flushPendingOutput(ServeClient* client) {
+	while (client->pendingStart != client->pendingEnd) {
+		ssize_t sentBytes = send(client->socket, client->pending + client->pendingStart,
+								 client->pendingEnd - client->pendingStart, MSG_NOSIGNAL);
+		if (sentBytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (sentBytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			return true;
+		}
+		if (sentBytes == -1) {
+			return false;
+		}
+		client->pendingStart += sentBytes;
+	}
+	return true;
+}
+
+static bool sendResponse(ServeClient* client, uint32_t requestId, ServeStatus status,
+						 const void* payload, uint32_t payloadBytes, int moreFlag) {
+	ServeResponse response = {.requestId = requestId, .status = status, .length = payloadBytes};
+	struct iovec iovecs[2] = {
+		{.iov_base = &response, .iov_len = sizeof(response)},
+		{.iov_base = (void*)payload, .iov_len = payloadBytes},
+	};
+	return sendOutput(client, iovecs, payloadBytes ? 2 : 1, moreFlag);
+}
+
+static void reserveWorkerBuffer(ServeWorker* worker, uint64_t bytes) {
+	if (bytes > worker->bufferCapacity) {
+		worker->bufferCapacity = bytes;
+		worker->buffer = xrealloc(worker->buffer, bytes);
+	}
+}
+
+static bool handleLs(ServeWorker* worker, ServeClient* client, const ServeImage* image,
+					 const ServeRequest* request, int32_t directoryIndex, int32_t entryIndex) {
+	if (entryIndex != -1) {
+		directoryIndex = image->directories[directoryIndex].subDirectoryIndex[entryIndex];
+		if (directoryIndex == -1) {
+			return sendResponse(client, request->requestId, SERVE_STATUS_NOT_DIRECTORY, NULL, 0, 0);
+		}
+	}
+
+	const ServeDirectory* directory = &image->directories[directoryIndex];
+	reserveWorkerBuffer(worker, (uint64_t)directory->entriesCount *
+									(sizeof(ServeStat) + 1 + SERVE_NAME_MAX_BYTES));
+	uint8_t* curr = worker->buffer;
+	for (uint32_t i = 0; i < directory->entriesCount; i++) {
+		ServeStat stat;
+		fillServeStat(&stat, &directory->entries[i]);
+		memcpy(curr, &stat, sizeof(ServeStat));
+		curr += sizeof(ServeStat);
+		uint8_t nameLength = strlen(directory->names[i]);
+		*curr++ = nameLength;
+		memcpy(curr, directory->names[i], nameLength);
+		curr += nameLength;
+	}
+	return sendResponse(client, request->requestId, SERVE_STATUS_OK, worker->buffer,
+						curr - worker->buffer, 0);
+}
+
+/** Replaces the worker pipe, whatever is left in it would be sent to the next client. */
+static void resetWorkerPipe(ServeWorker* worker) {
+	close(worker->pipe[0]);
+	close(worker->pipe[1]);
+	if (pipe2(worker->pipe, O_CLOEXEC) != 0) {
+		perror("Failed to create serve worker pipe");
+		exit(-1);
+	}
+}
+
+/** Moves the bytes the full socket did not take from the worker pipe to the client pending
+ * output, so the pipe is empty for the next client. */
+static bool drainPipeToPendingOutput(ServeWorker* worker, ServeClient* client, uint64_t bytes) {
+	uint8_t* pending = reservePendingOutput(client, bytes);
+	while (bytes > 0) {
+		ssize_t readBytes = read(worker->pipe[0], pending, bytes);
+		if (readBytes == -1 && errno == EINTR) {
+			continue;
+		}
+		if (readBytes <= 0) {
+			resetWorkerPipe(worker);
+			return false;
+		}
+		pending += readBytes;
+		bytes -= readBytes;
+		client->pendingEnd += readBytes;
+	}
+	return true;
+}
+
+/** Moves bytes of the image at offset into the socket through the worker pipe, stopping when the
+ * socket is full.
+ * @return Bytes taken from the image, sent or left pending, -1 when the client has to be
+ * disconnected. */
+static int64_t spliceToSocket(ServeWorker* worker, ServeClient* client, int fileDescriptor,
+							  uint64_t offset, uint64_t bytes) {
+	loff_t imageOffset = offset;
+	uint64_t movedBytes = 0;
+	while (movedBytes < bytes && client->pendingStart == client->pendingEnd) {
+		uint64_t stepBytes = bytes - movedBytes < SERVE_READ_CHUNK_BYTES ? bytes - movedBytes
+																		 : SERVE_READ_CHUNK_BYTES;
+		ssize_t inPipe = splice(fileDescriptor, &imageOffset, worker->pipe[1], NULL, stepBytes,
+								SPLICE_F_MOVE);
+		if (inPipe <= 0) {
+			return -1;
+		}
+		movedBytes += inPipe;
+
+		while (inPipe > 0) {
+			unsigned int flags =
+				SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (movedBytes < bytes ? SPLICE_F_MORE : 0);
+			ssize_t sentBytes = splice(worker->pipe[0], NULL, client->socket, NULL, inPipe, flags);
+			if (sentBytes == -1 && errno == EINTR) {
+				continue;
+			}
+			if (sentBytes == -1 && errno == EAGAIN) {
+				if (!drainPipeToPendingOutput(worker, client, inPipe)) {
+					return -1;
+				}
+				break;
+			}
+			if (sentBytes <= 0) {
+				resetWorkerPipe(worker);
+				return -1;
+			}
+			inPipe -= sentBytes;
+		}
+	}
+	return movedBytes;
+}
+
+/** @return Bytes taken from the image, sent or left pending, -1 when the client has to be
+ * disconnected. */
+static int64_t sendRun(ServeWorker* worker, ServeClient* client, const ServeImage* image,
+					   uint64_t offset, uint64_t bytes) {
+	if (image->fileDescriptor != -1) {
+		return spliceToSocket(worker, client, image->fileDescriptor, offset, bytes);
+	}
+
+	reserveWorkerBuffer(worker, SERVE_READ_CHUNK_BYTES);
+	uint64_t movedBytes = 0;
+	while (movedBytes < bytes && client->pendingStart == client->pendingEnd) {
+		uint64_t stepBytes = bytes - movedBytes < SERVE_READ_CHUNK_BYTES ? bytes - movedBytes
+																		 : SERVE_READ_CHUNK_BYTES;
+		preadDevice(worker->buffer, stepBytes, (int64_t)(offset + movedBytes), image->path);
+		movedBytes += stepBytes;
+		struct iovec iovec = {.iov_base = worker->buffer, .iov_len = stepBytes};
+		if (!sendOutput(client, &iovec, 1, movedBytes < bytes ? MSG_MORE : 0)) {
+			return -1;
+		}
+	}
+	return movedBytes;
+}
+
+/** Sends the rest of the client read-range run by run of contiguous clusters, until it is done or
+ * the socket is full. The chain was checked before the response header was sent.
+ * @return false when the client has to be disconnected. */
+static bool continueRead(ServeWorker* worker, ServeClient* client) {
+	const ServeImage* image = client->readImage;
+	while (client->readBytes > 0 && client->pendingStart == client->pendingEnd) {
+		uint64_t runBytes = image->bytesPerCluster - client->readClusterOffset;
+		uint16_t runEnd = client->readClusterId;
+		while (runBytes < client->readBytes && getNextClusterId(runEnd, image->fat) == runEnd + 1) {
+			runEnd++;
+			runBytes += image->bytesPerCluster;
+		}
+		runBytes = runBytes < client->readBytes ? runBytes : client->readBytes;
+		uint64_t deviceOffset = getClusterDeviceOffset(client->readClusterId, &image->fat12Info) +
+								client->readClusterOffset;
+		int64_t movedBytes = sendRun(worker, client, image, deviceOffset, runBytes);
+		if (movedBytes < 0) {
+			return false;
+		}
+
+		client->readBytes -= movedBytes;
+		uint64_t clusterOffset = client->readClusterOffset + (uint64_t)movedBytes;
+		while (client->readBytes > 0 && clusterOffset >= image->bytesPerCluster) {
+			client->readClusterId = getNextClusterId(client->readClusterId, image->fat);
+			clusterOffset -= image->bytesPerCluster;
+		}
+		client->readClusterOffset = clusterOffset;
+	}
+	if (client->readBytes == 0) {
+		client->readImage = NULL;
+	}
+	return true;
+}
+
+/** Starts sending the requested range of a file. The chain is walked in the cached fat first, so
+ * a broken chain is reported before the response header is sent. */
+static bool handleRead(ServeWorker* worker, ServeClient* client, const ServeImage* image,
+					   const ServeRequest* request, const FAT12DirectoryEntry* entry) {
+	if (isDirectoryEntryDirectory(entry)) {
+		return sendResponse(client, request->requestId, SERVE_STATUS_IS_DIRECTORY, NULL, 0, 0);
+	}
+	uint64_t fileBytes = entry->fileSizeInBytes;
+	uint64_t offset = request->offset < fileBytes ? request->offset : fileBytes;
+	uint64_t bytes = fileBytes - offset < request->length ? fileBytes - offset : request->length;
+	if (bytes == 0) {
+		return sendResponse(client, request->requestId, SERVE_STATUS_OK, NULL, 0, 0);
+	}
+
+	uint32_t skipClusters = offset / image->bytesPerCluster;
+	uint32_t neededClusters = (offset + bytes - 1) / image->bytesPerCluster - skipClusters + 1;
+	uint16_t firstClusterId = 0;
+	uint16_t clusterId = entry->firstClusterId;
+	for (uint32_t step = 0; step < skipClusters + neededClusters; step++) {
+		// A chain longer than the cluster count loops:
+		if (!isDataClusterId(clusterId, &image->fat12Info) ||
+			step >= image->fat12Info.clusterCount) {
+			return sendResponse(client, request->requestId, SERVE_STATUS_CORRUPTED_CHAIN, NULL, 0,
+								0);
+		}
+		if (step == skipClusters) {
+			firstClusterId = clusterId;
+		}
+		clusterId = getNextClusterId(clusterId, image->fat);
+	}
+
+	// The header announces the whole range, the runs follow it without another header:
+	ServeResponse response = {.requestId = request->requestId, .status = SERVE_STATUS_OK,
+							  .length = bytes};
+	struct iovec iovec = {.iov_base = &response, .iov_len = sizeof(response)};
+	if (!sendOutput(client, &iovec, 1, MSG_MORE)) {
+		return false;
+	}
+	client->readImage = image;
+	client->readClusterId = firstClusterId;
+	client->readClusterOffset = offset % image->bytesPerCluster;
+	client->readBytes = bytes;
+	return continueRead(worker, client);
+}
+
+/** @return false when the client has to be disconnected. */
+static bool handleRequest(ServeWorker* worker, ServeClient* client, const ServeRequest* request,
+						  const char* requestPath) {
+	if (request->imageIndex >= worker->server->imagesCount ||
+		(request->opcode != SERVE_OP_LS && request->opcode != SERVE_OP_STAT &&
+		 request->opcode != SERVE_OP_READ)) {
+		return sendResponse(client, request->requestId, SERVE_STATUS_BAD_REQUEST, NULL, 0, 0);
+	}
+
+	const ServeImage* image = &worker->server->images[request->imageIndex];
+	char path[SERVE_MAX_PATH + 1];
+	memcpy(path, requestPath, request->pathLength);
+	path[request->pathLength] = '\0';
+	int32_t directoryIndex;
+	int32_t entryIndex;
+	ServeStatus status = resolveServePath(image, path, &directoryIndex, &entryIndex);
+	if (status != SERVE_STATUS_OK) {
+		return sendResponse(client, request->requestId, status, NULL, 0, 0);
+	}
+	// The root directory has no entry of its own:
+	FAT12DirectoryEntry rootEntry = {.attributes = FAT12_ATTR_DIRECTORY};
+	const FAT12DirectoryEntry* entry =
+		entryIndex == -1 ? &rootEntry : &image->directories[directoryIndex].entries[entryIndex];
+
+	if (request->opcode == SERVE_OP_LS) {
+		return handleLs(worker, client, image, request, directoryIndex, entryIndex);
+	}
+	if (request->opcode == SERVE_OP_STAT) {
+		ServeStat stat;
+		fillServeStat(&stat, entry);
+		return sendResponse(client, request->requestId, SERVE_STATUS_OK, &stat, sizeof(stat), 0);
+	}
+	return handleRead(worker, client, image, request, entry);
+}
+
+/** Answers the complete requests in the client buffer, stopping after a response that did not
+ * fit in the socket so the next request is only parsed once it is out.
+ * @return false when the client broke the protocol or has to be disconnected. */
+static bool handleBufferedRequests(ServeWorker* worker, ServeClient* client) {
+	uint32_t consumedBytes = 0;
+	bool isHandled = true;
+	while (!isOutputPending(client) &&
+		   client->bufferedBytes - consumedBytes >= sizeof(ServeRequest)) {
+		ServeRequest request;
+		memcpy(&request, client->buffer + consumedBytes, sizeof(ServeRequest));
+		if (request.pathLength > SERVE_MAX_PATH) {
+			return false;
+		}
+		uint32_t requestBytes = sizeof(ServeRequest) + request.pathLength;
+		if (client->bufferedBytes - consumedBytes < requestBytes) {
+			break;
+		}
+		const char* path = (const char*)client->buffer + consumedBytes + sizeof(ServeRequest);
+		isHandled = handleRequest(worker, client, &request, path);
+		consumedBytes += requestBytes;
+		if (!isHandled) {
+			break;
+		}
+	}
+	memmove(client->buffer, client->buffer + consumedBytes, client->bufferedBytes - consumedBytes);
+	client->bufferedBytes -= consumedBytes;
+	return isHandled;
+}
+
+/** Finishes the response in progress, then answers the requests already received and receives
+ * once more when all of them are answered. Nothing waits for the socket, a client whose socket is
+ * full is left with pending output and handed back to epoll.
+ * @return false when the client disconnected or broke the protocol. */
+static bool serveClient(ServeWorker* worker, ServeClient* client) {
+	if (!flushPendingOutput(client) || (client->readImage && !continueRead(worker, client))) {
+		return false;
+	}
+	if (isOutputPending(client)) {
+		return true;
+	}
+	if (!handleBufferedRequests(worker, client)) {
+		return false;
+	}
+	if (isOutputPending(client)) {
+		return true;
+	}
+
+	ssize_t receivedBytes;
+	do {
+		receivedBytes = recv(client->socket, client->buffer + client->bufferedBytes,
+							 SERVE_REQUEST_MAX_BYTES - client->bufferedBytes, 0);
+	} while (receivedBytes == -1 && errno == EINTR);
+	if (receivedBytes == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+		return true;
+	}
+	if (receivedBytes <= 0) {
+		return false;
+	}
+	client->bufferedBytes += receivedBytes;
+	return handleBufferedRequests(worker, client);
+}
+
+/** Waits for the socket to drain while output is pending, for requests otherwise. */
+static void rearmClient(ServeServer* server, ServeClient* client) {
+	uint32_t readiness = isOutputPending(client) ? EPOLLOUT : EPOLLIN;
+	struct epoll_event event = {.events = readiness | EPOLLRDHUP | EPOLLONESHOT,
+								.data.ptr = client};
+	if (epoll_ctl(server->epoll, EPOLL_CTL_MOD, client->socket, &event) != 0) {
+		perror("Failed to rearm serve client");
+		exit(-1);
+	}
+}
+
+/** Closes the socket, which removes it from the epoll set, and frees the client. */
+static void closeServeClient(ServeServer* server, ServeClient* client) {
+	pthread_mutex_lock(&server->queueMutex);
+	if (client->previousClient) {
+		client->previousClient->nextClient = client->nextClient;
+	} else {
+		server->clients = client->nextClient;
+	}
+	if (client->nextClient) {
+		client->nextClient->previousClient = client->previousClient;
+	}
+	pthread_mutex_unlock(&server->queueMutex);
+
+	close(client->socket);
+	free(client->pending);
+	free(client);
+}
+
+static void* serveWorker(void* arg) {
+	ServeWorker* worker = arg;
+	ServeServer* server = worker->server;
+	while (true) {
+		pthread_mutex_lock(&server->queueMutex);
+		while (!server->queueHead && !server->isStopping) {
+			pthread_cond_wait(&server->queueCondition, &server->queueMutex);
+		}
+		ServeClient* client = server->queueHead;
+		if (!client) {
+			pthread_mutex_unlock(&server->queueMutex);
+			break;
+		}
+		server->queueHead = client->next;
+		if (!server->queueHead) {
+			server->queueTail = NULL;
+		}
+		pthread_mutex_unlock(&server->queueMutex);
+
+		if (serveClient(worker, client)) {
+			rearmClient(server, client);
+		} else {
+			// No other thread refers to the client while its one shot registration is not re-armed:
+			closeServeClient(server, client);
+		}
+	}
+	return NULL;
+}
+
+static void queueClient(ServeServer* server, ServeClient* client) {
+	pthread_mutex_lock(&server->queueMutex);
+	client->next = NULL;
+	if (server->queueTail) {
+		server->queueTail->next = client;
+	} else {
+		server->queueHead = client;
+	}
+	server->queueTail = client;
+	pthread_cond_signal(&server->queueCondition);
+	pthread_mutex_unlock(&server->queueMutex);
+}
+
+static void acceptClients(ServeServer* server, int listenSocket) {
+	while (true) {
+		int socket = accept4(listenSocket, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (socket == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+				perror("Failed to accept serve client");
+			}
+			return;
+		}
+
+		ServeClient* client = calloc(1, sizeof(ServeClient));
+		if (!client) {
+			perror("");
+			exit(-1);
+		}
+		client->socket = socket;
+		pthread_mutex_lock(&server->queueMutex);
+		client->nextClient = server->clients;
+		if (server->clients) {
+			server->clients->previousClient = client;
+		}
+		server->clients = client;
+		pthread_mutex_unlock(&server->queueMutex);
+
+		struct epoll_event event = {.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT,
+									.data.ptr = client};
+		if (epoll_ctl(server->epoll, EPOLL_CTL_ADD, socket, &event) != 0) {
+			perror("Failed to register serve client");
+			closeServeClient(server, client);
+		}
+	}
+}
+
+/** Binds the listening socket, replacing a socket file no server is listening on anymore. */
+static int bindServeSocket(const char* socketPath) {
+	struct sockaddr_un address = {.sun_family = AF_UNIX};
+	if (strlen(socketPath) >= sizeof(address.sun_path)) {
+		(void)fprintf(stderr, "Socket path is too long: %s\n", socketPath);
+		return -1;
+	}
+	strcpy(address.sun_path, socketPath);
+
+	struct stat socketStat;
+	if (stat(socketPath, &socketStat) == 0 && S_ISSOCK(socketStat.st_mode)) {
+		int probe = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		bool isInUse = probe != -1 &&
+					   connect(probe, (struct sockaddr*)&address, sizeof(address)) == 0;
+		if (probe != -1) {
+			close(probe);
+		}
+		if (isInUse) {
+			(void)fprintf(stderr, "Another server is listening on %s\n", socketPath);
+			return -1;
+		}
+		(void)unlink(socketPath);
+	}
+
+	int listenSocket = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listenSocket == -1 ||
+		bind(listenSocket, (struct sockaddr*)&address, sizeof(address)) != 0 ||
+		listen(listenSocket, SERVE_LISTEN_BACKLOG) != 0) {
+		perror("Failed to listen on serve socket");
+		if (listenSocket != -1) {
+			close(listenSocket);
+		}
+		return -1;
+	}
+	return listenSocket;
+}
+
+static uint32_t getServeWorkerCount(void) {
+	long onlineCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t workerCount = onlineCpus > 0 ? (uint32_t)onlineCpus : 1;
+	return workerCount > SERVE_MAX_WORKERS ? SERVE_MAX_WORKERS : workerCount;
+}
+
+/** Runs the epoll loop until SIGINT or SIGTERM arrives on signalFd. */
+static void runServeLoop(ServeServer* server, int listenSocket, int signalFd) {
+	struct epoll_event events[SERVE_MAX_EVENTS];
+	while (true) {
+		int eventsCount = epoll_wait(server->epoll, events, SERVE_MAX_EVENTS, -1);
+		if (eventsCount == -1 && errno == EINTR) {
+			continue;
+		}
+		if (eventsCount == -1) {
+			perror("Serve loop failed");
+			return;
+		}
+
+		for (int i = 0; i < eventsCount; i++) {
+			if (events[i].data.ptr == &signalTag) {
+				struct signalfd_siginfo signalInfo;
+				(void)read(signalFd, &signalInfo, sizeof(signalInfo));
+				return;
+			}
+			if (events[i].data.ptr == &listenTag) {
+				acceptClients(server, listenSocket);
+			} else {
+				queueClient(server, events[i].data.ptr);
+			}
+		}
+	}
+}
+
+int serveImages(const char* socketPath, char** imagePaths, uint32_t imagesCount) {
+	if (imagesCount == 0 || imagesCount > SERVE_MAX_IMAGES) {
+		(void)fprintf(stderr, "serve: between 1 and %d images can be served\n", SERVE_MAX_IMAGES);
+		return -1;
+	}
+	ServeServer server = {.imagesCount = imagesCount};
+	server.images = xmalloc(imagesCount * sizeof(ServeImage));
+	for (uint32_t i = 0; i < imagesCount; i++) {
+		if (!openServeImage(&server.images[i], imagePaths[i])) {
+			for (uint32_t j = 0; j < i; j++) {
+				closeServeImage(&server.images[j]);
+			}
+			free(server.images);
+			return -1;
+		}
+	}
+
+	int listenSocket = bindServeSocket(socketPath);
+	if (listenSocket == -1) {
+		for (uint32_t i = 0; i < imagesCount; i++) {
+			closeServeImage(&server.images[i]);
+		}
+		free(server.images);
+		return -1;
+	}
+
+	// Blocked before the workers start so they inherit the mask and only the signalfd sees them:
+	sigset_t stopSignals;
+	sigemptyset(&stopSignals);
+	sigaddset(&stopSignals, SIGINT);
+	sigaddset(&stopSignals, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+	(void)signal(SIGPIPE, SIG_IGN);
+	int signalFd = signalfd(-1, &stopSignals, SFD_CLOEXEC);
+	server.epoll = epoll_create1(EPOLL_CLOEXEC);
+	struct epoll_event listenEvent = {.events = EPOLLIN, .data.ptr = &listenTag};
+	struct epoll_event signalEvent = {.events = EPOLLIN, .data.ptr = &signalTag};
+	if (signalFd == -1 || server.epoll == -1 ||
+		epoll_ctl(server.epoll, EPOLL_CTL_ADD, listenSocket, &listenEvent) != 0 ||
+		epoll_ctl(server.epoll, EPOLL_CTL_ADD, signalFd, &signalEvent) != 0) {
+		perror("Failed to set up serve loop");
+		exit(-1);
+	}
+
+	pthread_mutex_init(&server.queueMutex, NULL);
+	pthread_cond_init(&server.queueCondition, NULL);
+	uint32_t workerCount = getServeWorkerCount();
+	ServeWorker workers[SERVE_MAX_WORKERS];
+	for (uint32_t i = 0; i < workerCount; i++) {
+		ServeWorker* worker = &workers[i];
+		memset(worker, 0, sizeof(ServeWorker));
+		worker->server = &server;
+		if (pipe2(worker->pipe, O_CLOEXEC) != 0) {
+			perror("Failed to create serve worker pipe");
+			exit(-1);
+		}
+		if (pthread_create(&worker->thread, NULL, serveWorker, worker) != 0) {
+			perror("Failed to create serve worker");
+			exit(-1);
+		}
+	}
+	(void)fprintf(stderr, "Serving %u images on %s with %u workers\n", imagesCount, socketPath,
+				  workerCount);
+
+	runServeLoop(&server, listenSocket, signalFd);
+
+	pthread_mutex_lock(&server.queueMutex);
+	server.isStopping = true;
+	pthread_cond_broadcast(&server.queueCondition);
+	pthread_mutex_unlock(&server.queueMutex);
+	for (uint32_t i = 0; i < workerCount; i++) {
+		pthread_join(workers[i].thread, NULL);
+		close(workers[i].pipe[0]);
+		close(workers[i].pipe[1]);
+		free(workers[i].buffer);
+	}
+	// The workers are gone, the clients still connected are only left in the list:
+	while (server.clients) {
+		closeServeClient(&server, server.clients);
+	}
+	close(listenSocket);
+	(void)unlink(socketPath);
+	close(signalFd);
+	close(server.epoll);
+	for (uint32_t i = 0; i < imagesCount; i++) {
+		closeServeImage(&server.images[i]);
+	}
+	free(server.images);
+	pthread_mutex_destroy(&server.queueMutex);
+	pthread_cond_destroy(&server.queueCondition);
+	return 0;
+}
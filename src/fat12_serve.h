@@ -0,0 +1,78 @@
+#pragma once
+#include <stdint.h>
+
+#define SERVE_MAX_IMAGES 256
+#define SERVE_MAX_WORKERS 64
+#define SERVE_MAX_PATH 1024
+// Bytes spliced through the worker pipe or read into the worker buffer per step of a read-range:
+#define SERVE_READ_CHUNK_BYTES (256 * 1024)
+
+/*
+ * Protocol: every request is a ServeRequest followed by pathLength bytes of path, not null
+ * terminated. Every request is answered in order by a ServeResponse followed by length bytes of
+ * payload. Integers are little endian, requests can be pipelined and requestId is echoed back.
+ *
+ * SERVE_OP_LS:   payload is one record per entry of the directory at path, a ServeStat followed by
+ *                a byte holding the name length and the name.
+ * SERVE_OP_STAT: payload is the ServeStat of the entry at path.
+ * SERVE_OP_READ: payload is up to length bytes of the file at path starting at offset, less when
+ *                the file ends first.
+ */
+typedef enum ServeOpcode {
+	SERVE_OP_LS = 1,
+	SERVE_OP_STAT = 2,
+	SERVE_OP_READ = 3,
+} ServeOpcode;
+
+typedef enum ServeStatus {
+	SERVE_STATUS_OK = 0,
+	SERVE_STATUS_NOT_FOUND = 1,
+	SERVE_STATUS_NOT_DIRECTORY = 2,
+	SERVE_STATUS_IS_DIRECTORY = 3,
+	SERVE_STATUS_BAD_REQUEST = 4,	  // Unknown opcode or image index
+	SERVE_STATUS_CORRUPTED_CHAIN = 5,  // The cluster chain ends before the file does
+} ServeStatus;
+
+typedef struct ServeRequest {
+	uint8_t opcode;
+	uint8_t imageIndex;	 // Position of the image on the serve command line
+	uint16_t pathLength;
+	uint32_t requestId;
+	uint64_t offset;  // SERVE_OP_READ only
+	uint32_t length;  // SERVE_OP_READ only
+} __attribute__((packed)) ServeRequest;
+
+typedef struct ServeResponse {
+	uint32_t requestId;
+	uint32_t status;  // ServeStatus, there is no payload unless it is SERVE_STATUS_OK
+	uint32_t length;
+} __attribute__((packed)) ServeResponse;
+
+typedef struct ServeStat {
+	uint32_t size;
+	uint8_t attributes;
+	uint16_t firstClusterId;
+	uint32_t creation;	// Raw FAT encoding, (date << 16) | time
+	uint32_t modification;
+} __attribute__((packed)) ServeStat;
+
+/**
+ * @brief Serves ls, stat and read-range requests for a set of images over a Unix socket until
+ * SIGINT or SIGTERM. Each image is validated and opened once, its fat and whole directory tree are
+ * decoded into memory up front so metadata requests never touch the device. Images must not be
+ * modified while they are served.
+ *
+ * A single epoll loop accepts clients and hands every client with pending requests to a pool of
+ * worker threads, one worker at a time per client. File data of uncompressed images is spliced
+ * from the image through a per worker pipe into the socket without copying it to user space,
+ * compressed images are read through their decompressed span cache and sent with sendmsg.
+ * Workers never wait for a socket: what a full socket does not take is kept as the client pending
+ * output, the client goes back to epoll until it drains and its next request is only parsed once
+ * the current response is out. Clients still connected at shutdown are closed.
+ *
+ * @param[in] socketPath Path the listening socket is bound to, a stale socket file is replaced.
+ * @param[in] imagePaths
+ * @param[in] imagesCount At most SERVE_MAX_IMAGES.
+ * @return 0 after a clean shutdown, -1 when an image is invalid or the socket can not be set up.
+ */
+int serveImages(const char* socketPath, char** imagePaths, uint32_t imagesCount);
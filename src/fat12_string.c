@@ -30,3 +30,36 @@ char* fatFileNameToStr(char* filenameFatFormat) {
 	name[j] = '\0';
 	return name;
 }
+
+static bool isValidFatNameChar(char c) {
+	const char SPECIAL_CHARS[] = "!#$%&'()-@^_`{}~";
+	return isalnum((unsigned char)c) || (c != '\0' && strchr(SPECIAL_CHARS, c));
+}
+
+bool strToFatFileName(char* filenameFatFormat, const char* name) {
+	const uint32_t FILENAME_LENGTH = 8;
+	const uint32_t EXTENSION_LENGTH = 3;
+
+	const char* extension = strrchr(name, '.');
+	uint64_t baseLength = extension ? (uint64_t)(extension - name) : strlen(name);
+	uint64_t extensionLength = extension ? strlen(extension + 1) : 0;
+	if (baseLength == 0 || baseLength > FILENAME_LENGTH || extensionLength > EXTENSION_LENGTH ||
+		(extension && extensionLength == 0)) {
+		return false;
+	}
+
+	memset(filenameFatFormat, ' ', FILENAME_LENGTH + EXTENSION_LENGTH);
+	for (uint32_t i = 0; i < baseLength; i++) {
+		if (!isValidFatNameChar(name[i])) {
+			return false;
+		}
+		filenameFatFormat[i] = (char)toupper((unsigned char)name[i]);
+	}
+	for (uint32_t i = 0; i < extensionLength; i++) {
+		if (!isValidFatNameChar(extension[i + 1])) {
+			return false;
+		}
+		filenameFatFormat[FILENAME_LENGTH + i] = (char)toupper((unsigned char)extension[i + 1]);
+	}
+	return true;
+}
@@ -1,4 +1,5 @@
 #pragma once
+#include <stdbool.h>
 #include <stdint.h>
 
 /** converts filename in the format of fat12 to a regular file name, handles errors internally and
@@ -7,3 +8,10 @@
  * @return an allocated string containing the name
  */
 char* fatFileNameToStr(char* filenameFatFormat);
+
+/** converts a regular file name to the fat12 format, the inverse of fatFileNameToStr
+ * @param[out] filenameFatFormat 11 chars that receive the name padded with spaces, not terminated
+ * @param[in] name a file name with up to 8 name chars and up to 3 extension chars
+ * @return false when name can not be stored as a fat12 short name
+ */
+bool strToFatFileName(char* filenameFatFormat, const char* name);
@@ -0,0 +1,463 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "allocwrap.h"
+#include "fat12.h"
+#include "fat12_string.h"
+#include "fat12_undelete.h"
+
+#define FREE_CLUSTER_ID 0x000
+
+typedef struct CarveSignature {
+	const char* type;
+	uint8_t bytes[CARVE_SIGNATURE_BYTES];
+	uint32_t length;
+} CarveSignature;
+
+static const CarveSignature CARVE_SIGNATURES[] = {
+	{"JPEG", {0xFF, 0xD8, 0xFF}, 3},
+	{"PNG", {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A}, 8},
+	{"GIF", {'G', 'I', 'F', '8'}, 4},
+	{"PDF", {'%', 'P', 'D', 'F', '-'}, 5},
+	{"ZIP", {'P', 'K', 0x03, 0x04}, 4},
+	{"GZIP", {0x1F, 0x8B, 0x08}, 3},
+	{"ELF", {0x7F, 'E', 'L', 'F'}, 4},
+	{"OLE", {0xD0, 0xCF, 0x11, 0xE0, 0xA1, 0xB1, 0x1A, 0xE1}, 8},
+	{"RAR", {'R', 'a', 'r', '!', 0x1A, 0x07}, 6},
+	{"7Z", {'7', 'z', 0xBC, 0xAF, 0x27, 0x1C}, 6},
+	{"RTF", {'{', '\\', 'r', 't', 'f'}, 5},
+};
+#define CARVE_SIGNATURES_COUNT (sizeof(CARVE_SIGNATURES) / sizeof(CARVE_SIGNATURES[0]))
+
+typedef struct DeletedEntry {
+	char* path;
+	FAT12DirectoryEntry entry;
+	uint32_t clusterCount;		// Clusters of the contiguous reconstruction
+	uint32_t freeClusterCount;	// Free clusters at the start of the reconstruction
+} DeletedEntry;
+
+typedef struct UndeleteWalk {
+	const uint8_t* fat;
+	FAT12Info* fat12Info;
+	const char* loopDevicePath;
+	uint32_t bytesPerCluster;
+	bool* isVisitedDirectory;  // Indexed by cluster id, stops loops in corrupted directory trees
+
+	DeletedEntry* entries;
+	uint32_t entriesCount;
+	uint32_t entriesCapacity;
+} UndeleteWalk;
+
+typedef struct CarveChunk {
+	uint16_t firstClusterId;
+	uint32_t clusterCount;
+} CarveChunk;
+
+typedef struct CarveContext {
+	CarveChunk* chunks;
+	uint32_t chunksCount;
+	uint32_t nextChunkIndex;  // Shared between workers, accessed atomically
+	uint32_t maxChunkClusters;
+	// Indexed by cluster id, 0 when no signature matched, otherwise the signature index + 1. Every
+	// worker writes the clusters of its own chunks only:
+	uint8_t* signatureAt;
+	FAT12Info* fat12Info;
+	const char* loopDevicePath;
+	uint32_t bytesPerCluster;
+} CarveContext;
+
+static bool isFreeCluster(const UndeleteWalk* walk, uint32_t clusterId) {
+	// Checked before the uint16_t conversion of isDataClusterId:
+	return clusterId < walk->fat12Info->clusterCount + 2 &&
+		   isDataClusterId(clusterId, walk->fat12Info) &&
+		   getNextClusterId(clusterId, walk->fat) == FREE_CLUSTER_ID;
+}
+
+static char* joinUndeletePath(const char* directoryPath, const FAT12DirectoryEntry* entry,
+							  bool isDeleted) {
+	char fatName[sizeof(entry->fileName)];
+	memcpy(fatName, entry->fileName, sizeof(fatName));
+	if (isDeleted) {
+		fatName[0] = '?';
+	}
+	char* name = fatFileNameToStr(fatName);
+	uint64_t directoryLength = strlen(directoryPath);
+	bool needsSeparator = directoryLength == 0 || directoryPath[directoryLength - 1] != '/';
+
+	char* path = xmalloc(directoryLength + needsSeparator + strlen(name) + 1);
+	memcpy(path, directoryPath, directoryLength);
+	if (needsSeparator) {
+		path[directoryLength] = '/';
+	}
+	strcpy(path + directoryLength + needsSeparator, name);
+	free(name);
+	return path;
+}
+
+/** Guesses the chain of a deleted entry as the clusters following its first cluster, and counts
+ * how many of them at the start of the guess are still free. */
+static DeletedEntry* addDeletedEntry(UndeleteWalk* walk, const FAT12DirectoryEntry* entry,
+									 char* path) {
+	if (walk->entriesCount == walk->entriesCapacity) {
+		walk->entriesCapacity = walk->entriesCapacity ? walk->entriesCapacity * 2 : 16;
+		walk->entries = xrealloc(walk->entries, walk->entriesCapacity * sizeof(DeletedEntry));
+	}
+
+	DeletedEntry* deleted = &walk->entries[walk->entriesCount];
+	walk->entriesCount++;
+	deleted->path = path;
+	memcpy(&deleted->entry, entry, sizeof(FAT12DirectoryEntry));
+	deleted->clusterCount = 1;
+	if (!isDirectoryEntryDirectory(entry)) {
+		deleted->clusterCount =
+			((uint64_t)entry->fileSizeInBytes + walk->bytesPerCluster - 1) / walk->bytesPerCluster;
+	}
+	deleted->freeClusterCount = 0;
+	if (isDataClusterId(entry->firstClusterId, walk->fat12Info)) {
+		while (deleted->freeClusterCount < deleted->clusterCount &&
+			   isFreeCluster(walk, (uint32_t)entry->firstClusterId + deleted->freeClusterCount)) {
+			deleted->freeClusterCount++;
+		}
+	}
+	return deleted;
+}
+
+static const char* getDeletedEntryStatus(const DeletedEntry* deleted, const FAT12Info* fat12Info) {
+	if (deleted->clusterCount == 0) {
+		return "empty";
+	}
+	if (!isDataClusterId(deleted->entry.firstClusterId, fat12Info)) {
+		return "lost";
+	}
+	if (deleted->freeClusterCount == deleted->clusterCount) {
+		return "recoverable";
+	}
+	return deleted->freeClusterCount ? "partial" : "overwritten";
+}
+
+/** Reads a directory cluster by cluster, following the fat when followFat is set and only reading
+ * the first cluster otherwise. Clusters already read as part of another directory end it. */
+static FAT12DirectoryEntry* readUndeleteDirectory(UndeleteWalk* walk, uint16_t firstClusterId,
+												  bool followFat, uint32_t* entriesCount) {
+	uint8_t* data = NULL;
+	uint32_t clusterCount = 0;
+	uint16_t clusterId = firstClusterId;
+	while (isDataClusterId(clusterId, walk->fat12Info) && !walk->isVisitedDirectory[clusterId]) {
+		walk->isVisitedDirectory[clusterId] = true;
+		data = xrealloc(data, (uint64_t)(clusterCount + 1) * walk->bytesPerCluster);
+		preadDevice(data + (uint64_t)clusterCount * walk->bytesPerCluster, walk->bytesPerCluster,
+					(int64_t)getClusterDeviceOffset(clusterId, walk->fat12Info),
+					walk->loopDevicePath);
+		clusterCount++;
+		if (!followFat) {
+			break;
+		}
+		clusterId = getNextClusterId(clusterId, walk->fat);
+	}
+
+	*entriesCount = (uint64_t)clusterCount * walk->bytesPerCluster / sizeof(FAT12DirectoryEntry);
+	return (FAT12DirectoryEntry*)data;
+}
+
+/** Checks that the first cluster of a deleted directory is free and was not reused for anything
+ * else, it has to start with the "." entry pointing back at it. */
+static bool isDeletedDirectoryIntact(const DeletedEntry* deleted, FAT12DirectoryEntry* entries,
+									 uint32_t entriesCount) {
+	return deleted->freeClusterCount == 1 && entriesCount > 0 && isDotDirectoryEntry(&entries[0]) &&
+		   entries[0].firstClusterId == deleted->entry.firstClusterId;
+}
+
+/** Collects the deleted entries of a directory and recurses into its sub directories. Inside a
+ * deleted directory every entry counts as deleted, even when its name was left intact. */
+static void walkUndeleteDirectory(UndeleteWalk* walk, FAT12DirectoryEntry* entries,
+								  uint32_t entriesCount, const char* directoryPath,
+								  bool isInDeletedDirectory) {
+	for (uint32_t i = 0; i < entriesCount; i++) {
+		FAT12DirectoryEntry* entry = &entries[i];
+		if (isFinalDirectoryEntry(entry)) {
+			break;
+		}
+		// Long file name entries carry the volume label bit as well:
+		if (isVolumeLabelEntry(entry) || isDotDirectoryEntry(entry)) {
+			continue;
+		}
+
+		bool isDeleted = isInDeletedDirectory || isDeletedEntry(entry);
+		char* path = joinUndeletePath(directoryPath, entry, isDeletedEntry(entry));
+		if (!isDeleted) {
+			if (isDirectoryEntryDirectory(entry)) {
+				uint32_t subEntriesCount;
+				FAT12DirectoryEntry* subEntries =
+					readUndeleteDirectory(walk, entry->firstClusterId, true, &subEntriesCount);
+				walkUndeleteDirectory(walk, subEntries, subEntriesCount, path, false);
+				free(subEntries);
+			}
+			free(path);
+			continue;
+		}
+
+		DeletedEntry* deleted = addDeletedEntry(walk, entry, path);
+		if (isDirectoryEntryDirectory(entry) && deleted->freeClusterCount == 1) {
+			uint32_t subEntriesCount;
+			FAT12DirectoryEntry* subEntries =
+				readUndeleteDirectory(walk, entry->firstClusterId, false, &subEntriesCount);
+			// Checked before recursing, deleted moves once the walk below grows the entries array:
+			if (isDeletedDirectoryIntact(deleted, subEntries, subEntriesCount)) {
+				walkUndeleteDirectory(walk, subEntries, subEntriesCount, path, true);
+			}
+			free(subEntries);
+		}
+	}
+}
+
+static void initUndeleteWalk(UndeleteWalk* walk, FAT12Info* fat12Info,
+							 const char* loopDevicePath) {
+	memset(walk, 0, sizeof(UndeleteWalk));
+	walk->fat = getFat(fat12Info, loopDevicePath);
+	walk->fat12Info = fat12Info;
+	walk->loopDevicePath = loopDevicePath;
+	walk->bytesPerCluster = fat12Info->bytesPerSector * fat12Info->sectorsPerCluster;
+	walk->isVisitedDirectory = calloc(fat12Info->clusterCount + 2, sizeof(bool));
+	if (!walk->isVisitedDirectory) {
+		perror("");
+		exit(-1);
+	}
+}
+
+/** Walks the tree below entry, NULL for the root directory, collecting every deleted entry. */
+static void collectDeletedEntries(UndeleteWalk* walk, FAT12DirectoryEntry* entry,
+								  const char* path) {
+	FAT12DirectoryEntry* entries;
+	uint32_t entriesCount;
+	if (entry) {
+		entries = readUndeleteDirectory(walk, entry->firstClusterId, true, &entriesCount);
+	} else {
+		// The root directory is read raw, getRootDirectoryEntries drops deleted entries:
+		const uint32_t ROOT_DIR_BYTES =
+			walk->fat12Info->rootDirSectorsSize * walk->fat12Info->bytesPerSector;
+		entries = xmalloc(ROOT_DIR_BYTES);
+		preadDevice((uint8_t*)entries, ROOT_DIR_BYTES,
+					(int64_t)walk->fat12Info->rootDirSectorOffset * walk->fat12Info->bytesPerSector,
+					walk->loopDevicePath);
+		entriesCount = ROOT_DIR_BYTES / sizeof(FAT12DirectoryEntry);
+	}
+
+	walkUndeleteDirectory(walk, entries, entriesCount, path, false);
+	free(entries);
+}
+
+static void freeUndeleteWalk(UndeleteWalk* walk) {
+	for (uint32_t i = 0; i < walk->entriesCount; i++) {
+		free(walk->entries[i].path);
+	}
+	free(walk->entries);
+	free(walk->isVisitedDirectory);
+	free((void*)walk->fat);
+}
+
+uint64_t listDeletedEntries(FAT12DirectoryEntry* entry, const char* path, FAT12Info* fat12Info,
+							const char* loopDevicePath) {
+	UndeleteWalk walk;
+	initUndeleteWalk(&walk, fat12Info, loopDevicePath);
+	collectDeletedEntries(&walk, entry, path);
+
+	for (uint32_t i = 0; i < walk.entriesCount; i++) {
+		const DeletedEntry* deleted = &walk.entries[i];
+		printf("%s %s %u bytes", getDeletedEntryStatus(deleted, fat12Info), deleted->path,
+			   deleted->entry.fileSizeInBytes);
+		if (deleted->clusterCount && isDataClusterId(deleted->entry.firstClusterId, fat12Info)) {
+			printf(", clusters %u-%u (%u/%u free)", deleted->entry.firstClusterId,
+				   deleted->entry.firstClusterId + deleted->clusterCount - 1,
+				   deleted->freeClusterCount, deleted->clusterCount);
+		}
+		printf("\n");
+	}
+
+	uint64_t deletedCount = walk.entriesCount;
+	freeUndeleteWalk(&walk);
+	return deletedCount;
+}
+
+/** @return The index of the signature clusterData starts with + 1, 0 when there is none. */
+static uint8_t matchCarveSignature(const uint8_t* clusterData) {
+#ifdef __SSE2__
+	// A single compare of the first 16 bytes against each signature, only the signature length
+	// bytes of the resulting mask have to match:
+	const __m128i block = _mm_loadu_si128((const __m128i*)clusterData);
+	for (uint32_t i = 0; i < CARVE_SIGNATURES_COUNT; i++) {
+		const __m128i signature = _mm_loadu_si128((const __m128i*)CARVE_SIGNATURES[i].bytes);
+		uint32_t requiredMask = (1u << CARVE_SIGNATURES[i].length) - 1;
+		uint32_t mask = _mm_movemask_epi8(_mm_cmpeq_epi8(block, signature));
+		if ((mask & requiredMask) == requiredMask) {
+			return i + 1;
+		}
+	}
+#else
+	for (uint32_t i = 0; i < CARVE_SIGNATURES_COUNT; i++) {
+		if (memcmp(clusterData, CARVE_SIGNATURES[i].bytes, CARVE_SIGNATURES[i].length) == 0) {
+			return i + 1;
+		}
+	}
+#endif
+	return 0;
+}
+
+static void* carveWorker(void* arg) {
+	CarveContext* context = arg;
+	uint8_t* buffer = xmalloc((uint64_t)context->maxChunkClusters * context->bytesPerCluster);
+
+	while (true) {
+		uint32_t chunkIndex = __atomic_fetch_add(&context->nextChunkIndex, 1, __ATOMIC_RELAXED);
+		if (chunkIndex >= context->chunksCount) {
+			break;
+		}
+		const CarveChunk* chunk = &context->chunks[chunkIndex];
+		preadDevice(buffer, (uint64_t)chunk->clusterCount * context->bytesPerCluster,
+					(int64_t)getClusterDeviceOffset(chunk->firstClusterId, context->fat12Info),
+					context->loopDevicePath);
+		for (uint32_t i = 0; i < chunk->clusterCount; i++) {
+			context->signatureAt[chunk->firstClusterId + i] =
+				matchCarveSignature(buffer + (uint64_t)i * context->bytesPerCluster);
+		}
+	}
+
+	free(buffer);
+	return NULL;
+}
+
+/** Splits the runs of contiguous free clusters into chunks of at most maxChunkClusters. */
+static uint32_t buildCarveChunks(const UndeleteWalk* walk, CarveChunk** chunks,
+								 uint32_t maxChunkClusters, uint32_t* freeClusterCount) {
+	const uint32_t END = walk->fat12Info->clusterCount + 2;
+	uint32_t chunksCount = 0;
+	uint32_t capacity = 0;
+	*chunks = NULL;
+	*freeClusterCount = 0;
+	uint32_t clusterId = 2;
+	while (clusterId < END) {
+		if (!isFreeCluster(walk, clusterId)) {
+			clusterId++;
+			continue;
+		}
+
+		uint32_t clusterCount = 0;
+		while (clusterId + clusterCount < END && clusterCount < maxChunkClusters &&
+			   isFreeCluster(walk, clusterId + clusterCount)) {
+			clusterCount++;
+		}
+		if (chunksCount == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			*chunks = xrealloc(*chunks, capacity * sizeof(CarveChunk));
+		}
+		(*chunks)[chunksCount].firstClusterId = clusterId;
+		(*chunks)[chunksCount].clusterCount = clusterCount;
+		chunksCount++;
+		*freeClusterCount += clusterCount;
+		clusterId += clusterCount;
+	}
+	return chunksCount;
+}
+
+static uint32_t getCarveWorkerCount(uint32_t chunksCount) {
+	long onlineCpus = sysconf(_SC_NPROCESSORS_ONLN);
+	uint32_t workerCount = onlineCpus > 0 ? (uint32_t)onlineCpus : 1;
+	if (workerCount > CARVE_MAX_WORKERS) {
+		workerCount = CARVE_MAX_WORKERS;
+	}
+	if (workerCount > chunksCount) {
+		workerCount = chunksCount;
+	}
+	return workerCount;
+}
+
+uint64_t carveFreeClusters(FAT12Info* fat12Info, const char* loopDevicePath) {
+	UndeleteWalk walk;
+	initUndeleteWalk(&walk, fat12Info, loopDevicePath);
+	collectDeletedEntries(&walk, NULL, "/");
+	const uint32_t END = fat12Info->clusterCount + 2;
+
+	CarveContext context = {
+		.nextChunkIndex = 0,
+		.fat12Info = fat12Info,
+		.loopDevicePath = loopDevicePath,
+		.bytesPerCluster = walk.bytesPerCluster,
+	};
+	context.maxChunkClusters = CARVE_READ_BYTES / walk.bytesPerCluster;
+	if (context.maxChunkClusters == 0) {
+		context.maxChunkClusters = 1;
+	}
+	uint32_t freeClusterCount;
+	context.chunksCount =
+		buildCarveChunks(&walk, &context.chunks, context.maxChunkClusters, &freeClusterCount);
+	context.signatureAt = calloc(END, sizeof(uint8_t));
+	if (!context.signatureAt) {
+		perror("");
+		exit(-1);
+	}
+
+	uint32_t workerCount = getCarveWorkerCount(context.chunksCount);
+	pthread_t workers[CARVE_MAX_WORKERS];
+	for (uint32_t i = 0; i < workerCount; i++) {
+		if (pthread_create(&workers[i], NULL, carveWorker, &context) != 0) {
+			perror("Failed to create carve worker");
+			exit(-1);
+		}
+	}
+	for (uint32_t i = 0; i < workerCount; i++) {
+		pthread_join(workers[i], NULL);
+	}
+
+	// Deleted files whose first cluster is still free name the hits starting at that cluster:
+	const DeletedEntry** deletedAt = calloc(END, sizeof(DeletedEntry*));
+	if (!deletedAt) {
+		perror("");
+		exit(-1);
+	}
+	for (uint32_t i = 0; i < walk.entriesCount; i++) {
+		const DeletedEntry* deleted = &walk.entries[i];
+		uint16_t firstClusterId = deleted->entry.firstClusterId;
+		if (!isDirectoryEntryDirectory(&deleted->entry) && deleted->freeClusterCount &&
+			!deletedAt[firstClusterId]) {
+			deletedAt[firstClusterId] = deleted;
+		}
+	}
+
+	// Printing after all workers finished keeps the output in cluster order:
+	uint64_t hitCount = 0;
+	for (uint32_t clusterId = 2; clusterId < END; clusterId++) {
+		if (!context.signatureAt[clusterId]) {
+			continue;
+		}
+		const CarveSignature* signature = &CARVE_SIGNATURES[context.signatureAt[clusterId] - 1];
+		const DeletedEntry* deleted = deletedAt[clusterId];
+		if (deleted) {
+			printf("cluster %u %s %u bytes %s\n", clusterId, signature->type,
+				   deleted->entry.fileSizeInBytes, deleted->path);
+		} else {
+			uint32_t runEnd = clusterId + 1;
+			while (runEnd < END && isFreeCluster(&walk, runEnd) && !context.signatureAt[runEnd]) {
+				runEnd++;
+			}
+			printf("cluster %u %s %lu bytes\n", clusterId, signature->type,
+				   (uint64_t)(runEnd - clusterId) * walk.bytesPerCluster);
+		}
+		hitCount++;
+	}
+	(void)fprintf(stderr, "Scanned %u free clusters (%lu bytes) with %u workers, %lu found\n",
+				  freeClusterCount, (uint64_t)freeClusterCount * walk.bytesPerCluster, workerCount,
+				  hitCount);
+
+	free((void*)deletedAt);
+	free(context.signatureAt);
+	free(context.chunks);
+	freeUndeleteWalk(&walk);
+	return hitCount;
+}
@@ -0,0 +1,49 @@
+#pragma once
+#include <stdint.h>
+
+#include "fat12.h"
+
+/** Upper bound of the contiguous free cluster bytes a carve worker reads at once */
+#define CARVE_READ_BYTES (1024 * 1024)
+#define CARVE_MAX_WORKERS 64
+// Signatures are matched against the first bytes of a cluster with a single 16 byte compare:
+#define CARVE_SIGNATURE_BYTES 16
+
+/**
+ * @brief Prints every deleted entry below the directory entry, one per line as
+ * "<status> <path> <size> bytes, clusters <first>-<last> (<free>/<count> free)". The first
+ * character of a deleted name is lost, it is printed as '?'.
+ *
+ * The cluster chain of a deleted entry is freed, so it is reconstructed assuming the file was
+ * stored contiguously from its first cluster, as put allocates it. The status tells how much of
+ * that guess is still free: recoverable (all of it), partial (a prefix of it), overwritten (its
+ * first cluster is allocated again), lost (no valid first cluster) or empty (nothing was stored).
+ * Deleted directories are assumed to fit in their first cluster and are listed recursively while
+ * that cluster is free and still starts with the "." entry.
+ *
+ * @param[in] entry Directory entry of the directory to search, NULL for the root directory.
+ * @param[in] path Path of entry, used as the prefix of the printed paths.
+ * @param[in] fat12Info
+ * @param[in] loopDevicePath
+ *
+ * @return Number of deleted entries found.
+ */
+uint64_t listDeletedEntries(FAT12DirectoryEntry* entry, const char* path, FAT12Info* fat12Info,
+							const char* loopDevicePath);
+
+/**
+ * @brief Scans every free cluster for the signatures of known file types and prints each hit as
+ * "cluster <id> <type> <bytes> bytes", followed by the path of the deleted entry that started at
+ * that cluster when there is one. The byte count is the size of the deleted entry, or otherwise the
+ * run of free clusters up to the next allocated cluster or signature hit.
+ *
+ * Free clusters are found from the fat and read in a single ascending pass, runs of contiguous
+ * free clusters are read in chunks of up to CARVE_READ_BYTES spread across worker threads. FAT
+ * stores files from the start of a cluster, so only the first bytes of each cluster are compared.
+ *
+ * @param[in] fat12Info
+ * @param[in] loopDevicePath
+ *
+ * @return Number of signatures found.
+ */
+uint64_t carveFreeClusters(FAT12Info* fat12Info, const char* loopDevicePath);
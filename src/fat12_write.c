@@ -0,0 +1,789 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "allocwrap.h"
+#include "device_compressed.h"
+#include "fat12.h"
+#include "fat12_string.h"
+#include "fat12_write.h"
+
+// Host file bytes copied into the filesystem per write:
+#define PUT_BUFFER_CLUSTERS 64
+// Long file name entries are marked by this attribute combination and precede their 8.3 entry:
+#define LONG_NAME_ATTRIBUTES 0x0F
+#define LONG_NAME_LAST_ORDER_FLAG 0x40
+
+/** A directory loaded for modification, entries keep the on disk layout including free slots. */
+typedef struct FAT12Directory {
+	bool isRoot;
+	uint16_t firstClusterId;
+	uint16_t lastClusterId;
+	FAT12DirectoryEntry* entries;
+	uint32_t entriesCount;
+	uint64_t* sectorOffsets;  // Device byte offset of every sector of the directory
+	uint32_t sectorsCount;
+} FAT12Directory;
+
+void setFat12VolumeEntry(FAT12Volume* volume, uint16_t clusterId, uint16_t nextClusterId) {
+	uint32_t offset = clusterId + (clusterId / 2);
+	setNextClusterId(clusterId, nextClusterId, volume->fat);
+	volume->dirtyFatSectors[offset / volume->fat12Info.bytesPerSector] = true;
+	volume->dirtyFatSectors[(offset + 1) / volume->fat12Info.bytesPerSector] = true;
+}
+
+static void buildFreeExtentIndex(FAT12Volume* volume) {
+	const uint32_t LAST_CLUSTER_ID = volume->fat12Info.clusterCount + 1;
+
+	free(volume->freeExtents);
+	volume->freeExtents = NULL;
+	volume->freeExtentsCount = 0;
+	uint32_t capacity = 0;
+	for (uint32_t clusterId = 2; clusterId <= LAST_CLUSTER_ID; clusterId++) {
+		if (getNextClusterId(clusterId, volume->fat) != FAT_FREE_CLUSTER) {
+			continue;
+		}
+
+		FAT12Extent* last = volume->freeExtentsCount
+								? &volume->freeExtents[volume->freeExtentsCount - 1]
+								: NULL;
+		if (last && last->firstClusterId + last->clusterCount == clusterId) {
+			last->clusterCount++;
+			continue;
+		}
+		if (volume->freeExtentsCount == capacity) {
+			capacity = capacity ? capacity * 2 : 16;
+			volume->freeExtents = xrealloc(volume->freeExtents, capacity * sizeof(FAT12Extent));
+		}
+		volume->freeExtents[volume->freeExtentsCount].firstClusterId = clusterId;
+		volume->freeExtents[volume->freeExtentsCount].clusterCount = 1;
+		volume->freeExtentsCount++;
+	}
+}
+
+int openFat12Volume(FAT12Volume* volume, const char* loopDevicePath) {
+	memset(volume, 0, sizeof(FAT12Volume));
+	volume->loopDevicePath = loopDevicePath;
+	if (isCompressedDevicePath(loopDevicePath)) {
+		(void)fprintf(stderr, "Compressed images are read only: %s\n", loopDevicePath);
+		return -1;
+	}
+	volume->fileDescriptor = open(loopDevicePath, O_RDWR | O_CLOEXEC);
+	if (volume->fileDescriptor == -1) {
+		perror("Error opening loop device file for writing");
+		return -1;
+	}
+
+	loadFat12Header(&volume->fat12Header, loopDevicePath);
+	const char* headerError =
+		getFat12HeaderError(&volume->fat12Header, getDeviceBytes(loopDevicePath));
+	if (headerError) {
+		(void)fprintf(stderr, "Invalid FAT12 filesystem: %s\n", headerError);
+		close(volume->fileDescriptor);
+		return -1;
+	}
+	loadFat12Info(&volume->fat12Info, &volume->fat12Header);
+	volume->bytesPerCluster =
+		volume->fat12Info.bytesPerSector * volume->fat12Info.sectorsPerCluster;
+
+	volume->fat = getFat(&volume->fat12Info, loopDevicePath);
+	volume->dirtyFatSectors = calloc(volume->fat12Info.fatSectorSize, sizeof(bool));
+	if (!volume->dirtyFatSectors) {
+		perror("");
+		exit(-1);
+	}
+	buildFreeExtentIndex(volume);
+	return 0;
+}
+
+void closeFat12Volume(FAT12Volume* volume) {
+	for (uint32_t i = 0; i < volume->directoryWritesCount; i++) {
+		free(volume->directoryWrites[i].data);
+	}
+	free(volume->directoryWrites);
+	free(volume->pendingFreeChains);
+	free(volume->pendingFreeClusters);
+	free(volume->freeExtents);
+	free(volume->dirtyFatSectors);
+	free(volume->fat);
+	close(volume->fileDescriptor);
+	memset(volume, 0, sizeof(FAT12Volume));
+}
+
+static void takeFromExtent(FAT12Volume* volume, uint32_t extentIndex, uint32_t clusterCount,
+						   uint16_t* clusterIds) {
+	FAT12Extent* extent = &volume->freeExtents[extentIndex];
+	for (uint32_t i = 0; i < clusterCount; i++) {
+		clusterIds[i] = extent->firstClusterId + i;
+	}
+	extent->firstClusterId += clusterCount;
+	extent->clusterCount -= clusterCount;
+
+	if (extent->clusterCount == 0) {
+		memmove(extent, extent + 1,
+				(volume->freeExtentsCount - extentIndex - 1) * sizeof(FAT12Extent));
+		volume->freeExtentsCount--;
+	}
+}
+
+bool allocateFat12Clusters(FAT12Volume* volume, uint32_t clusterCount, uint16_t* clusterIds) {
+	uint64_t freeClusters = 0;
+	int64_t bestFitIndex = -1;
+	for (uint32_t i = 0; i < volume->freeExtentsCount; i++) {
+		uint32_t extentCount = volume->freeExtents[i].clusterCount;
+		freeClusters += extentCount;
+		if (extentCount >= clusterCount &&
+			(bestFitIndex == -1 || extentCount < volume->freeExtents[bestFitIndex].clusterCount)) {
+			bestFitIndex = i;
+		}
+	}
+	if (freeClusters < clusterCount) {
+		return false;
+	}
+
+	if (bestFitIndex != -1) {
+		takeFromExtent(volume, bestFitIndex, clusterCount, clusterIds);
+	} else {
+		// No single extent fits, the largest extents keep the amount of fragments lowest:
+		uint32_t allocated = 0;
+		while (allocated < clusterCount) {
+			uint32_t largestIndex = 0;
+			for (uint32_t i = 1; i < volume->freeExtentsCount; i++) {
+				if (volume->freeExtents[i].clusterCount >
+					volume->freeExtents[largestIndex].clusterCount) {
+					largestIndex = i;
+				}
+			}
+			uint32_t takeCount = volume->freeExtents[largestIndex].clusterCount;
+			if (takeCount > clusterCount - allocated) {
+				takeCount = clusterCount - allocated;
+			}
+			takeFromExtent(volume, largestIndex, takeCount, clusterIds + allocated);
+			allocated += takeCount;
+		}
+	}
+
+	for (uint32_t i = 0; i + 1 < clusterCount; i++) {
+		setFat12VolumeEntry(volume, clusterIds[i], clusterIds[i + 1]);
+	}
+	setFat12VolumeEntry(volume, clusterIds[clusterCount - 1], FAT_LAST_CLUSTER_NUM);
+	return true;
+}
+
+static void writeClusters(FAT12Volume* volume, const uint16_t* clusterIds, uint32_t clusterCount,
+						  const uint8_t* data) {
+	// Clusters that follow each other on the device are written with a single pwrite:
+	uint32_t runStart = 0;
+	for (uint32_t i = 1; i <= clusterCount; i++) {
+		if (i < clusterCount && clusterIds[i] == clusterIds[i - 1] + 1) {
+			continue;
+		}
+		pwriteDevice(data + (uint64_t)runStart * volume->bytesPerCluster,
+					 (uint64_t)(i - runStart) * volume->bytesPerCluster,
+					 (int64_t)getClusterDeviceOffset(clusterIds[runStart], &volume->fat12Info),
+					 volume->fileDescriptor);
+		runStart = i;
+	}
+}
+
+static void loadRootDirectory(FAT12Volume* volume, FAT12Directory* directory) {
+	const FAT12Info* info = &volume->fat12Info;
+	uint64_t directoryBytes = (uint64_t)info->rootDirSectorsSize * info->bytesPerSector;
+
+	memset(directory, 0, sizeof(FAT12Directory));
+	directory->isRoot = true;
+	directory->entries = xmalloc(directoryBytes);
+	directory->entriesCount = directoryBytes / sizeof(FAT12DirectoryEntry);
+	directory->sectorsCount = info->rootDirSectorsSize;
+	directory->sectorOffsets = xmalloc(directory->sectorsCount * sizeof(uint64_t));
+	for (uint32_t i = 0; i < directory->sectorsCount; i++) {
+		directory->sectorOffsets[i] =
+			(uint64_t)(info->rootDirSectorOffset + i) * info->bytesPerSector;
+	}
+	preadDevice((uint8_t*)directory->entries, directoryBytes, (int64_t)directory->sectorOffsets[0],
+				volume->loopDevicePath);
+}
+
+/** @return false when the cluster chain of the directory is corrupted. */
+static bool loadSubDirectory(FAT12Volume* volume, uint16_t firstClusterId,
+							 FAT12Directory* directory) {
+	const FAT12Info* info = &volume->fat12Info;
+
+	memset(directory, 0, sizeof(FAT12Directory));
+	directory->firstClusterId = firstClusterId;
+	uint32_t clusterCount = 0;
+	uint16_t clusterId = firstClusterId;
+	while (isDataClusterId(clusterId, info) && clusterCount < info->clusterCount) {
+		directory->entries =
+			xrealloc(directory->entries, (uint64_t)(clusterCount + 1) * volume->bytesPerCluster);
+		directory->sectorOffsets =
+			xrealloc(directory->sectorOffsets,
+					 (uint64_t)(clusterCount + 1) * info->sectorsPerCluster * sizeof(uint64_t));
+
+		uint64_t clusterOffset = getClusterDeviceOffset(clusterId, info);
+		for (uint32_t i = 0; i < info->sectorsPerCluster; i++) {
+			directory->sectorOffsets[directory->sectorsCount] =
+				clusterOffset + (uint64_t)i * info->bytesPerSector;
+			directory->sectorsCount++;
+		}
+		preadDevice((uint8_t*)directory->entries + (uint64_t)clusterCount * volume->bytesPerCluster,
+					volume->bytesPerCluster, (int64_t)clusterOffset, volume->loopDevicePath);
+
+		clusterCount++;
+		directory->lastClusterId = clusterId;
+		clusterId = getNextClusterId(clusterId, volume->fat);
+	}
+
+	directory->entriesCount =
+		(uint64_t)clusterCount * volume->bytesPerCluster / sizeof(FAT12DirectoryEntry);
+	return clusterCount > 0 && clusterId == FAT_LAST_CLUSTER_NUM;
+}
+
+static void freeDirectory(FAT12Directory* directory) {
+	free(directory->entries);
+	free(directory->sectorOffsets);
+}
+
+/** @return Index of the entry called fatName or -1 when there is none. */
+static int64_t findDirectoryEntry(FAT12Directory* directory, const char* fatName) {
+	for (uint32_t i = 0; i < directory->entriesCount; i++) {
+		FAT12DirectoryEntry* entry = &directory->entries[i];
+		if (isFinalDirectoryEntry(entry)) {
+			break;
+		}
+		if (isDeletedEntry(entry) || isVolumeLabelEntry(entry)) {
+			continue;
+		}
+		if (memcmp(entry->fileName, fatName, sizeof(entry->fileName)) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+/** Loads the directory at path, prints the reason and returns false when it can not be found. */
+static bool resolveDirectory(FAT12Volume* volume, const char* path, FAT12Directory* directory) {
+	loadRootDirectory(volume, directory);
+
+	char* pathCopy = strdup(path);
+	char* savePtr;
+	for (char* token = strtok_r(pathCopy, "/", &savePtr); token;
+		 token = strtok_r(NULL, "/", &savePtr)) {
+		char fatName[11];
+		int64_t entryIndex = -1;
+		if (strToFatFileName(fatName, token)) {
+			entryIndex = findDirectoryEntry(directory, fatName);
+		}
+		if (entryIndex == -1 || !isDirectoryEntryDirectory(&directory->entries[entryIndex])) {
+			(void)fprintf(stderr, "Directory does not exist: %s\n", path);
+			free(pathCopy);
+			freeDirectory(directory);
+			return false;
+		}
+
+		uint16_t firstClusterId = directory->entries[entryIndex].firstClusterId;
+		freeDirectory(directory);
+		if (!loadSubDirectory(volume, firstClusterId, directory)) {
+			(void)fprintf(stderr, "Directory cluster chain is corrupted: %s\n", path);
+			free(pathCopy);
+			freeDirectory(directory);
+			return false;
+		}
+	}
+
+	free(pathCopy);
+	return true;
+}
+
+/** Splits path into its parent directory path and the fat formatted name of its last component.
+ * @param[out] parentPath Allocated parent path, the caller frees it.
+ */
+static bool splitEntryPath(const char* path, char** parentPath, char* fatName) {
+	char* pathCopy = strdup(path);
+	uint64_t length = strlen(pathCopy);
+	while (length > 1 && pathCopy[length - 1] == '/') {
+		pathCopy[--length] = '\0';
+	}
+
+	char* lastSeparator = strrchr(pathCopy, '/');
+	if (pathCopy[0] != '/' || !lastSeparator || !strToFatFileName(fatName, lastSeparator + 1)) {
+		(void)fprintf(stderr, "Invalid FAT12 path: %s\n", path);
+		free(pathCopy);
+		return false;
+	}
+
+	lastSeparator[1] = '\0';
+	*parentPath = pathCopy;
+	return true;
+}
+
+/** Gets the pending write of the sector at offset, adding one when the sector has none yet.
+ * @param[out] isNew Set when the returned write was just added and its data is uninitialized.
+ */
+static FAT12PendingWrite* getPendingDirectoryWrite(FAT12Volume* volume, uint64_t offset,
+												   bool* isNew) {
+	for (uint32_t i = 0; i < volume->directoryWritesCount; i++) {
+		if (volume->directoryWrites[i].offset == offset) {
+			*isNew = false;
+			return &volume->directoryWrites[i];
+		}
+	}
+
+	if (volume->directoryWritesCount == volume->directoryWritesCapacity) {
+		volume->directoryWritesCapacity =
+			volume->directoryWritesCapacity ? volume->directoryWritesCapacity * 2 : 8;
+		volume->directoryWrites = xrealloc(
+			volume->directoryWrites, volume->directoryWritesCapacity * sizeof(FAT12PendingWrite));
+	}
+	FAT12PendingWrite* write = &volume->directoryWrites[volume->directoryWritesCount];
+	write->offset = offset;
+	write->bytes = volume->fat12Info.bytesPerSector;
+	write->data = xmalloc(write->bytes);
+	volume->directoryWritesCount++;
+	*isNew = true;
+	return write;
+}
+
+/** Queues the sector holding entryIndex for the write back, replacing an older copy of it. */
+static void queueDirectorySector(FAT12Volume* volume, FAT12Directory* directory,
+								 uint32_t entryIndex) {
+	const uint32_t BYTES_PER_SECTOR = volume->fat12Info.bytesPerSector;
+	uint32_t sectorIndex = (uint64_t)entryIndex * sizeof(FAT12DirectoryEntry) / BYTES_PER_SECTOR;
+	const uint8_t* sectorData =
+		(uint8_t*)directory->entries + (uint64_t)sectorIndex * BYTES_PER_SECTOR;
+
+	bool isNew;
+	FAT12PendingWrite* write =
+		getPendingDirectoryWrite(volume, directory->sectorOffsets[sectorIndex], &isNew);
+	memcpy(write->data, sectorData, BYTES_PER_SECTOR);
+}
+
+void setFat12EntryFirstCluster(FAT12Volume* volume, uint64_t entryOffset, uint16_t firstClusterId) {
+	const uint32_t BYTES_PER_SECTOR = volume->fat12Info.bytesPerSector;
+	uint64_t sectorOffset = entryOffset - entryOffset % BYTES_PER_SECTOR;
+
+	bool isNew;
+	FAT12PendingWrite* write = getPendingDirectoryWrite(volume, sectorOffset, &isNew);
+	if (isNew) {
+		preadDevice(write->data, BYTES_PER_SECTOR, (int64_t)sectorOffset, volume->loopDevicePath);
+	}
+	FAT12DirectoryEntry* entry =
+		(FAT12DirectoryEntry*)(write->data + entryOffset % BYTES_PER_SECTOR);
+	entry->firstClusterId = firstClusterId;
+}
+
+/** Grows a sub directory by one zeroed cluster.
+ * @return false when the filesystem is full.
+ */
+static bool extendDirectory(FAT12Volume* volume, FAT12Directory* directory) {
+	const FAT12Info* info = &volume->fat12Info;
+	uint16_t clusterId;
+	if (!allocateFat12Clusters(volume, 1, &clusterId)) {
+		return false;
+	}
+
+	uint8_t* zeroCluster = calloc(1, volume->bytesPerCluster);
+	if (!zeroCluster) {
+		perror("");
+		exit(-1);
+	}
+	writeClusters(volume, &clusterId, 1, zeroCluster);
+	free(zeroCluster);
+	setFat12VolumeEntry(volume, directory->lastClusterId, clusterId);
+
+	uint32_t clusterCount = directory->sectorsCount / info->sectorsPerCluster;
+	directory->entries =
+		xrealloc(directory->entries, (uint64_t)(clusterCount + 1) * volume->bytesPerCluster);
+	memset((uint8_t*)directory->entries + (uint64_t)clusterCount * volume->bytesPerCluster, 0,
+		   volume->bytesPerCluster);
+	directory->sectorOffsets =
+		xrealloc(directory->sectorOffsets,
+				 (uint64_t)(clusterCount + 1) * info->sectorsPerCluster * sizeof(uint64_t));
+	uint64_t clusterOffset = getClusterDeviceOffset(clusterId, info);
+	for (uint32_t i = 0; i < info->sectorsPerCluster; i++) {
+		directory->sectorOffsets[directory->sectorsCount] =
+			clusterOffset + (uint64_t)i * info->bytesPerSector;
+		directory->sectorsCount++;
+	}
+	directory->entriesCount += volume->bytesPerCluster / sizeof(FAT12DirectoryEntry);
+	directory->lastClusterId = clusterId;
+	return true;
+}
+
+/** Finds a deleted or unused slot for a new entry, growing sub directories when they are full.
+ * @return Index of the slot or -1 when there is no room.
+ */
+static int64_t findFreeDirectorySlot(FAT12Volume* volume, FAT12Directory* directory) {
+	for (uint32_t i = 0; i < directory->entriesCount; i++) {
+		FAT12DirectoryEntry* entry = &directory->entries[i];
+		if (isDeletedEntry(entry)) {
+			return i;
+		}
+		if (isFinalDirectoryEntry(entry)) {
+			// The slot after the new entry has to end the directory:
+			if (i + 1 < directory->entriesCount && !isFinalDirectoryEntry(entry + 1)) {
+				(entry + 1)->fileName[0] = FINAL_ENTRY;
+				queueDirectorySector(volume, directory, i + 1);
+			}
+			return i;
+		}
+	}
+
+	if (directory->isRoot) {
+		return -1;
+	}
+	uint32_t slotIndex = directory->entriesCount;
+	if (!extendDirectory(volume, directory)) {
+		return -1;
+	}
+	return slotIndex;
+}
+
+static void initNewEntry(FAT12DirectoryEntry* entry, const char* fatName, uint8_t attributes,
+						 uint16_t firstClusterId, uint32_t fileSize) {
+	time_t now = time(NULL);
+	struct tm localNow;
+	localtime_r(&now, &localNow);
+	uint32_t year = localNow.tm_year + 1900;
+	if (year < FAT_YEAR_BASE) {
+		year = FAT_YEAR_BASE;
+	}
+	uint32_t dateTime = encodeFatDateTime(year, localNow.tm_mon + 1, localNow.tm_mday,
+										  localNow.tm_hour, localNow.tm_min, localNow.tm_sec);
+
+	memset(entry, 0, sizeof(FAT12DirectoryEntry));
+	memcpy(entry->fileName, fatName, sizeof(entry->fileName));
+	entry->attributes = attributes;
+	entry->creationTimeCentiseconds = (localNow.tm_sec % 2) * 100;
+	entry->creationTime = dateTime & 0xFFFF;
+	entry->creationDate = dateTime >> 16;
+	entry->lastAccessDate = entry->creationDate;
+	entry->lastModifyTime = entry->creationTime;
+	entry->lastModifyDate = entry->creationDate;
+	entry->firstClusterId = firstClusterId;
+	entry->fileSizeInBytes = fileSize;
+}
+
+/** Prepares the parent directory of path for a new entry.
+ * @param[out] slotIndex Index of the slot the entry goes to.
+ */
+static bool prepareNewEntry(FAT12Volume* volume, const char* path, FAT12Directory* parent,
+							char* fatName, int64_t* slotIndex) {
+	char* parentPath;
+	if (!splitEntryPath(path, &parentPath, fatName)) {
+		return false;
+	}
+	bool isResolved = resolveDirectory(volume, parentPath, parent);
+	free(parentPath);
+	if (!isResolved) {
+		return false;
+	}
+
+	if (findDirectoryEntry(parent, fatName) != -1) {
+		(void)fprintf(stderr, "Path already exists: %s\n", path);
+		freeDirectory(parent);
+		return false;
+	}
+	*slotIndex = findFreeDirectorySlot(volume, parent);
+	if (*slotIndex == -1) {
+		(void)fprintf(stderr, "No room for a new entry in the parent directory of %s\n", path);
+		freeDirectory(parent);
+		return false;
+	}
+	return true;
+}
+
+/** Streams a host file into already allocated clusters, cluster runs are written at once. */
+static bool copyHostFile(FAT12Volume* volume, int hostFileDescriptor, const uint16_t* clusterIds,
+						 uint32_t clusterCount) {
+	uint8_t* buffer = xmalloc((uint64_t)PUT_BUFFER_CLUSTERS * volume->bytesPerCluster);
+
+	for (uint32_t written = 0; written < clusterCount;) {
+		uint32_t batchCount = clusterCount - written;
+		if (batchCount > PUT_BUFFER_CLUSTERS) {
+			batchCount = PUT_BUFFER_CLUSTERS;
+		}
+		uint64_t batchBytes = (uint64_t)batchCount * volume->bytesPerCluster;
+
+		uint64_t filled = 0;
+		while (filled < batchBytes) {
+			ssize_t bytesRead = read(hostFileDescriptor, buffer + filled, batchBytes - filled);
+			if (bytesRead == -1 && errno == EINTR) {
+				continue;
+			}
+			if (bytesRead == -1) {
+				perror("Failed to read host file");
+				free(buffer);
+				return false;
+			}
+			if (bytesRead == 0) {
+				break;
+			}
+			filled += bytesRead;
+		}
+		// The tail of the last cluster is zeroed instead of leaking old device content:
+		memset(buffer + filled, 0, batchBytes - filled);
+
+		writeClusters(volume, clusterIds + written, batchCount, buffer);
+		written += batchCount;
+	}
+
+	free(buffer);
+	return true;
+}
+
+int putFat12File(FAT12Volume* volume, const char* hostFilePath, const char* path) {
+	int hostFileDescriptor = open(hostFilePath, O_RDONLY | O_CLOEXEC);
+	if (hostFileDescriptor == -1) {
+		perror("Error opening host file");
+		return -1;
+	}
+	struct stat hostStat;
+	if (fstat(hostFileDescriptor, &hostStat) != 0 || !S_ISREG(hostStat.st_mode) ||
+		(uint64_t)hostStat.st_size > UINT32_MAX) {
+		(void)fprintf(stderr, "Host file is not a regular file below 4 GB: %s\n", hostFilePath);
+		close(hostFileDescriptor);
+		return -1;
+	}
+
+	FAT12Directory parent;
+	char fatName[11];
+	int64_t slotIndex;
+	if (!prepareNewEntry(volume, path, &parent, fatName, &slotIndex)) {
+		close(hostFileDescriptor);
+		return -1;
+	}
+
+	uint32_t fileSize = hostStat.st_size;
+	uint32_t clusterCount = (fileSize + volume->bytesPerCluster - 1) / volume->bytesPerCluster;
+	uint16_t* clusterIds = xmalloc((clusterCount ? clusterCount : 1) * sizeof(uint16_t));
+	bool isCopied = clusterCount == 0;
+	if (clusterCount && !allocateFat12Clusters(volume, clusterCount, clusterIds)) {
+		(void)fprintf(stderr, "Not enough free space for %s\n", path);
+	} else if (clusterCount) {
+		isCopied = copyHostFile(volume, hostFileDescriptor, clusterIds, clusterCount);
+	}
+	close(hostFileDescriptor);
+
+	if (isCopied) {
+		initNewEntry(&parent.entries[slotIndex], fatName, FAT12_ATTR_ARCHIVE,
+					 clusterCount ? clusterIds[0] : 0, fileSize);
+		queueDirectorySector(volume, &parent, slotIndex);
+	}
+	free(clusterIds);
+	freeDirectory(&parent);
+	return isCopied ? 0 : -1;
+}
+
+int makeFat12Directory(FAT12Volume* volume, const char* path) {
+	FAT12Directory parent;
+	char fatName[11];
+	int64_t slotIndex;
+	if (!prepareNewEntry(volume, path, &parent, fatName, &slotIndex)) {
+		return -1;
+	}
+
+	uint16_t clusterId;
+	if (!allocateFat12Clusters(volume, 1, &clusterId)) {
+		(void)fprintf(stderr, "Not enough free space for %s\n", path);
+		freeDirectory(&parent);
+		return -1;
+	}
+
+	FAT12DirectoryEntry* clusterEntries = calloc(1, volume->bytesPerCluster);
+	if (!clusterEntries) {
+		perror("");
+		exit(-1);
+	}
+	initNewEntry(&clusterEntries[0], ".          ", FAT12_ATTR_DIRECTORY, clusterId, 0);
+	// The root directory has no cluster, ".." of its children points to cluster 0:
+	initNewEntry(&clusterEntries[1], "..         ", FAT12_ATTR_DIRECTORY, parent.firstClusterId, 0);
+	writeClusters(volume, &clusterId, 1, (uint8_t*)clusterEntries);
+	free(clusterEntries);
+
+	initNewEntry(&parent.entries[slotIndex], fatName, FAT12_ATTR_DIRECTORY, clusterId, 0);
+	queueDirectorySector(volume, &parent, slotIndex);
+	freeDirectory(&parent);
+	return 0;
+}
+
+static bool isDirectoryEmpty(FAT12Directory* directory) {
+	for (uint32_t i = 0; i < directory->entriesCount; i++) {
+		FAT12DirectoryEntry* entry = &directory->entries[i];
+		if (isFinalDirectoryEntry(entry)) {
+			break;
+		}
+		if (!isDeletedEntry(entry) && !isDotDirectoryEntry(entry)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void pushClusterId(uint16_t** clusterIds, uint32_t* count, uint32_t* capacity,
+						  uint16_t clusterId) {
+	if (*count == *capacity) {
+		*capacity = *capacity ? *capacity * 2 : 8;
+		*clusterIds = xrealloc(*clusterIds, *capacity * sizeof(uint16_t));
+	}
+	(*clusterIds)[*count] = clusterId;
+	(*count)++;
+}
+
+void releaseFat12Cluster(FAT12Volume* volume, uint16_t clusterId) {
+	pushClusterId(&volume->pendingFreeClusters, &volume->pendingFreeClustersCount,
+				  &volume->pendingFreeClustersCapacity, clusterId);
+}
+
+/** Checksum of an 8.3 name that every long file name entry of it stores. */
+static uint8_t getShortNameChecksum(const char* fatName) {
+	uint8_t checksum = 0;
+	for (uint32_t i = 0; i < 11; i++) {
+		checksum = ((checksum & 1) << 7) + (checksum >> 1) + (uint8_t)fatName[i];
+	}
+	return checksum;
+}
+
+/** Deletes the long file name entries in front of the 8.3 entry at entryIndex. Only entries whose
+ * checksum matches the 8.3 name belong to it, the walk stops after the entry flagged as the last
+ * part of the name. */
+static void removeLongNameEntries(FAT12Volume* volume, FAT12Directory* directory,
+								  uint32_t entryIndex) {
+	const uint8_t CHECKSUM = getShortNameChecksum(directory->entries[entryIndex].fileName);
+
+	for (uint32_t i = entryIndex; i > 0; i--) {
+		FAT12DirectoryEntry* entry = &directory->entries[i - 1];
+		// The checksum is stored where 8.3 entries keep the creation time centiseconds:
+		if (entry->attributes != LONG_NAME_ATTRIBUTES || isDeletedEntry(entry) ||
+			entry->creationTimeCentiseconds != CHECKSUM) {
+			break;
+		}
+		bool isLastPart = entry->fileName[0] & LONG_NAME_LAST_ORDER_FLAG;
+		entry->fileName[0] = (char)DELETED_ENTRY;
+		queueDirectorySector(volume, directory, i - 1);
+		if (isLastPart) {
+			break;
+		}
+	}
+}
+
+int removeFat12Entry(FAT12Volume* volume, const char* path) {
+	char* parentPath;
+	char fatName[11];
+	if (!splitEntryPath(path, &parentPath, fatName)) {
+		return -1;
+	}
+	FAT12Directory parent;
+	bool isResolved = resolveDirectory(volume, parentPath, &parent);
+	free(parentPath);
+	if (!isResolved) {
+		return -1;
+	}
+
+	int64_t entryIndex = findDirectoryEntry(&parent, fatName);
+	if (entryIndex == -1) {
+		(void)fprintf(stderr, "Path does not exist: %s\n", path);
+		freeDirectory(&parent);
+		return -1;
+	}
+	FAT12DirectoryEntry* entry = &parent.entries[entryIndex];
+	if (isDirectoryEntryDirectory(entry)) {
+		FAT12Directory directory;
+		bool isValid = loadSubDirectory(volume, entry->firstClusterId, &directory);
+		bool isEmpty = isValid && isDirectoryEmpty(&directory);
+		freeDirectory(&directory);
+		if (!isEmpty) {
+			(void)fprintf(stderr, "Directory is not empty: %s\n", path);
+			freeDirectory(&parent);
+			return -1;
+		}
+	}
+
+	if (isDataClusterId(entry->firstClusterId, &volume->fat12Info)) {
+		pushClusterId(&volume->pendingFreeChains, &volume->pendingFreeChainsCount,
+					  &volume->pendingFreeChainsCapacity, entry->firstClusterId);
+	}
+	removeLongNameEntries(volume, &parent, entryIndex);
+	entry->fileName[0] = (char)DELETED_ENTRY;
+	queueDirectorySector(volume, &parent, entryIndex);
+	freeDirectory(&parent);
+	return 0;
+}
+
+/** Writes the dirty fat sectors to every fat copy, consecutive dirty sectors in a single write. */
+static void writeDirtyFatSectors(FAT12Volume* volume) {
+	const FAT12Info* info = &volume->fat12Info;
+
+	for (uint32_t copy = 0; copy < volume->fat12Header.tableCount; copy++) {
+		uint32_t copySectorOffset = info->fatSectionSectorOffset + copy * info->fatSectorSize;
+		uint32_t sector = 0;
+		while (sector < info->fatSectorSize) {
+			if (!volume->dirtyFatSectors[sector]) {
+				sector++;
+				continue;
+			}
+			uint32_t runStart = sector;
+			while (sector < info->fatSectorSize && volume->dirtyFatSectors[sector]) {
+				sector++;
+			}
+			pwriteDevice(volume->fat + (uint64_t)runStart * info->bytesPerSector,
+						 (uint64_t)(sector - runStart) * info->bytesPerSector,
+						 (int64_t)(copySectorOffset + runStart) * info->bytesPerSector,
+						 volume->fileDescriptor);
+		}
+	}
+	memset(volume->dirtyFatSectors, 0, info->fatSectorSize * sizeof(bool));
+}
+
+static void syncVolume(FAT12Volume* volume) {
+	if (fdatasync(volume->fileDescriptor) != 0) {
+		perror("Failed to sync loop device");
+		exit(-1);
+	}
+}
+
+void flushFat12Volume(FAT12Volume* volume) {
+	// Data clusters were written on allocation, fsync them before anything points to them:
+	syncVolume(volume);
+	writeDirtyFatSectors(volume);
+	syncVolume(volume);
+
+	for (uint32_t i = 0; i < volume->directoryWritesCount; i++) {
+		FAT12PendingWrite* write = &volume->directoryWrites[i];
+		pwriteDevice(write->data, write->bytes, (int64_t)write->offset, volume->fileDescriptor);
+		free(write->data);
+	}
+	volume->directoryWritesCount = 0;
+	syncVolume(volume);
+
+	if (volume->pendingFreeChainsCount == 0 && volume->pendingFreeClustersCount == 0) {
+		return;
+	}
+	for (uint32_t i = 0; i < volume->pendingFreeChainsCount; i++) {
+		uint16_t clusterId = volume->pendingFreeChains[i];
+		uint32_t freedCount = 0;
+		while (isDataClusterId(clusterId, &volume->fat12Info) &&
+			   freedCount < volume->fat12Info.clusterCount) {
+			uint16_t nextClusterId = getNextClusterId(clusterId, volume->fat);
+			setFat12VolumeEntry(volume, clusterId, FAT_FREE_CLUSTER);
+			clusterId = nextClusterId;
+			freedCount++;
+		}
+	}
+	volume->pendingFreeChainsCount = 0;
+	for (uint32_t i = 0; i < volume->pendingFreeClustersCount; i++) {
+		setFat12VolumeEntry(volume, volume->pendingFreeClusters[i], FAT_FREE_CLUSTER);
+	}
+	volume->pendingFreeClustersCount = 0;
+	writeDirtyFatSectors(volume);
+	syncVolume(volume);
+	// Freed clusters join the index only now, so nothing in this batch reused them:
+	buildFreeExtentIndex(volume);
+}
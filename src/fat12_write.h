@@ -0,0 +1,111 @@
+#pragma once
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "fat12.h"
+
+#define FAT12_ATTR_ARCHIVE 0x20
+#define FAT_FREE_CLUSTER 0x000
+
+/** A run of free clusters that follow each other on the device. */
+typedef struct FAT12Extent {
+	uint16_t firstClusterId;
+	uint16_t clusterCount;
+} FAT12Extent;
+
+/** A directory sector waiting to be written back by flushFat12Volume. */
+typedef struct FAT12PendingWrite {
+	uint64_t offset;
+	uint32_t bytes;
+	uint8_t* data;
+} FAT12PendingWrite;
+
+/**
+ * A FAT12 filesystem opened for writing. Changes are collected in memory, data clusters are written
+ * right away since they only ever go to free clusters, while fat sectors and directory sectors are
+ * marked dirty and written back together by flushFat12Volume.
+ */
+typedef struct FAT12Volume {
+	const char* loopDevicePath;
+	int fileDescriptor;
+	FAT12Header fat12Header;
+	FAT12Info fat12Info;
+	uint32_t bytesPerCluster;
+
+	uint8_t* fat;
+	bool* dirtyFatSectors;
+
+	// Free space index built from the fat, sorted by first cluster id:
+	FAT12Extent* freeExtents;
+	uint32_t freeExtentsCount;
+
+	FAT12PendingWrite* directoryWrites;
+	uint32_t directoryWritesCount;
+	uint32_t directoryWritesCapacity;
+
+	// Chains released by removals, freed in the fat only after the directory entries are gone:
+	uint16_t* pendingFreeChains;
+	uint32_t pendingFreeChainsCount;
+	uint32_t pendingFreeChainsCapacity;
+
+	// Single clusters released by relocations, freed in the same step as pendingFreeChains:
+	uint16_t* pendingFreeClusters;
+	uint32_t pendingFreeClustersCount;
+	uint32_t pendingFreeClustersCapacity;
+} FAT12Volume;
+
+/** Opens a FAT12 filesystem for writing and builds the free extent index from its fat.
+ * @param[out] volume Volume to initialize.
+ * @param[in] loopDevicePath
+ * @return 0 on success, -1 when the device can not be opened or is not a valid FAT12 filesystem.
+ */
+int openFat12Volume(FAT12Volume* volume, const char* loopDevicePath);
+
+/** Writes every pending change, in an order that keeps the filesystem consistent if the write back
+ * is interrupted at any point (at worst clusters are leaked, never shared or dangling):
+ * 1. fat sectors holding new allocations, to every fat copy.
+ * 2. directory sectors.
+ * 3. fat sectors of removed chains and released clusters, to every fat copy.
+ */
+void flushFat12Volume(FAT12Volume* volume);
+
+/** Releases the memory and file descriptor of volume, pending changes are dropped. */
+void closeFat12Volume(FAT12Volume* volume);
+
+/** Copies a host file into the filesystem. Clusters are allocated best fit from the free extent
+ * index so the file stays in a single extent whenever the free space allows it.
+ * @return 0 on success, -1 on failure (the reason is printed to stderr).
+ */
+int putFat12File(FAT12Volume* volume, const char* hostFilePath, const char* path);
+
+/** Creates an empty directory with its "." and ".." entries.
+ * @return 0 on success, -1 on failure.
+ */
+int makeFat12Directory(FAT12Volume* volume, const char* path);
+
+/** Removes a file or an empty directory and releases its clusters. The long file name entries of
+ * the file are removed with it.
+ * @return 0 on success, -1 on failure.
+ */
+int removeFat12Entry(FAT12Volume* volume, const char* path);
+
+/** Allocates clusterCount clusters and links them into a chain ending with FAT_LAST_CLUSTER_NUM.
+ * The smallest free extent that fits the whole chain is used, without one the largest extents are
+ * combined.
+ * @param[out] clusterIds Receives the cluster ids of the chain in order.
+ * @return false when there is not enough free space.
+ */
+bool allocateFat12Clusters(FAT12Volume* volume, uint32_t clusterCount, uint16_t* clusterIds);
+
+/** Sets a fat entry in memory and marks the sectors holding it dirty. */
+void setFat12VolumeEntry(FAT12Volume* volume, uint16_t clusterId, uint16_t nextClusterId);
+
+/** Queues a single cluster to be freed by the last step of flushFat12Volume, its fat entry is left
+ * untouched until then. */
+void releaseFat12Cluster(FAT12Volume* volume, uint16_t clusterId);
+
+/** Queues a change of the first cluster id of the directory entry at entryOffset, the sector
+ * holding it is written back with the other directory sectors by flushFat12Volume.
+ * @param[in] entryOffset Device byte offset of the directory entry.
+ */
+void setFat12EntryFirstCluster(FAT12Volume* volume, uint64_t entryOffset, uint16_t firstClusterId);
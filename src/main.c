@@ -1,9 +1,13 @@
+#include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "fat12.h"
 #include "fat12_api.h"
+#include "fat12_scan.h"
+#include "fat12_serve.h"
 
 void smallTest(const char* loopDevicePath) {
 	char* fileContent;
@@ -41,30 +45,141 @@ void lsPath(const char* loopDevicePath, const char* filePath) {
 	}
 	free((void*)names);
 }
+int grepPath(const char* loopDevicePath, const char* pattern, const char* path) {
+	initFat12Api(loopDevicePath);
+
+	// Exit status follows grep: 0 when something matched, 1 otherwise
+	return grepByPath(pattern, path) ? 0 : 1;
+}
+
+int findPath(const char* loopDevicePath, const char* path, int optionCount, char** options) {
+	FAT12FindFilter filter;
+	initFindFilter(&filter);
+	if (!parseFindFilter(&filter, optionCount, options)) {
+		return -1;
+	}
+
+	initFat12Api(loopDevicePath);
+	findByPath(path, &filter);
+	return 0;
+}
+
+int scanSource(int argc, char** argv) {
+	uint32_t workerCount = 0;
+	if (argc == 4) {
+		char* end;
+		workerCount = strtoul(argv[3], &end, 10);
+		if (*argv[3] == '\0' || *end != '\0') {
+			(void)fprintf(stderr, "scan: invalid worker count %s\n", argv[3]);
+			return -1;
+		}
+	}
+
+	return scanImages(argv[2], workerCount) ? 1 : 0;
+}
+
 void printHelpMenu() {
 	printf("Invalid usage:\n");
-	printf("Usage: FAT12Parser <loop_device_file> <command>\n\n");
+	printf("Usage: FAT12Parser [--direct] <loop_device_file> <command>\n");
+	printf("       FAT12Parser scan <images_dir_or_list> [workers]\n");
+	printf("       FAT12Parser serve <socket_path> <loop_device_file>...\n\n");
 	printf("Supported commands:\n");
 	printf("1. ls <dir_path>\n");
 	printf("2. cat <file_path>\n");
+	printf("3. grep <pattern> <path>\n");
+	printf("4. find <dir_path> [-type f|d] [-minsize N] [-maxsize N] [-attr MASK]\n");
+	printf("        [-noattr MASK] [-cluster ID] [-maxdepth N] [-cfrom DATE] [-cto DATE]\n");
+	printf("        [-mfrom DATE] [-mto DATE]\n");
+	printf("   DATE is YYYY-MM-DD or YYYY-MM-DDTHH:MM:SS\n");
+	printf("5. put <host_file> <file_path>\n");
+	printf("6. mkdir <dir_path>\n");
+	printf("7. rm <path>\n");
+	printf("8. defrag\n");
+	printf("9. diff <other_loop_device_file>\n");
+	printf("10. undelete <dir_path>\n");
+	printf("11. carve\n");
+	printf("\n--direct reads the device with O_DIRECT, bypassing the page cache.\n");
+	printf("scan and serve do not support it.\n");
+}
+
+static bool isCommand(const char* command, const char* expected) {
+	return strlen(command) == strlen(expected) && strcmp(command, expected) == 0;
 }
 
 int main(int argc, char** argv) {
-	if (argc != 4) {
+	const char DIRECT_OPTION[] = "--direct";
+	bool isDirect = argc > 1 && isCommand(argv[1], DIRECT_OPTION);
+	if (isDirect) {
+		setDeviceReadMode(DEVICE_READ_DIRECT);
+		argc--;
+		argv++;
+	}
+
+	// scan and serve open the images themselves and do not go through the device read mode:
+	const char SCAN_COMMAND[] = "scan";
+	const char SERVE_COMMAND[] = "serve";
+	if (isDirect && argc > 1 &&
+		(isCommand(argv[1], SCAN_COMMAND) || isCommand(argv[1], SERVE_COMMAND))) {
+		(void)fprintf(stderr, "%s: --direct is not supported, run it without --direct\n", argv[1]);
+		return -1;
+	}
+	if ((argc == 3 || argc == 4) && isCommand(argv[1], SCAN_COMMAND)) {
+		return scanSource(argc, argv);
+	}
+	if (argc >= 4 && isCommand(argv[1], SERVE_COMMAND)) {
+		return serveImages(argv[2], argv + 3, argc - 3) ? 1 : 0;
+	}
+	const char DEFRAG_COMMAND[] = "defrag";
+	if (argc == 3 && isCommand(argv[2], DEFRAG_COMMAND)) {
+		initFat12Api(argv[1]);
+		return defragFilesystem();
+	}
+	const char CARVE_COMMAND[] = "carve";
+	if (argc == 3 && isCommand(argv[2], CARVE_COMMAND)) {
+		initFat12Api(argv[1]);
+		carveFilesystem();
+		return 0;
+	}
+	if (argc < 4) {
 		printHelpMenu();
 		exit(-1);
 	}
 
 	const char LS_COMMAND[] = "ls";
 	const char CAT_COMMAND[] = "cat";
+	const char GREP_COMMAND[] = "grep";
+	const char FIND_COMMAND[] = "find";
+	const char PUT_COMMAND[] = "put";
+	const char MKDIR_COMMAND[] = "mkdir";
+	const char RM_COMMAND[] = "rm";
+	const char DIFF_COMMAND[] = "diff";
+	const char UNDELETE_COMMAND[] = "undelete";
 	char* loopDevicePath = argv[1];
 	char* command = argv[2];
-	char* path = argv[3];
 
-	if (strlen(command) == strlen(LS_COMMAND) && strcmp(command, LS_COMMAND) == 0) {
-		lsPath(loopDevicePath, path);
-	} else if (strlen(command) == strlen(CAT_COMMAND) && strcmp(command, CAT_COMMAND) == 0) {
-		catFile(loopDevicePath, path);
+	if (argc == 4 && isCommand(command, LS_COMMAND)) {
+		lsPath(loopDevicePath, argv[3]);
+	} else if (argc == 4 && isCommand(command, CAT_COMMAND)) {
+		catFile(loopDevicePath, argv[3]);
+	} else if (argc == 5 && isCommand(command, GREP_COMMAND)) {
+		return grepPath(loopDevicePath, argv[3], argv[4]);
+	} else if (isCommand(command, FIND_COMMAND)) {
+		return findPath(loopDevicePath, argv[3], argc - 4, argv + 4);
+	} else if (argc == 5 && isCommand(command, PUT_COMMAND)) {
+		initFat12Api(loopDevicePath);
+		return putFileByPath(argv[3], argv[4]);
+	} else if (argc == 4 && isCommand(command, MKDIR_COMMAND)) {
+		initFat12Api(loopDevicePath);
+		return makeDirectoryByPath(argv[3]);
+	} else if (argc == 4 && isCommand(command, RM_COMMAND)) {
+		initFat12Api(loopDevicePath);
+		return removeByPath(argv[3]);
+	} else if (argc == 4 && isCommand(command, DIFF_COMMAND)) {
+		initFat12Api(loopDevicePath);
+		return diffWithImage(argv[3]);
+	} else if (argc == 4 && isCommand(command, UNDELETE_COMMAND)) {
+		initFat12Api(loopDevicePath);
+		undeleteByPath(argv[3]);
 	} else {
 		printHelpMenu();
 		exit(-1);